@@ -0,0 +1,218 @@
+#include <algorithm>
+
+#include "auction.h"
+
+size_t CAuction::solve(const graph& g, std::vector<int32_t>& vecAssigned, CThreadTeam& team)
+{
+	vecAssigned.assign(g.nBidders, nUnassigned);
+	m_vecPrices.assign(g.nObjects, 0);
+	m_vecOwners.assign(g.nObjects, nUnassigned);
+	m_vecWinning.assign(g.nObjects, nUnassigned);
+	m_nRounds = 0;
+
+	int64_t nMaxBenefit = 0;
+	for (int64_t nBenefit : g.vecBenefits)
+		nMaxBenefit = std::max(nMaxBenefit, nBenefit);
+	if (nMaxBenefit <= 0)
+		return 0;
+
+	// Each phase keeps the prices of the one before and starts the
+	// assignment over. Starting coarser than this pushes prices up so far
+	// that settle() has more to undo than the phases saved
+	int64_t nEps = std::max<int64_t>(1, nMaxBenefit / 1024);
+	for (;;)
+	{
+		runPhase(g, nEps, vecAssigned, team);
+		if (nEps == 1)
+			break;
+		nEps = std::max<int64_t>(1, nEps / 6);
+	}
+
+	settle(g, vecAssigned);
+	return m_nRounds;
+}
+
+void CAuction::runPhase(const graph& g, int64_t nEps, std::vector<int32_t>& vecAssigned, CThreadTeam& team)
+{
+	std::fill(vecAssigned.begin(), vecAssigned.end(), nUnassigned);
+	std::fill(m_vecOwners.begin(), m_vecOwners.end(), nUnassigned);
+
+	m_vecQueue.clear();
+	for (size_t b = 0; b < g.nBidders; b++)
+	{
+		if (g.vecOffsets[b] != g.vecOffsets[b + 1])
+			m_vecQueue.push_back(uint32_t(b));
+	}
+
+	CThreadTeam::range_t fnBid = [&](size_t nBegin, size_t nEnd)
+	{
+		for (size_t i = nBegin; i < nEnd; i++)
+		{
+			uint32_t b = m_vecQueue[i];
+
+			// Staying out is worth 0 and competes like any other object
+			int32_t nBest = nUnassigned;
+			int64_t nFirst = 0;
+			int64_t nSecond = 0;
+			for (uint32_t e = g.vecOffsets[b]; e < g.vecOffsets[b + 1]; e++)
+			{
+				int64_t nValue = g.vecBenefits[e] - m_vecPrices[g.vecObjects[e]];
+				if (nValue > nFirst)
+				{
+					nSecond = nFirst;
+					nFirst = nValue;
+					nBest = int32_t(g.vecObjects[e]);
+				}
+				else if (nValue > nSecond)
+				{
+					nSecond = nValue;
+				}
+			}
+
+			m_vecBidObjects[i] = nBest;
+			if (nBest != nUnassigned)
+				m_vecBids[i] = m_vecPrices[nBest] + nFirst - nSecond + nEps;
+		}
+	};
+
+	while (!m_vecQueue.empty())
+	{
+		m_nRounds++;
+		m_vecBidObjects.resize(m_vecQueue.size());
+		m_vecBids.resize(m_vecQueue.size());
+		team.run(m_vecQueue.size(), nChunk, fnBid);
+
+		// Prices only move here, between rounds, so every bid of a round
+		// saw the same ones. Ties go to the earlier bidder in the queue
+		m_vecTouched.clear();
+		for (size_t i = 0; i < m_vecQueue.size(); i++)
+		{
+			int32_t o = m_vecBidObjects[i];
+			if (o == nUnassigned)
+				continue;
+
+			int32_t& nWinning = m_vecWinning[o];
+			if (nWinning == nUnassigned)
+			{
+				nWinning = int32_t(i);
+				m_vecTouched.push_back(uint32_t(o));
+			}
+			else if (m_vecBids[i] > m_vecBids[nWinning])
+			{
+				nWinning = int32_t(i);
+			}
+		}
+
+		m_vecNext.clear();
+		for (size_t i = 0; i < m_vecQueue.size(); i++)
+		{
+			int32_t o = m_vecBidObjects[i];
+			if (o != nUnassigned && m_vecWinning[o] != int32_t(i))
+				m_vecNext.push_back(m_vecQueue[i]);
+		}
+
+		for (uint32_t o : m_vecTouched)
+		{
+			uint32_t nWinner = m_vecQueue[m_vecWinning[o]];
+			int32_t nOld = m_vecOwners[o];
+			if (nOld != nUnassigned)
+			{
+				vecAssigned[nOld] = nUnassigned;
+				m_vecNext.push_back(uint32_t(nOld));
+			}
+
+			m_vecOwners[o] = int32_t(nWinner);
+			vecAssigned[nWinner] = int32_t(o);
+			m_vecPrices[o] = m_vecBids[m_vecWinning[o]];
+			m_vecWinning[o] = nUnassigned;
+		}
+
+		m_vecQueue.swap(m_vecNext);
+	}
+}
+
+void CAuction::settle(const graph& g, std::vector<int32_t>& vecAssigned)
+{
+	m_vecQueue.clear();
+	for (size_t o = 0; o < g.nObjects; o++)
+	{
+		if (m_vecOwners[o] == nUnassigned && m_vecPrices[o] > 0)
+			m_vecQueue.push_back(uint32_t(o));
+	}
+	if (m_vecQueue.empty())
+		return;
+
+	m_vecObjectOffsets.assign(g.nObjects + 1, 0);
+	for (uint32_t o : g.vecObjects)
+		m_vecObjectOffsets[o + 1]++;
+	for (size_t o = 0; o < g.nObjects; o++)
+		m_vecObjectOffsets[o + 1] += m_vecObjectOffsets[o];
+
+	m_vecObjectBidders.resize(g.vecObjects.size());
+	m_vecObjectBenefits.resize(g.vecObjects.size());
+	// m_vecTouched is free once the phases are over, here it is where
+	// each object's next edge goes
+	m_vecTouched.assign(m_vecObjectOffsets.begin(), m_vecObjectOffsets.end() - 1);
+	m_vecProfits.assign(g.nBidders, 0);
+	for (size_t b = 0; b < g.nBidders; b++)
+	{
+		for (uint32_t e = g.vecOffsets[b]; e < g.vecOffsets[b + 1]; e++)
+		{
+			uint32_t o = g.vecObjects[e];
+			uint32_t i = m_vecTouched[o]++;
+			m_vecObjectBidders[i] = uint32_t(b);
+			m_vecObjectBenefits[i] = g.vecBenefits[e];
+
+			if (vecAssigned[b] == int32_t(o))
+				m_vecProfits[b] = g.vecBenefits[e] - m_vecPrices[o];
+		}
+	}
+
+	// An object offers itself to the bidder that gains most by switching,
+	// at a price that keeps it worth no more than eps above the runner up.
+	// Staying unsold at price 0 is always open to it
+	while (!m_vecQueue.empty())
+	{
+		m_nRounds++;
+		uint32_t o = m_vecQueue.back();
+		m_vecQueue.pop_back();
+
+		int32_t nBest = nUnassigned;
+		int64_t nFirst = 0;
+		int64_t nSecond = 0;
+		for (uint32_t i = m_vecObjectOffsets[o]; i < m_vecObjectOffsets[o + 1]; i++)
+		{
+			int64_t nGain = m_vecObjectBenefits[i] - m_vecProfits[m_vecObjectBidders[i]];
+			if (nBest == nUnassigned || nGain > nFirst)
+			{
+				nSecond = nBest == nUnassigned ? 0 : nFirst;
+				nFirst = nGain;
+				nBest = int32_t(m_vecObjectBidders[i]);
+			}
+			else if (nGain > nSecond)
+			{
+				nSecond = nGain;
+			}
+		}
+
+		if (nBest == nUnassigned || nFirst < 1)
+		{
+			m_vecPrices[o] = 0;
+			continue;
+		}
+
+		int64_t nPrice = std::max<int64_t>(0, nSecond - 1);
+		int32_t nOld = vecAssigned[nBest];
+		if (nOld != nUnassigned)
+		{
+			m_vecOwners[nOld] = nUnassigned;
+			if (m_vecPrices[nOld] > 0)
+				m_vecQueue.push_back(uint32_t(nOld));
+		}
+
+		vecAssigned[nBest] = int32_t(o);
+		m_vecOwners[o] = nBest;
+		m_vecPrices[o] = nPrice;
+		m_vecProfits[nBest] = nFirst + m_vecProfits[nBest] - nPrice;
+	}
+}
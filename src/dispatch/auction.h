@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "thread_team.h"
+
+// Maximum weight assignment on a sparse bipartite graph by the auction
+// algorithm. Bidders get at most one object each and an object at most one
+// bidder; a bidder may also stay out, which is worth 0 to it, so only edges
+// with a positive benefit ever get used.
+//
+// Unassigned bidders bid in rounds, Jacobi style: all of them pick their
+// best object against the current prices at once, on the thread team, then
+// the highest bid on every object wins it and pushes out its old owner.
+// Prices go up by at least eps per bid, and eps shrinks over a few phases
+// so the early ones settle prices coarsely and cheaply.
+//
+// Prices carried over from coarse phases can leave objects nobody took at
+// a price that keeps bidders away from them, which forward bidding alone
+// never undoes when there are more objects than bidders. So at the end
+// such objects bid for bidders in turn (a reverse auction), lowering their
+// price until they are taken or free. With integer benefits scaled by
+// (bidders + 1) and eps 1 at the end, the result is then optimal.
+class CAuction
+{
+	public:
+		// Edges of bidder b are [vecOffsets[b], vecOffsets[b + 1]) in
+		// vecObjects and vecBenefits
+		struct graph
+		{
+			size_t nBidders = 0;
+			size_t nObjects = 0;
+			std::vector<uint32_t> vecOffsets;
+			std::vector<uint32_t> vecObjects;
+			std::vector<int64_t> vecBenefits;
+		};
+
+		static constexpr int32_t nUnassigned = -1;
+
+		// Bidders per chunk on the team, below that a round runs inline
+		static constexpr size_t nChunk = 256;
+
+		// Fills vecAssigned with the object of every bidder, or nUnassigned.
+		// The buffers are kept between calls. Returns the number of rounds
+		size_t solve(const graph& g, std::vector<int32_t>& vecAssigned, CThreadTeam& team);
+
+	private:
+		void runPhase(const graph& g, int64_t nEps, std::vector<int32_t>& vecAssigned, CThreadTeam& team);
+
+		// The reverse auction at eps 1 for objects left unassigned with a
+		// price. Serial, few objects need it
+		void settle(const graph& g, std::vector<int32_t>& vecAssigned);
+
+		std::vector<int64_t> m_vecPrices;
+		std::vector<int32_t> m_vecOwners;
+
+		// Unassigned bidders of this round and the next
+		std::vector<uint32_t> m_vecQueue;
+		std::vector<uint32_t> m_vecNext;
+
+		// What each queued bidder bid this round, by queue position
+		std::vector<int32_t> m_vecBidObjects;
+		std::vector<int64_t> m_vecBids;
+
+		// Highest bid on each object this round, by queue position, and
+		// the objects that got any
+		std::vector<int32_t> m_vecWinning;
+		std::vector<uint32_t> m_vecTouched;
+
+		// For settle(): the edges again by object, and what each bidder
+		// makes on its object at current prices
+		std::vector<uint32_t> m_vecObjectOffsets;
+		std::vector<uint32_t> m_vecObjectBidders;
+		std::vector<int64_t> m_vecObjectBenefits;
+		std::vector<int64_t> m_vecProfits;
+
+		size_t m_nRounds = 0;
+};
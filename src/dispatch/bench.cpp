@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <unordered_set>
+
+#include "matcher.h"
+
+// One rush hour window: 10k requests against 2k free vehicles over a
+// 20 km square, most requests bunched around a few hot spots. Times the
+// matcher at a few thread counts and compares its result with greedy
+// nearest-first in arrival order.
+namespace
+{
+	constexpr size_t nRequests = 10000;
+	constexpr size_t nVehicles = 2000;
+	constexpr size_t nRepeats = 5;
+
+	// Moscow, where 0.18 degrees of latitude and 0.32 of longitude are both
+	// about 20 km
+	constexpr int32_t nCenterLat = 557500000;
+	constexpr int32_t nCenterLon = 376000000;
+	constexpr int32_t nHalfLat = 900000;
+	constexpr int32_t nHalfLon = 1600000;
+
+	struct greedy_result
+	{
+		size_t nMatched = 0;
+		uint64_t nTotalEta = 0;
+		double fMillis = 0.0;
+	};
+
+	greedy_result greedy(const CSpatialGrid& grid, const std::vector<pickup_request>& vecBatch)
+	{
+		greedy_result result;
+		std::unordered_set<uint32_t> setBusy;
+		std::vector<spatial_hit> vecHits;
+
+		auto started = std::chrono::steady_clock::now();
+		for (const pickup_request& request : vecBatch)
+		{
+			grid.nearest(request.nLat, request.nLon, 4 * CMatcher::nCandidates, vecHits, CMatcher::fSearchMeters);
+			for (const spatial_hit& hit : vecHits)
+			{
+				// Same estimate as the matcher's default
+				uint32_t nEta = uint32_t(double(hit.fMeters) * 1.3 / 8.3);
+				if (nEta > CMatcher::nMaxEta || setBusy.count(hit.nId))
+					continue;
+
+				setBusy.insert(hit.nId);
+				result.nMatched++;
+				result.nTotalEta += nEta;
+				break;
+			}
+		}
+		result.fMillis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+		return result;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::mt19937 rng(2024);
+	std::uniform_int_distribution<int32_t> lat(-nHalfLat, nHalfLat);
+	std::uniform_int_distribution<int32_t> lon(-nHalfLon, nHalfLon);
+	std::normal_distribution<double> spread(0.0, 130000.0);
+
+	CSpatialGrid grid;
+	for (uint32_t v = 0; v < nVehicles; v++)
+		grid.update(v + 1, nCenterLat + lat(rng), nCenterLon + lon(rng), 0);
+
+	int32_t aSpotLat[5], aSpotLon[5];
+	for (size_t i = 0; i < 5; i++)
+	{
+		aSpotLat[i] = nCenterLat + lat(rng) / 2;
+		aSpotLon[i] = nCenterLon + lon(rng) / 2;
+	}
+
+	std::vector<pickup_request> vecRequests(nRequests);
+	for (size_t r = 0; r < nRequests; r++)
+	{
+		pickup_request& request = vecRequests[r];
+		request.nRequest = uint32_t(r + 1);
+		if (r % 5 < 3)
+		{
+			request.nLat = aSpotLat[r % 5] + int32_t(spread(rng));
+			request.nLon = aSpotLon[r % 5] + int32_t(spread(rng) * 1.8);
+		}
+		else
+		{
+			request.nLat = nCenterLat + lat(rng);
+			request.nLon = nCenterLon + lon(rng);
+		}
+	}
+
+	greedy_result g = greedy(grid, vecRequests);
+	std::printf("%zu requests x %zu vehicles\n", nRequests, nVehicles);
+	std::printf("greedy    matched %zu, mean eta %.1f s, %.1f ms\n",
+		g.nMatched, double(g.nTotalEta) / double(g.nMatched), g.fMillis);
+
+	std::vector<size_t> vecThreads;
+	if (argc > 1)
+	{
+		vecThreads.push_back(size_t(std::atoi(argv[1])));
+	}
+	else
+	{
+		size_t nMax = std::max<size_t>(1, std::thread::hardware_concurrency());
+		for (size_t n = 1; n < nMax; n *= 2)
+			vecThreads.push_back(n);
+		vecThreads.push_back(nMax);
+	}
+
+	for (size_t nThreads : vecThreads)
+	{
+		std::vector<double> vecMillis;
+		match_report report;
+		for (size_t i = 0; i < nRepeats; i++)
+		{
+			// A fresh matcher each time, the last one left its vehicles busy
+			CMatcher matcher(grid, nThreads, nullptr);
+			std::vector<pickup_request> vecBatch = vecRequests;
+			std::vector<pickup_assignment> vecOut;
+
+			report = matcher.match(vecBatch, vecOut);
+			vecMillis.push_back(double(report.nCandidateNanos + report.nSolveNanos) / 1e6);
+		}
+		std::sort(vecMillis.begin(), vecMillis.end());
+
+		std::printf("auction   %2zu threads: matched %zu, mean eta %.1f s, %zu edges, %zu rounds, "
+			"median %.1f ms (candidates %.1f, auction %.1f)\n",
+			nThreads, report.nMatched, double(report.nTotalEta) / double(report.nMatched), report.nEdges,
+			report.nRounds, vecMillis[nRepeats / 2], double(report.nCandidateNanos) / 1e6, double(report.nSolveNanos) / 1e6);
+	}
+	return 0;
+}
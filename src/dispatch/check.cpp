@@ -0,0 +1,226 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <random>
+#include <vector>
+
+#include "auction.h"
+#include "matcher.h"
+
+// Self checks, run by ctest: the auction against brute force on small
+// graphs, and the matcher's busy vehicles coming free again. Prints what
+// failed and exits non-zero.
+namespace
+{
+	size_t g_nFailed = 0;
+
+	void check(bool bOk, const char* pWhat)
+	{
+		if (!bOk)
+		{
+			std::printf("FAIL: %s\n", pWhat);
+			g_nFailed++;
+		}
+	}
+
+	// Best total benefit with bidders from b on, every object at most once
+	int64_t bestFrom(const CAuction::graph& g, size_t b, std::vector<bool>& vecTaken)
+	{
+		if (b == g.nBidders)
+			return 0;
+
+		// Staying out is worth 0
+		int64_t nBest = bestFrom(g, b + 1, vecTaken);
+		for (uint32_t e = g.vecOffsets[b]; e < g.vecOffsets[b + 1]; e++)
+		{
+			uint32_t o = g.vecObjects[e];
+			if (vecTaken[o])
+				continue;
+
+			vecTaken[o] = true;
+			nBest = std::max(nBest, g.vecBenefits[e] + bestFrom(g, b + 1, vecTaken));
+			vecTaken[o] = false;
+		}
+		return nBest;
+	}
+
+	void checkAuction()
+	{
+		std::mt19937 rng(7);
+		CAuction auction;
+		CThreadTeam team(2);
+		std::vector<int32_t> vecAssigned;
+
+		for (size_t nCase = 0; nCase < 2000; nCase++)
+		{
+			CAuction::graph g;
+			g.nBidders = 1 + rng() % 7;
+			g.nObjects = 1 + rng() % 7;
+			int64_t nScale = int64_t(g.nBidders) + 1;
+
+			// Sparse, with ties now and then, like candidate ETAs
+			g.vecOffsets.push_back(0);
+			for (size_t b = 0; b < g.nBidders; b++)
+			{
+				for (uint32_t o = 0; o < g.nObjects; o++)
+				{
+					if (rng() % 2)
+						continue;
+					g.vecObjects.push_back(o);
+					g.vecBenefits.push_back(int64_t(1 + rng() % 20) * nScale);
+				}
+				g.vecOffsets.push_back(uint32_t(g.vecObjects.size()));
+			}
+
+			auction.solve(g, vecAssigned, team);
+
+			// A matching over existing edges...
+			bool bValid = vecAssigned.size() == g.nBidders;
+			std::vector<bool> vecTaken(g.nObjects, false);
+			int64_t nTotal = 0;
+			for (size_t b = 0; bValid && b < g.nBidders; b++)
+			{
+				if (vecAssigned[b] == CAuction::nUnassigned)
+					continue;
+
+				uint32_t o = uint32_t(vecAssigned[b]);
+				bool bEdge = false;
+				for (uint32_t e = g.vecOffsets[b]; e < g.vecOffsets[b + 1]; e++)
+				{
+					if (g.vecObjects[e] == o)
+					{
+						bEdge = true;
+						nTotal += g.vecBenefits[e];
+					}
+				}
+				bValid = bEdge && !vecTaken[o];
+				vecTaken[o] = true;
+			}
+			check(bValid, "auction assigns along edges, each object once");
+
+			// ...and as good as any
+			std::fill(vecTaken.begin(), vecTaken.end(), false);
+			if (bValid)
+				check(nTotal == bestFrom(g, 0, vecTaken), "auction total benefit is optimal");
+		}
+	}
+
+	// Collects what the window thread assigns
+	struct assignments
+	{
+		std::mutex mx;
+		std::condition_variable cv;
+		std::vector<pickup_assignment> vec;
+
+		void add(const pickup_assignment& assignment)
+		{
+			std::lock_guard<std::mutex> lock(mx);
+			vec.push_back(assignment);
+			cv.notify_all();
+		}
+
+		// Waits until there are nCount, false if they do not come in time
+		bool waitFor(size_t nCount, std::chrono::milliseconds timeout)
+		{
+			std::unique_lock<std::mutex> lock(mx);
+			return cv.wait_for(lock, timeout, [&]() { return vec.size() >= nCount; });
+		}
+
+		pickup_assignment at(size_t i)
+		{
+			std::lock_guard<std::mutex> lock(mx);
+			return vec[i];
+		}
+
+		size_t size()
+		{
+			std::lock_guard<std::mutex> lock(mx);
+			return vec.size();
+		}
+	};
+
+	uint64_t steadyMillis()
+	{
+		return uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	void checkMatcher()
+	{
+		const std::chrono::milliseconds wait(2000);
+		const std::chrono::milliseconds quiet(3 * CMatcher::nWindowMs);
+
+		// Two vehicles a few hundred metres from the requests
+		CSpatialGrid grid;
+		grid.update(1, 557500000, 376000000, steadyMillis());
+		grid.update(2, 557530000, 376000000, steadyMillis());
+
+		assignments got;
+		CMatcher matcher(grid, 1, [&](const pickup_assignment& assignment) { got.add(assignment); });
+		matcher.start();
+
+		auto request = [&](uint64_t nTag, uint32_t nRequest)
+		{
+			pickup_request r;
+			r.nTag = nTag;
+			r.nRequest = nRequest;
+			r.nLat = 557510000;
+			r.nLon = 376000000;
+			r.nArrived = steadyMillis();
+			matcher.submit(r);
+		};
+
+		request(1, 1);
+		request(1, 2);
+		check(got.waitFor(2, wait), "both vehicles assigned");
+		check(got.size() == 2 && got.at(0).bMatched && got.at(1).bMatched
+			&& got.at(0).nVehicle != got.at(1).nVehicle, "two requests get two different vehicles");
+
+		// Both busy, the next one waits
+		request(2, 3);
+		check(!got.waitFor(3, quiet), "no vehicle while both are busy");
+
+		// Done with the first trip, its vehicle takes the waiting request
+		uint32_t nFirst = got.at(0).nVehicle;
+		matcher.release(nFirst);
+		check(got.waitFor(3, wait), "released vehicle is assigned again");
+		check(got.size() == 3 && got.at(2).nRequest == 3 && got.at(2).nVehicle == nFirst, "the waiting request gets the released vehicle");
+
+		// A cancelled request is never assigned, even once a vehicle is free
+		request(3, 4);
+		matcher.cancel(3, 4);
+		check(!got.waitFor(4, quiet), "cancelled request is dropped");
+
+		// Cancelling an assigned request frees its vehicle
+		uint32_t nSecond = got.at(1).nVehicle;
+		matcher.cancel(1, 2);
+		request(3, 5);
+		check(got.waitFor(4, wait), "vehicle of a cancelled request is free again");
+		check(got.size() == 4 && got.at(3).nRequest == 5 && got.at(3).nVehicle == nSecond, "the next request gets it");
+
+		// Everything of a caller that went away is dropped
+		request(4, 6);
+		request(4, 7);
+		matcher.cancelAll(4);
+		matcher.release(nFirst);
+		check(!got.waitFor(5, quiet), "requests of a gone caller are dropped");
+
+		matcher.stop();
+	}
+}
+
+int main()
+{
+	checkAuction();
+	checkMatcher();
+
+	if (g_nFailed != 0)
+	{
+		std::printf("%zu checks failed\n", g_nFailed);
+		return 1;
+	}
+	std::printf("dispatch: all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,340 @@
+#include <algorithm>
+#include <chrono>
+
+#include "matcher.h"
+
+namespace
+{
+	// Roads are longer than the straight line, and 30 km/h is about what a
+	// city manages
+	constexpr double fDetour = 1.3;
+	constexpr double fMetersPerSecond = 8.3;
+
+	// Requests per chunk on the team
+	constexpr size_t nRequestChunk = 64;
+
+	uint64_t nowNanos()
+	{
+		return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	void straightLine(int32_t, int32_t, const spatial_hit* pFrom, size_t nFrom, uint32_t* pSeconds)
+	{
+		for (size_t i = 0; i < nFrom; i++)
+			pSeconds[i] = uint32_t(double(pFrom[i].fMeters) * fDetour / fMetersPerSecond);
+	}
+}
+
+CMatcher::CMatcher(CSpatialGrid& grid, size_t nThreads, assigned_t fnAssigned, eta_t fnEta)
+	: m_grid(grid), m_team(nThreads), m_fnAssigned(std::move(fnAssigned)), m_fnEta(std::move(fnEta))
+{
+	if (!m_fnEta)
+		m_fnEta = straightLine;
+}
+
+CMatcher::~CMatcher()
+{
+	stop();
+}
+
+bool CMatcher::start()
+{
+	std::lock_guard<std::mutex> lock(m_mxPending);
+	if (m_bRunning)
+		return false;
+
+	m_bRunning = true;
+	m_threadWindows = std::thread([this]() { runWindows(); });
+	return true;
+}
+
+void CMatcher::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mxPending);
+		m_bRunning = false;
+	}
+	m_cvPending.notify_all();
+
+	if (m_threadWindows.joinable())
+		m_threadWindows.join();
+}
+
+void CMatcher::submit(const pickup_request& request)
+{
+	std::lock_guard<std::mutex> lock(m_mxPending);
+	m_vecPending.push_back(request);
+}
+
+void CMatcher::release(uint32_t nVehicle)
+{
+	std::lock_guard<std::mutex> lock(m_mxPending);
+	m_vecReleased.push_back(nVehicle);
+}
+
+void CMatcher::cancel(uint64_t nTag, uint32_t nRequest)
+{
+	std::lock_guard<std::mutex> lock(m_mxPending);
+	m_vecCancelled.emplace_back(nTag, nRequest);
+}
+
+void CMatcher::cancelAll(uint64_t nTag)
+{
+	std::lock_guard<std::mutex> lock(m_mxPending);
+	m_vecGone.push_back(nTag);
+}
+
+void CMatcher::runWindows()
+{
+	std::vector<pickup_request> vecArrived;
+	std::vector<uint32_t> vecReleased;
+	std::vector<std::pair<uint64_t, uint32_t>> vecCancelled;
+	std::vector<uint64_t> vecGone;
+	std::vector<pickup_assignment> vecOut;
+	uint64_t nExpired = nowNanos() / 1000000;
+
+	auto next = std::chrono::steady_clock::now() + std::chrono::milliseconds(nWindowMs);
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mxPending);
+			m_cvPending.wait_until(lock, next, [this]() { return !m_bRunning; });
+			if (!m_bRunning)
+				return;
+
+			vecArrived.swap(m_vecPending);
+			vecReleased.swap(m_vecReleased);
+			vecCancelled.swap(m_vecCancelled);
+			vecGone.swap(m_vecGone);
+		}
+
+		for (uint32_t nVehicle : vecReleased)
+			m_mapBusy.erase(nVehicle);
+		vecReleased.clear();
+
+		m_vecWaiting.insert(m_vecWaiting.end(), vecArrived.begin(), vecArrived.end());
+		vecArrived.clear();
+
+		// Cancels are rare, looking through both is fine
+		for (const auto& cancelled : vecCancelled)
+		{
+			auto it = std::find_if(m_vecWaiting.begin(), m_vecWaiting.end(), [&](const pickup_request& request)
+			{
+				return request.nTag == cancelled.first && request.nRequest == cancelled.second;
+			});
+			if (it != m_vecWaiting.end())
+			{
+				m_vecWaiting.erase(it);
+				continue;
+			}
+
+			for (auto itBusy = m_mapBusy.begin(); itBusy != m_mapBusy.end(); ++itBusy)
+			{
+				if (itBusy->second.nTag == cancelled.first && itBusy->second.nRequest == cancelled.second)
+				{
+					m_mapBusy.erase(itBusy);
+					break;
+				}
+			}
+		}
+		vecCancelled.clear();
+
+		if (!vecGone.empty())
+		{
+			auto it = std::remove_if(m_vecWaiting.begin(), m_vecWaiting.end(), [&](const pickup_request& request)
+			{
+				return std::find(vecGone.begin(), vecGone.end(), request.nTag) != vecGone.end();
+			});
+			m_vecWaiting.erase(it, m_vecWaiting.end());
+			vecGone.clear();
+		}
+
+		vecOut.clear();
+		if (!m_vecWaiting.empty())
+			m_lastReport = match(m_vecWaiting, vecOut);
+
+		for (const pickup_assignment& assignment : vecOut)
+			m_fnAssigned(assignment);
+
+		// Whoever waited too long is told so and dropped
+		uint64_t nNow = nowNanos() / 1000000;
+		auto it = std::remove_if(m_vecWaiting.begin(), m_vecWaiting.end(), [&](const pickup_request& request)
+		{
+			if (nNow - request.nArrived < nGiveUpAfterMs)
+				return false;
+
+			pickup_assignment assignment;
+			assignment.nRequest = request.nRequest;
+			assignment.nTag = request.nTag;
+			m_fnAssigned(assignment);
+			return true;
+		});
+		m_vecWaiting.erase(it, m_vecWaiting.end());
+
+		// Vehicles that have gone quiet are not offered anymore
+		if (nNow - nExpired >= nExpireEveryMs)
+		{
+			if (nNow > nStaleAfterMs)
+				m_grid.removeOlderThan(nNow - nStaleAfterMs);
+
+			// So are vehicles that were never released
+			for (auto itBusy = m_mapBusy.begin(); itBusy != m_mapBusy.end();)
+			{
+				if (nNow - itBusy->second.nSince >= nBusyForMs)
+					itBusy = m_mapBusy.erase(itBusy);
+				else
+					++itBusy;
+			}
+			nExpired = nNow;
+		}
+
+		// A window that ran over starts the next one right away
+		next += std::chrono::milliseconds(nWindowMs);
+		auto now = std::chrono::steady_clock::now();
+		if (next < now)
+			next = now;
+	}
+}
+
+void CMatcher::findCandidates(const pickup_request& request, size_t r, std::vector<spatial_hit>& vecHits)
+{
+	// Ask for more than needed when some vehicles are busy, they are
+	// filtered out below
+	size_t k = nCandidates + std::min(m_mapBusy.size(), 3 * nCandidates);
+	m_grid.nearest(request.nLat, request.nLon, k, vecHits, fSearchMeters);
+
+	auto it = std::remove_if(vecHits.begin(), vecHits.end(), [this](const spatial_hit& hit)
+	{
+		return m_mapBusy.count(hit.nId) != 0;
+	});
+	vecHits.erase(it, vecHits.end());
+	if (vecHits.size() > nCandidates)
+		vecHits.resize(nCandidates);
+
+	uint32_t aEta[nCandidates];
+	m_fnEta(request.nLat, request.nLon, vecHits.data(), vecHits.size(), aEta);
+
+	candidate* pSlots = &m_vecCandidates[r * nCandidates];
+	uint8_t nCount = 0;
+	for (size_t i = 0; i < vecHits.size(); i++)
+	{
+		if (aEta[i] <= nMaxEta)
+			pSlots[nCount++] = { vecHits[i].nId, aEta[i], 0 };
+	}
+	m_vecCandidateCounts[r] = nCount;
+}
+
+match_report CMatcher::match(std::vector<pickup_request>& vecBatch, std::vector<pickup_assignment>& vecOut)
+{
+	match_report report;
+	report.nRequests = vecBatch.size();
+
+	uint64_t nStarted = nowNanos();
+
+	m_vecCandidates.resize(vecBatch.size() * nCandidates);
+	m_vecCandidateCounts.assign(vecBatch.size(), 0);
+	m_team.run(vecBatch.size(), nRequestChunk, [&](size_t nBegin, size_t nEnd)
+	{
+		std::vector<spatial_hit> vecHits;
+		for (size_t r = nBegin; r < nEnd; r++)
+			findCandidates(vecBatch[r], r, vecHits);
+	});
+
+	// Number the vehicles that turned up
+	m_mapVehicles.clear();
+	m_vecVehicles.clear();
+	for (size_t r = 0; r < vecBatch.size(); r++)
+	{
+		for (size_t i = 0; i < m_vecCandidateCounts[r]; i++)
+		{
+			candidate& c = m_vecCandidates[r * nCandidates + i];
+			auto inserted = m_mapVehicles.emplace(c.nVehicle, uint32_t(m_vecVehicles.size()));
+			if (inserted.second)
+				m_vecVehicles.push_back(c.nVehicle);
+			c.nIndex = inserted.first->second;
+		}
+		report.nEdges += m_vecCandidateCounts[r];
+	}
+	report.nVehicles = m_vecVehicles.size();
+
+	uint64_t nSearched = nowNanos();
+	report.nCandidateNanos = nSearched - nStarted;
+
+	// The smaller side bids, rounds are as short as they can be that way.
+	// Benefits are scaled by bidders + 1 so that the auction's last phase
+	// at eps 1 lands on the optimum, see CAuction
+	bool bVehiclesBid = m_vecVehicles.size() <= vecBatch.size();
+	m_graph.nBidders = bVehiclesBid ? m_vecVehicles.size() : vecBatch.size();
+	m_graph.nObjects = bVehiclesBid ? vecBatch.size() : m_vecVehicles.size();
+	int64_t nScale = int64_t(m_graph.nBidders) + 1;
+
+	m_graph.vecOffsets.assign(m_graph.nBidders + 1, 0);
+	for (size_t r = 0; r < vecBatch.size(); r++)
+	{
+		for (size_t i = 0; i < m_vecCandidateCounts[r]; i++)
+		{
+			size_t b = bVehiclesBid ? m_vecCandidates[r * nCandidates + i].nIndex : r;
+			m_graph.vecOffsets[b + 1]++;
+		}
+	}
+	for (size_t b = 0; b < m_graph.nBidders; b++)
+		m_graph.vecOffsets[b + 1] += m_graph.vecOffsets[b];
+
+	m_graph.vecObjects.resize(report.nEdges);
+	m_graph.vecBenefits.resize(report.nEdges);
+	m_vecFill.assign(m_graph.vecOffsets.begin(), m_graph.vecOffsets.end() - 1);
+	for (size_t r = 0; r < vecBatch.size(); r++)
+	{
+		for (size_t i = 0; i < m_vecCandidateCounts[r]; i++)
+		{
+			const candidate& c = m_vecCandidates[r * nCandidates + i];
+			size_t b = bVehiclesBid ? c.nIndex : r;
+			uint32_t e = m_vecFill[b]++;
+			m_graph.vecObjects[e] = bVehiclesBid ? uint32_t(r) : c.nIndex;
+			m_graph.vecBenefits[e] = (int64_t(nMaxEta) + 1 - c.nEta) * nScale;
+		}
+	}
+
+	report.nRounds = m_auction.solve(m_graph, m_vecAssigned, m_team);
+
+	// Assignments out, matched requests out of the batch
+	std::vector<bool> vecMatched(vecBatch.size(), false);
+	for (size_t b = 0; b < m_graph.nBidders; b++)
+	{
+		if (m_vecAssigned[b] == CAuction::nUnassigned)
+			continue;
+
+		size_t r = bVehiclesBid ? size_t(m_vecAssigned[b]) : b;
+		size_t v = bVehiclesBid ? b : size_t(m_vecAssigned[b]);
+		uint32_t nVehicle = m_vecVehicles[v];
+
+		const candidate* pSlots = &m_vecCandidates[r * nCandidates];
+		const candidate* pFound = std::find_if(pSlots, pSlots + m_vecCandidateCounts[r],
+			[&](const candidate& c) { return c.nVehicle == nVehicle; });
+
+		pickup_assignment assignment;
+		assignment.nRequest = vecBatch[r].nRequest;
+		assignment.nTag = vecBatch[r].nTag;
+		assignment.nVehicle = nVehicle;
+		assignment.nEta = pFound->nEta;
+		assignment.bMatched = true;
+		vecOut.push_back(assignment);
+
+		m_mapBusy[nVehicle] = { assignment.nTag, assignment.nRequest, nStarted / 1000000 };
+		vecMatched[r] = true;
+		report.nMatched++;
+		report.nTotalEta += assignment.nEta;
+	}
+
+	size_t nKept = 0;
+	for (size_t r = 0; r < vecBatch.size(); r++)
+	{
+		if (!vecMatched[r])
+			vecBatch[nKept++] = vecBatch[r];
+	}
+	vecBatch.resize(nKept);
+
+	report.nSolveNanos = nowNanos() - nSearched;
+	return report;
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "auction.h"
+#include "geo/spatial_grid.h"
+#include "thread_team.h"
+
+// A rider waiting for a vehicle. nTag is the caller's, handed back as is
+struct pickup_request
+{
+	uint32_t nRequest = 0;
+	uint64_t nTag = 0;
+	int32_t nLat = 0;
+	int32_t nLon = 0;
+	// Steady clock milliseconds
+	uint64_t nArrived = 0;
+};
+
+// The outcome of a request: a vehicle and its ETA in seconds, or, when
+// bMatched is false, that no vehicle was found in time
+struct pickup_assignment
+{
+	uint32_t nRequest = 0;
+	uint64_t nTag = 0;
+	uint32_t nVehicle = 0;
+	uint32_t nEta = 0;
+	bool bMatched = false;
+};
+
+// What one window did
+struct match_report
+{
+	size_t nRequests = 0;
+	size_t nVehicles = 0;
+	size_t nEdges = 0;
+	size_t nMatched = 0;
+	size_t nRounds = 0;
+	uint64_t nTotalEta = 0;
+	// Steady clock nanoseconds spent finding candidates and in the auction
+	uint64_t nCandidateNanos = 0;
+	uint64_t nSolveNanos = 0;
+};
+
+// Matches pickup requests to free vehicles in batches. Requests collect for
+// a window, then the whole batch is assigned at once so that the total ETA
+// is as low as the auction gets it, instead of every request grabbing the
+// nearest vehicle in arrival order.
+//
+// Each request only considers its nCandidates nearest free vehicles in the
+// grid, which keeps the cost matrix sparse: 10k requests against 2k
+// vehicles is 160k edges instead of 20M. Candidate search and ETAs run on
+// the thread team, so does the bidding. A request left without a vehicle
+// stays for the next window, until nGiveUpAfterMs.
+//
+// A vehicle is busy from its assignment until release(), or until the
+// request it was assigned to is cancel()ed. Should neither ever come, e.g.
+// because the vehicle lost its connection for good, it is free again
+// nBusyForMs after the assignment.
+//
+// The window thread also keeps the grid fresh: a vehicle that stopped
+// reporting, e.g. because it went offline, is taken out once its last
+// position is nStaleAfterMs old. The grid has to be updated with steady
+// clock milliseconds for that, the same clock as pickup_request::nArrived.
+class CMatcher
+{
+	public:
+		// ETA in seconds from each of the vehicles to the pickup point
+		using eta_t = std::function<void(int32_t nLat, int32_t nLon, const spatial_hit* pFrom, size_t nFrom, uint32_t* pSeconds)>;
+		using assigned_t = std::function<void(const pickup_assignment&)>;
+
+		static constexpr uint64_t nWindowMs = 200;
+		static constexpr uint64_t nGiveUpAfterMs = 60000;
+		static constexpr size_t nCandidates = 16;
+
+		// Positions older than this are dropped, checked every
+		// nExpireEveryMs, so a silent vehicle is offered for at most the
+		// sum of both after its last report
+		static constexpr uint64_t nStaleAfterMs = 30000;
+		static constexpr uint64_t nExpireEveryMs = 1000;
+
+		// Longer than any trip, only for vehicles nobody released
+		static constexpr uint64_t nBusyForMs = 3 * 3600 * 1000;
+
+		// Vehicles further than this, in distance or in time, are never
+		// offered
+		static constexpr double fSearchMeters = 10000.0;
+		static constexpr uint32_t nMaxEta = 1800;
+
+		// Without fnEta, straight line distance at city speed
+		CMatcher(CSpatialGrid& grid, size_t nThreads, assigned_t fnAssigned, eta_t fnEta = nullptr);
+		CMatcher(const CMatcher&) = delete;
+		~CMatcher();
+
+		// The window thread, which calls fnAssigned
+		bool start();
+		void stop();
+
+		// Any thread
+		void submit(const pickup_request& request);
+		void release(uint32_t nVehicle);
+		// Drops the request if it is still waiting, frees its vehicle if it
+		// already has one
+		void cancel(uint64_t nTag, uint32_t nRequest);
+		// Drops every request of nTag that is still waiting, for callers
+		// that went away. Vehicles already assigned stay busy until
+		// released, the trips may well go ahead without them
+		void cancelAll(uint64_t nTag);
+
+		// One window's worth of matching, what the window thread runs.
+		// Appends an assignment for every request that got a vehicle and
+		// leaves the others in vecBatch. Not for use while started
+		match_report match(std::vector<pickup_request>& vecBatch, std::vector<pickup_assignment>& vecOut);
+
+		// Of the window thread's latest batch, safe to read from fnAssigned
+		// or once stopped
+		const match_report& lastReport() const { return m_lastReport; }
+
+	private:
+		void runWindows();
+
+		// Nearest free vehicles of request r into its slots of
+		// m_vecCandidates, with ETAs
+		void findCandidates(const pickup_request& request, size_t r, std::vector<spatial_hit>& vecHits);
+
+		CSpatialGrid& m_grid;
+		CThreadTeam m_team;
+		CAuction m_auction;
+		assigned_t m_fnAssigned;
+		eta_t m_fnEta;
+
+		// Window thread only. Busy vehicles, with the request they took
+		// and since when
+		struct busy
+		{
+			uint64_t nTag;
+			uint32_t nRequest;
+			uint64_t nSince;
+		};
+		std::unordered_map<uint32_t, busy> m_mapBusy;
+		std::vector<pickup_request> m_vecWaiting;
+		match_report m_lastReport;
+
+		// nCandidates slots per request of the batch
+		struct candidate
+		{
+			uint32_t nVehicle;
+			uint32_t nEta;
+			// Into m_vecVehicles, once numbered
+			uint32_t nIndex;
+		};
+		std::vector<candidate> m_vecCandidates;
+		std::vector<uint8_t> m_vecCandidateCounts;
+
+		// Vehicles of the batch, numbered in order of appearance
+		std::unordered_map<uint32_t, uint32_t> m_mapVehicles;
+		std::vector<uint32_t> m_vecVehicles;
+		std::vector<uint32_t> m_vecFill;
+		CAuction::graph m_graph;
+		std::vector<int32_t> m_vecAssigned;
+
+		// Handed over to the window thread
+		std::mutex m_mxPending;
+		std::condition_variable m_cvPending;
+		std::vector<pickup_request> m_vecPending;
+		std::vector<uint32_t> m_vecReleased;
+		std::vector<std::pair<uint64_t, uint32_t>> m_vecCancelled;
+		std::vector<uint64_t> m_vecGone;
+		bool m_bRunning = false;
+		std::thread m_threadWindows;
+};
@@ -0,0 +1,84 @@
+#include "thread_team.h"
+
+CThreadTeam::CThreadTeam(size_t nThreads)
+{
+	for (size_t i = 1; i < nThreads; i++)
+		m_vecThreads.emplace_back([this]() { work(); });
+}
+
+CThreadTeam::~CThreadTeam()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mxJob);
+		m_bStopping = true;
+	}
+	m_cvStart.notify_all();
+
+	for (std::thread& thread : m_vecThreads)
+		thread.join();
+}
+
+void CThreadTeam::run(size_t nItems, size_t nChunk, const range_t& fn)
+{
+	if (nChunk == 0)
+		nChunk = 1;
+
+	if (m_vecThreads.empty() || nItems <= nChunk)
+	{
+		if (nItems > 0)
+			fn(0, nItems);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mxJob);
+		m_pFn = &fn;
+		m_nItems = nItems;
+		m_nChunk = nChunk;
+		m_nNext.store(0, std::memory_order_relaxed);
+		m_nBusy = m_vecThreads.size();
+		m_nGeneration++;
+	}
+	m_cvStart.notify_all();
+
+	drain();
+
+	// fn lives on our stack, nobody may still be in it when we return
+	std::unique_lock<std::mutex> lock(m_mxJob);
+	m_cvDone.wait(lock, [this]() { return m_nBusy == 0; });
+	m_pFn = nullptr;
+}
+
+void CThreadTeam::work()
+{
+	uint64_t nSeen = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mxJob);
+			m_cvStart.wait(lock, [&]() { return m_bStopping || m_nGeneration != nSeen; });
+			if (m_bStopping)
+				return;
+			nSeen = m_nGeneration;
+		}
+
+		drain();
+
+		std::lock_guard<std::mutex> lock(m_mxJob);
+		if (--m_nBusy == 0)
+			m_cvDone.notify_one();
+	}
+}
+
+void CThreadTeam::drain()
+{
+	for (;;)
+	{
+		size_t nBegin = m_nNext.fetch_add(m_nChunk, std::memory_order_relaxed);
+		if (nBegin >= m_nItems)
+			return;
+
+		size_t nEnd = nBegin + m_nChunk < m_nItems ? nBegin + m_nChunk : m_nItems;
+		(*m_pFn)(nBegin, nEnd);
+	}
+}
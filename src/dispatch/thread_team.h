@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fork-join over a range of indices. The threads are started once and wait
+// between jobs, so a job costs a wake-up rather than a thread start, which
+// matters for the auction's many short rounds. The calling thread works
+// too, so a team of n runs n - 1 threads of its own.
+class CThreadTeam
+{
+	public:
+		using range_t = std::function<void(size_t nBegin, size_t nEnd)>;
+
+		explicit CThreadTeam(size_t nThreads);
+		CThreadTeam(const CThreadTeam&) = delete;
+		~CThreadTeam();
+
+		// Call fn over [0, nItems) in chunks of nChunk and return once all
+		// of them are done. Runs inline when there is a single chunk. One
+		// caller at a time
+		void run(size_t nItems, size_t nChunk, const range_t& fn);
+
+		size_t threads() const { return m_vecThreads.size() + 1; }
+
+	private:
+		void work();
+		void drain();
+
+		std::vector<std::thread> m_vecThreads;
+
+		std::mutex m_mxJob;
+		std::condition_variable m_cvStart;
+		std::condition_variable m_cvDone;
+		uint64_t m_nGeneration = 0;
+		size_t m_nBusy = 0;
+		bool m_bStopping = false;
+
+		// The current job, set under m_mxJob before the generation moves
+		const range_t* m_pFn = nullptr;
+		size_t m_nItems = 0;
+		size_t m_nChunk = 1;
+		std::atomic<size_t> m_nNext{0};
+};
@@ -0,0 +1,108 @@
+#include <algorithm>
+
+#include "eta_cache.h"
+
+namespace
+{
+	constexpr double fMetersPerDegree = 111320.0;
+	constexpr double fUnitsPerDegree = 1e7;
+}
+
+CEtaCache::CEtaCache(size_t nCapacity, double fCellMeters)
+{
+	m_nCellUnits = std::max<int64_t>(1, int64_t(fCellMeters / fMetersPerDegree * fUnitsPerDegree));
+
+	size_t nSets = 1;
+	while (nSets * nWays < nCapacity)
+		nSets *= 2;
+	m_aEntries.reset(new entry[nSets * nWays]);
+	m_nSetMask = nSets - 1;
+}
+
+uint64_t CEtaCache::cell(int32_t nLat, int32_t nLon) const
+{
+	// Like CSpatialGrid's cells, counted from the south pole and the
+	// antimeridian
+	uint64_t nRow = uint64_t((int64_t(nLat) + 900000000) / m_nCellUnits);
+	uint64_t nCol = uint64_t((int64_t(nLon) + 1800000000) / m_nCellUnits);
+	return (nRow << 32) | nCol;
+}
+
+size_t CEtaCache::setOf(const eta_key& key) const
+{
+	uint64_t nHash = key.nFrom * 0x9E3779B97F4A7C15ull;
+	nHash ^= (key.nTo + (nHash >> 29)) * 0xBF58476D1CE4E5B9ull;
+	nHash ^= (uint64_t(key.nBucket) + (nHash >> 31)) * 0x94D049BB133111EBull;
+	return size_t(nHash >> 24) & m_nSetMask;
+}
+
+bool CEtaCache::find(const eta_key& key, uint32_t& nSeconds)
+{
+	size_t nSet = setOf(key);
+	entry* pSet = &m_aEntries[nSet * nWays];
+
+	stripe& s = m_aStripes[nSet % nStripes];
+	std::lock_guard<std::mutex> lock(s.mx);
+	for (size_t i = 0; i < nWays; i++)
+	{
+		if (pSet[i].nUsed != 0 && pSet[i].key == key)
+		{
+			pSet[i].nUsed = ++s.nTick;
+			nSeconds = pSet[i].nSeconds;
+			s.nHits++;
+			return true;
+		}
+	}
+
+	s.nMisses++;
+	return false;
+}
+
+void CEtaCache::insert(const eta_key& key, uint32_t nSeconds)
+{
+	size_t nSet = setOf(key);
+	entry* pSet = &m_aEntries[nSet * nWays];
+
+	stripe& s = m_aStripes[nSet % nStripes];
+	std::lock_guard<std::mutex> lock(s.mx);
+
+	// The key itself if another thread got there first, else the least
+	// recently used, empty ones being least of all
+	entry* pVictim = &pSet[0];
+	for (size_t i = 0; i < nWays; i++)
+	{
+		if (pSet[i].nUsed != 0 && pSet[i].key == key)
+		{
+			pVictim = &pSet[i];
+			break;
+		}
+		if (pSet[i].nUsed < pVictim->nUsed)
+			pVictim = &pSet[i];
+	}
+
+	pVictim->key = key;
+	pVictim->nSeconds = nSeconds;
+	pVictim->nUsed = ++s.nTick;
+}
+
+uint64_t CEtaCache::hits() const
+{
+	uint64_t nHits = 0;
+	for (const stripe& s : m_aStripes)
+	{
+		std::lock_guard<std::mutex> lock(s.mx);
+		nHits += s.nHits;
+	}
+	return nHits;
+}
+
+uint64_t CEtaCache::misses() const
+{
+	uint64_t nMisses = 0;
+	for (const stripe& s : m_aStripes)
+	{
+		std::lock_guard<std::mutex> lock(s.mx);
+		nMisses += s.nMisses;
+	}
+	return nMisses;
+}
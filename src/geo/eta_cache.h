@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+// Travel times between two cells at one time of day
+struct eta_key
+{
+	uint64_t nFrom = 0;
+	uint64_t nTo = 0;
+	uint32_t nBucket = 0;
+
+	bool operator==(const eta_key& other) const
+	{
+		return nFrom == other.nFrom && nTo == other.nTo && nBucket == other.nBucket;
+	}
+};
+
+// Fixed size cache of travel times. Points are rounded to cells, so every
+// trip between the same two cells in the same time bucket shares one entry,
+// which is what makes repeated matching windows over the same streets
+// cheap. The price is an error of up to a cell's crossing time.
+//
+// Set associative: a key can only live in one set of nWays entries, and
+// the least recently used of them makes room for a new one, so the memory
+// is fixed at construction and nothing is ever allocated after. Sets are
+// locked in stripes, threads mostly do not meet. A set always falls in the
+// same stripe, so recency is counted per stripe, under its lock.
+class CEtaCache
+{
+	public:
+		static constexpr size_t nWays = 4;
+		static constexpr size_t nStripes = 64;
+
+		// nCapacity is rounded up to a power of two
+		explicit CEtaCache(size_t nCapacity = 1 << 18, double fCellMeters = 150.0);
+		CEtaCache(const CEtaCache&) = delete;
+
+		uint64_t cell(int32_t nLat, int32_t nLon) const;
+
+		bool find(const eta_key& key, uint32_t& nSeconds);
+		void insert(const eta_key& key, uint32_t nSeconds);
+
+		uint64_t hits() const;
+		uint64_t misses() const;
+
+	private:
+		struct entry
+		{
+			eta_key key;
+			uint32_t nSeconds = 0;
+			// Tick of the last use, 0 is an empty entry
+			uint64_t nUsed = 0;
+		};
+
+		size_t setOf(const eta_key& key) const;
+
+		// Cell edge in 1e-7 degrees
+		int64_t m_nCellUnits;
+
+		std::unique_ptr<entry[]> m_aEntries;
+		size_t m_nSetMask;
+
+		// A cache line each, stripes are taken by different threads
+		struct alignas(64) stripe
+		{
+			mutable std::mutex mx;
+			uint64_t nTick = 0;
+			uint64_t nHits = 0;
+			uint64_t nMisses = 0;
+		};
+		stripe m_aStripes[nStripes];
+};
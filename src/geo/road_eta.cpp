@@ -0,0 +1,84 @@
+#include <chrono>
+#include <vector>
+
+#include "road_eta.h"
+
+namespace
+{
+	uint32_t toSeconds(uint32_t nMillis, float fMeters)
+	{
+		if (nMillis == CRoadGraph::nUnreachable)
+			return CRoadEta::nUnreachable;
+		return uint32_t((uint64_t(nMillis) + 500) / 1000 + uint64_t(double(fMeters) / CRoadEta::fSnapSpeed));
+	}
+}
+
+CRoadEta::CRoadEta(const CRoadGraph& graph, CEtaCache& cache) : m_graph(graph), m_cache(cache)
+{
+}
+
+uint32_t CRoadEta::timeBucket()
+{
+	auto now = std::chrono::system_clock::now().time_since_epoch();
+	uint64_t nSeconds = uint64_t(std::chrono::duration_cast<std::chrono::seconds>(now).count());
+	return uint32_t((nSeconds % 86400) / nBucketSeconds);
+}
+
+void CRoadEta::toPoint(int32_t nLat, int32_t nLon, const spatial_hit* pFrom, size_t nFrom, uint32_t* pSeconds) const
+{
+	eta_key key;
+	key.nTo = m_cache.cell(nLat, nLon);
+	key.nBucket = timeBucket();
+
+	// Whatever the cache does not have is searched for in one go
+	thread_local std::vector<uint32_t> t_vecMissing;
+	thread_local std::vector<uint32_t> t_vecNodes;
+	thread_local std::vector<float> t_vecSnaps;
+	thread_local std::vector<uint32_t> t_vecMillis;
+	t_vecMissing.clear();
+
+	for (size_t i = 0; i < nFrom; i++)
+	{
+		key.nFrom = m_cache.cell(pFrom[i].nLat, pFrom[i].nLon);
+		if (!m_cache.find(key, pSeconds[i]))
+			t_vecMissing.push_back(uint32_t(i));
+	}
+	if (t_vecMissing.empty())
+		return;
+
+	float fToSnap = 0.0f;
+	uint32_t nTo = m_graph.nearestNode(nLat, nLon, fSnapMeters, &fToSnap);
+
+	t_vecNodes.resize(t_vecMissing.size());
+	t_vecSnaps.resize(t_vecMissing.size());
+	t_vecMillis.resize(t_vecMissing.size());
+	for (size_t m = 0; m < t_vecMissing.size(); m++)
+	{
+		const spatial_hit& hit = pFrom[t_vecMissing[m]];
+		t_vecNodes[m] = m_graph.nearestNode(hit.nLat, hit.nLon, fSnapMeters, &t_vecSnaps[m]);
+	}
+
+	// Nodes that do not exist, for a point off the map, come back
+	// unreachable
+	m_graph.manyToOne(t_vecNodes.data(), t_vecNodes.size(), nTo, t_vecMillis.data());
+
+	for (size_t m = 0; m < t_vecMissing.size(); m++)
+	{
+		size_t i = t_vecMissing[m];
+		pSeconds[i] = toSeconds(t_vecMillis[m], t_vecSnaps[m] + fToSnap);
+
+		key.nFrom = m_cache.cell(pFrom[i].nLat, pFrom[i].nLon);
+		m_cache.insert(key, pSeconds[i]);
+	}
+}
+
+uint32_t CRoadEta::between(int32_t nFromLat, int32_t nFromLon, int32_t nToLat, int32_t nToLon) const
+{
+	spatial_hit from;
+	from.nLat = nFromLat;
+	from.nLon = nFromLon;
+
+	uint32_t nSeconds;
+	toPoint(nToLat, nToLon, &from, 1, &nSeconds);
+	return nSeconds;
+}
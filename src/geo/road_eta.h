@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+
+#include "eta_cache.h"
+#include "road_graph.h"
+#include "spatial_grid.h"
+
+// Travel times between points over a road graph, through a cache. Points
+// are snapped to their nearest node, the drive to and from the node is
+// counted at fSnapSpeed. A point with no node within fSnapMeters is
+// unreachable.
+//
+// Cache entries are keyed by the current time bucket, a slot of the day of
+// nBucketSeconds, so that times of day can differ once the graph knows
+// about traffic, and so that what the cache holds turns over with the day.
+class CRoadEta
+{
+	public:
+		static constexpr uint32_t nUnreachable = UINT32_MAX;
+		static constexpr uint32_t nBucketSeconds = 900;
+		static constexpr double fSnapMeters = 500.0;
+		static constexpr double fSnapSpeed = 8.3;
+
+		CRoadEta(const CRoadGraph& graph, CEtaCache& cache);
+
+		// Seconds from each of the vehicles in pFrom to the point, fits
+		// CMatcher::eta_t
+		void toPoint(int32_t nLat, int32_t nLon, const spatial_hit* pFrom, size_t nFrom, uint32_t* pSeconds) const;
+
+		uint32_t between(int32_t nFromLat, int32_t nFromLon, int32_t nToLat, int32_t nToLon) const;
+
+		// Slot of the day, UTC
+		static uint32_t timeBucket();
+
+	private:
+		const CRoadGraph& m_graph;
+		CEtaCache& m_cache;
+};
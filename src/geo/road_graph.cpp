@@ -0,0 +1,534 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <queue>
+#include <sstream>
+
+#include "road_graph.h"
+
+// Distances of one Dijkstra search. Stamped instead of cleared, so starting
+// a search costs nothing however large the graph
+struct CRoadGraph::search_space
+{
+	std::vector<uint32_t> vecDist;
+	std::vector<uint32_t> vecStamps;
+	uint32_t nStamp = 0;
+
+	// Min-heap of (distance, node), stale entries are skipped when popped
+	std::vector<std::pair<uint32_t, uint32_t>> vecHeap;
+
+	void reset(size_t nNodes)
+	{
+		if (vecDist.size() < nNodes)
+		{
+			vecDist.resize(nNodes);
+			vecStamps.resize(nNodes, 0);
+		}
+		if (++nStamp == 0)
+		{
+			std::fill(vecStamps.begin(), vecStamps.end(), 0);
+			nStamp = 1;
+		}
+		vecHeap.clear();
+	}
+
+	uint32_t dist(uint32_t v) const
+	{
+		return vecStamps[v] == nStamp ? vecDist[v] : nUnreachable;
+	}
+
+	void relax(uint32_t v, uint32_t d)
+	{
+		if (vecStamps[v] == nStamp && vecDist[v] <= d)
+			return;
+
+		vecStamps[v] = nStamp;
+		vecDist[v] = d;
+		vecHeap.emplace_back(d, v);
+		std::push_heap(vecHeap.begin(), vecHeap.end(), std::greater<std::pair<uint32_t, uint32_t>>());
+	}
+
+	// False once the heap is empty
+	bool pop(uint32_t& v, uint32_t& d)
+	{
+		while (!vecHeap.empty())
+		{
+			std::pop_heap(vecHeap.begin(), vecHeap.end(), std::greater<std::pair<uint32_t, uint32_t>>());
+			d = vecHeap.back().first;
+			v = vecHeap.back().second;
+			vecHeap.pop_back();
+			if (d == vecDist[v])
+				return true;
+		}
+		return false;
+	}
+};
+
+namespace
+{
+	constexpr double fUnitsPerDegree = 1e7;
+
+	// Witness searches give up after settling this many nodes, fewer while
+	// only working out a priority. A witness missed only costs a shortcut
+	// that was not needed
+	constexpr size_t nWitnessSettled = 500;
+	constexpr size_t nEstimateSettled = 100;
+
+	// Graph as it shrinks during contraction. Arcs to contracted nodes are
+	// taken out as the nodes go
+	struct dynamic_arc
+	{
+		uint32_t nNode;
+		uint32_t nWeight;
+	};
+
+	struct contraction
+	{
+		std::vector<std::vector<dynamic_arc>> vecOut;
+		std::vector<std::vector<dynamic_arc>> vecIn;
+		std::vector<bool> vecContracted;
+		std::vector<uint32_t> vecDeleted;
+		std::vector<uint32_t> vecLevel;
+
+		// Witness search state. Targets are the out neighbours of the node
+		// being contracted, marked with nTargetStamp
+		std::vector<uint32_t> vecDist;
+		std::vector<uint32_t> vecStamps;
+		uint32_t nStamp = 0;
+		std::vector<uint32_t> vecTargets;
+		uint32_t nTargetStamp = 0;
+		std::vector<std::pair<uint32_t, uint32_t>> vecHeap;
+
+		explicit contraction(size_t nNodes)
+			: vecOut(nNodes), vecIn(nNodes), vecContracted(nNodes, false), vecDeleted(nNodes, 0), vecLevel(nNodes, 0),
+			  vecDist(nNodes, 0), vecStamps(nNodes, 0), vecTargets(nNodes, 0)
+		{
+		}
+
+		static void addArc(std::vector<dynamic_arc>& vecArcs, uint32_t nNode, uint32_t nWeight)
+		{
+			for (dynamic_arc& arc : vecArcs)
+			{
+				if (arc.nNode == nNode)
+				{
+					arc.nWeight = std::min(arc.nWeight, nWeight);
+					return;
+				}
+			}
+			vecArcs.push_back({ nNode, nWeight });
+		}
+
+		static void removeArc(std::vector<dynamic_arc>& vecArcs, uint32_t nNode)
+		{
+			for (size_t i = 0; i < vecArcs.size(); i++)
+			{
+				if (vecArcs[i].nNode == nNode)
+				{
+					vecArcs[i] = vecArcs.back();
+					vecArcs.pop_back();
+					return;
+				}
+			}
+		}
+
+		uint32_t dist(uint32_t v) const
+		{
+			return vecStamps[v] == nStamp ? vecDist[v] : CRoadGraph::nUnreachable;
+		}
+
+		// Shortest distances from u without going through v, until all
+		// nTargets targets are settled, or up to nMax or nLimit nodes
+		void witness(uint32_t u, uint32_t v, uint32_t nMax, size_t nTargets, size_t nLimit)
+		{
+			if (++nStamp == 0)
+			{
+				std::fill(vecStamps.begin(), vecStamps.end(), 0);
+				nStamp = 1;
+			}
+			vecHeap.clear();
+
+			auto greater = std::greater<std::pair<uint32_t, uint32_t>>();
+			vecStamps[u] = nStamp;
+			vecDist[u] = 0;
+			vecHeap.emplace_back(0, u);
+
+			size_t nSettled = 0;
+			while (!vecHeap.empty() && nSettled < nLimit && nTargets > 0)
+			{
+				std::pop_heap(vecHeap.begin(), vecHeap.end(), greater);
+				uint32_t d = vecHeap.back().first;
+				uint32_t x = vecHeap.back().second;
+				vecHeap.pop_back();
+				if (d != vecDist[x])
+					continue;
+				if (d > nMax)
+					break;
+				nSettled++;
+				if (vecTargets[x] == nTargetStamp)
+					nTargets--;
+
+				for (const dynamic_arc& arc : vecOut[x])
+				{
+					if (arc.nNode == v)
+						continue;
+
+					uint32_t nd = d + arc.nWeight;
+					if (nd <= nMax && nd < dist(arc.nNode))
+					{
+						vecStamps[arc.nNode] = nStamp;
+						vecDist[arc.nNode] = nd;
+						vecHeap.emplace_back(nd, arc.nNode);
+						std::push_heap(vecHeap.begin(), vecHeap.end(), greater);
+					}
+				}
+			}
+		}
+
+		// Shortcuts that contracting v takes, added if bApply. Returns how
+		// many
+		size_t shortcuts(uint32_t v, bool bApply)
+		{
+			if (++nTargetStamp == 0)
+			{
+				std::fill(vecTargets.begin(), vecTargets.end(), 0);
+				nTargetStamp = 1;
+			}
+
+			uint32_t nMaxOut = 0;
+			for (const dynamic_arc& out : vecOut[v])
+			{
+				nMaxOut = std::max(nMaxOut, out.nWeight);
+				vecTargets[out.nNode] = nTargetStamp;
+			}
+
+			size_t nCount = 0;
+			for (size_t i = 0; i < vecIn[v].size(); i++)
+			{
+				// Copied, adding a shortcut may grow vecIn of another node
+				dynamic_arc in = vecIn[v][i];
+				witness(in.nNode, v, in.nWeight + nMaxOut, vecOut[v].size(), bApply ? nWitnessSettled : nEstimateSettled);
+
+				for (size_t j = 0; j < vecOut[v].size(); j++)
+				{
+					dynamic_arc out = vecOut[v][j];
+					if (out.nNode == in.nNode)
+						continue;
+
+					uint32_t nVia = in.nWeight + out.nWeight;
+					if (dist(out.nNode) <= nVia)
+						continue;
+
+					nCount++;
+					if (bApply)
+					{
+						addArc(vecOut[in.nNode], out.nNode, nVia);
+						addArc(vecIn[out.nNode], in.nNode, nVia);
+					}
+				}
+			}
+			return nCount;
+		}
+
+		// Least important first: nodes whose removal adds few arcs, next
+		// to few already removed, low in the hierarchy so far
+		int64_t priority(uint32_t v)
+		{
+			int64_t nEdgeDiff = int64_t(shortcuts(v, false)) - int64_t(vecIn[v].size() + vecOut[v].size());
+			return 4 * nEdgeDiff + 2 * int64_t(vecDeleted[v]) + int64_t(vecLevel[v]);
+		}
+	};
+}
+
+CRoadGraph::CRoadGraph()
+{
+}
+
+bool CRoadGraph::load(const std::string& strPath)
+{
+	std::ifstream file(strPath);
+	if (!file.is_open())
+		return false;
+
+	std::vector<int32_t> vecLat;
+	std::vector<int32_t> vecLon;
+	std::vector<arc_spec> vecArcs;
+
+	std::string strLine;
+	while (std::getline(file, strLine))
+	{
+		std::istringstream line(strLine);
+		std::string strKind;
+		if (!(line >> strKind) || strKind[0] == '#')
+			continue;
+
+		if (strKind == "v")
+		{
+			double fLat, fLon;
+			if (!(line >> fLat >> fLon))
+				return false;
+			vecLat.push_back(int32_t(std::lround(fLat * fUnitsPerDegree)));
+			vecLon.push_back(int32_t(std::lround(fLon * fUnitsPerDegree)));
+		}
+		else if (strKind == "a")
+		{
+			uint64_t nFrom, nTo;
+			double fSeconds;
+			if (!(line >> nFrom >> nTo >> fSeconds) || fSeconds < 0.0)
+				return false;
+			vecArcs.push_back({ uint32_t(nFrom), uint32_t(nTo), uint32_t(std::lround(fSeconds * 1000.0)) });
+		}
+		else
+		{
+			return false;
+		}
+	}
+	return build(vecLat, vecLon, vecArcs);
+}
+
+bool CRoadGraph::build(const std::vector<int32_t>& vecLat, const std::vector<int32_t>& vecLon, const std::vector<arc_spec>& vecArcs)
+{
+	if (vecLat.size() != vecLon.size() || vecLat.size() >= nNoNode)
+		return false;
+	for (const arc_spec& arc : vecArcs)
+	{
+		if (arc.nFrom >= vecLat.size() || arc.nTo >= vecLat.size())
+			return false;
+	}
+
+	m_vecLat = vecLat;
+	m_vecLon = vecLon;
+
+	// A couple of buckets per node keeps them short
+	m_pNodes.reset(new CSpatialGrid(100.0, 2 * vecLat.size()));
+	for (uint32_t v = 0; v < vecLat.size(); v++)
+		m_pNodes->update(v, vecLat[v], vecLon[v], 0);
+
+	contract(vecArcs);
+	return true;
+}
+
+void CRoadGraph::contract(const std::vector<arc_spec>& vecArcs)
+{
+	const size_t nNodes = m_vecLat.size();
+	contraction c(nNodes);
+	for (const arc_spec& arc : vecArcs)
+	{
+		if (arc.nFrom == arc.nTo)
+			continue;
+		contraction::addArc(c.vecOut[arc.nFrom], arc.nTo, arc.nMillis);
+		contraction::addArc(c.vecIn[arc.nTo], arc.nFrom, arc.nMillis);
+	}
+
+	// Arcs of each node at the time it goes, they are the ones to higher
+	// nodes. By original id for now
+	std::vector<std::vector<dynamic_arc>> vecUp(nNodes);
+	std::vector<std::vector<dynamic_arc>> vecDown(nNodes);
+	m_vecRank.assign(nNodes, 0);
+	m_nShortcuts = 0;
+
+	// Lazy: a popped node's priority is worked out again and it goes back
+	// in if it is no longer the least. Entries that do not match the
+	// node's current priority are stale
+	using entry = std::pair<int64_t, uint32_t>;
+	std::priority_queue<entry, std::vector<entry>, std::greater<entry>> queue;
+	std::vector<int64_t> vecPriority(nNodes);
+	for (uint32_t v = 0; v < nNodes; v++)
+	{
+		vecPriority[v] = c.priority(v);
+		queue.emplace(vecPriority[v], v);
+	}
+
+	uint32_t nRank = 0;
+	while (!queue.empty())
+	{
+		entry top = queue.top();
+		queue.pop();
+		uint32_t v = top.second;
+		if (c.vecContracted[v] || top.first != vecPriority[v])
+			continue;
+
+		vecPriority[v] = c.priority(v);
+		if (!queue.empty() && vecPriority[v] > queue.top().first)
+		{
+			queue.emplace(vecPriority[v], v);
+			continue;
+		}
+
+		m_nShortcuts += c.shortcuts(v, true);
+		c.vecContracted[v] = true;
+		m_vecRank[v] = nRank++;
+		vecUp[v] = std::move(c.vecOut[v]);
+		vecDown[v] = std::move(c.vecIn[v]);
+
+		for (const dynamic_arc& out : vecUp[v])
+			contraction::removeArc(c.vecIn[out.nNode], v);
+		for (const dynamic_arc& in : vecDown[v])
+			contraction::removeArc(c.vecOut[in.nNode], v);
+
+		// Neighbours get a new priority, their old entries go stale
+		auto touch = [&](uint32_t w)
+		{
+			c.vecDeleted[w]++;
+			c.vecLevel[w] = std::max(c.vecLevel[w], c.vecLevel[v] + 1);
+			vecPriority[w] = c.priority(w);
+			queue.emplace(vecPriority[w], w);
+		};
+		for (const dynamic_arc& out : vecUp[v])
+			touch(out.nNode);
+		for (const dynamic_arc& in : vecDown[v])
+			touch(in.nNode);
+	}
+
+	// Into CSR, in contraction order numbering
+	auto pack = [&](std::vector<std::vector<dynamic_arc>>& vecArcs, csr& g)
+	{
+		std::vector<uint32_t> vecByRank(nNodes);
+		for (uint32_t v = 0; v < nNodes; v++)
+			vecByRank[m_vecRank[v]] = v;
+
+		g.vecFirst.assign(nNodes + 1, 0);
+		g.vecHead.clear();
+		g.vecWeight.clear();
+		for (uint32_t r = 0; r < nNodes; r++)
+		{
+			for (const dynamic_arc& arc : vecArcs[vecByRank[r]])
+			{
+				g.vecHead.push_back(m_vecRank[arc.nNode]);
+				g.vecWeight.push_back(arc.nWeight);
+			}
+			g.vecFirst[r + 1] = uint32_t(g.vecHead.size());
+			std::vector<dynamic_arc>().swap(vecArcs[vecByRank[r]]);
+		}
+	};
+	pack(vecUp, m_up);
+	pack(vecDown, m_down);
+}
+
+uint32_t CRoadGraph::nearestNode(int32_t nLat, int32_t nLon, double fMaxMeters, float* pMeters) const
+{
+	if (!m_pNodes)
+		return nNoNode;
+
+	thread_local std::vector<spatial_hit> t_vecHits;
+	if (m_pNodes->nearest(nLat, nLon, 1, t_vecHits, fMaxMeters) == 0)
+		return nNoNode;
+
+	if (pMeters)
+		*pMeters = t_vecHits[0].fMeters;
+	return t_vecHits[0].nId;
+}
+
+bool CRoadGraph::stalled(const csr& opposite, uint32_t v, uint32_t d, const search_space& space) const
+{
+	for (uint32_t e = opposite.vecFirst[v]; e < opposite.vecFirst[v + 1]; e++)
+	{
+		uint32_t nVia = space.dist(opposite.vecHead[e]);
+		if (nVia != nUnreachable && nVia + opposite.vecWeight[e] < d)
+			return true;
+	}
+	return false;
+}
+
+void CRoadGraph::searchAll(const csr& g, const csr& opposite, uint32_t nFrom, search_space& space) const
+{
+	space.reset(nodes());
+	space.relax(nFrom, 0);
+
+	uint32_t v, d;
+	while (space.pop(v, d))
+	{
+		if (stalled(opposite, v, d, space))
+			continue;
+
+		for (uint32_t e = g.vecFirst[v]; e < g.vecFirst[v + 1]; e++)
+			space.relax(g.vecHead[e], d + g.vecWeight[e]);
+	}
+}
+
+uint32_t CRoadGraph::searchTo(const csr& g, const csr& opposite, uint32_t nFrom, const search_space& other, search_space& space) const
+{
+	space.reset(nodes());
+	space.relax(nFrom, 0);
+
+	uint32_t nBest = nUnreachable;
+	uint32_t v, d;
+	while (space.pop(v, d))
+	{
+		// Everything still queued is further than what we have
+		if (d >= nBest)
+			break;
+
+		uint32_t nOther = other.dist(v);
+		if (nOther != nUnreachable)
+			nBest = std::min(nBest, d + nOther);
+
+		if (stalled(opposite, v, d, space))
+			continue;
+
+		for (uint32_t e = g.vecFirst[v]; e < g.vecFirst[v + 1]; e++)
+		{
+			uint32_t nd = d + g.vecWeight[e];
+			if (nd < nBest)
+				space.relax(g.vecHead[e], nd);
+		}
+	}
+	return nBest;
+}
+
+uint32_t CRoadGraph::travelTime(uint32_t nFrom, uint32_t nTo) const
+{
+	uint32_t nTime;
+	manyToOne(&nFrom, 1, nTo, &nTime);
+	return nTime;
+}
+
+void CRoadGraph::manyToOne(const uint32_t* pFrom, size_t n, uint32_t nTo, uint32_t* pOut) const
+{
+	// Per thread and shared by every graph, a search resets what it uses
+	thread_local struct
+	{
+		search_space complete;
+		search_space partial;
+	} t_spaces;
+
+	if (nTo >= nodes())
+	{
+		std::fill(pOut, pOut + n, nUnreachable);
+		return;
+	}
+
+	// Backwards from the target over arcs coming down into it, then up
+	// from each source until it meets that
+	searchAll(m_down, m_up, m_vecRank[nTo], t_spaces.complete);
+	for (size_t i = 0; i < n; i++)
+	{
+		pOut[i] = pFrom[i] < nodes()
+			? searchTo(m_up, m_down, m_vecRank[pFrom[i]], t_spaces.complete, t_spaces.partial)
+			: nUnreachable;
+	}
+}
+
+void CRoadGraph::oneToMany(uint32_t nFrom, const uint32_t* pTo, size_t n, uint32_t* pOut) const
+{
+	// Per thread and shared by every graph, a search resets what it uses
+	thread_local struct
+	{
+		search_space complete;
+		search_space partial;
+	} t_spaces;
+
+	if (nFrom >= nodes())
+	{
+		std::fill(pOut, pOut + n, nUnreachable);
+		return;
+	}
+
+	searchAll(m_up, m_down, m_vecRank[nFrom], t_spaces.complete);
+	for (size_t i = 0; i < n; i++)
+	{
+		pOut[i] = pTo[i] < nodes()
+			? searchTo(m_down, m_up, m_vecRank[pTo[i]], t_spaces.complete, t_spaces.partial)
+			: nUnreachable;
+	}
+}
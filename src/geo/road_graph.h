@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "spatial_grid.h"
+
+// A directed road graph with contraction hierarchies for travel times.
+//
+// The file is text, one item per line, '#' starts a comment:
+//
+//  v <lat> <lon>               a node, in degrees; nodes are numbered from
+//                              0 in the order they appear
+//  a <from> <to> <seconds>     a one way arc between two nodes
+//
+// After loading, every node is contracted in turn, least important first,
+// adding shortcut arcs wherever a shortest path ran through it. Queries
+// then only ever go up the order, from both ends, and meet near the top:
+// a few hundred nodes are touched instead of a city's worth.
+//
+// Both halves of the result are stored in CSR form, arcs to higher nodes
+// from each node and arcs from higher nodes into each node, with nodes
+// renumbered by contraction order so the top of the hierarchy, where all
+// searches end up, shares cache lines.
+//
+// Times are in milliseconds. Queries are const and run on any number of
+// threads at once, each thread keeps its own search state.
+class CRoadGraph
+{
+	public:
+		static constexpr uint32_t nUnreachable = UINT32_MAX;
+		static constexpr uint32_t nNoNode = UINT32_MAX;
+
+		CRoadGraph();
+		CRoadGraph(const CRoadGraph&) = delete;
+
+		// Reads the file and contracts it, false if it cannot be read or
+		// names a node that does not exist
+		bool load(const std::string& strPath);
+
+		// The same from memory, arcs as (from, to, milliseconds)
+		struct arc_spec
+		{
+			uint32_t nFrom;
+			uint32_t nTo;
+			uint32_t nMillis;
+		};
+		bool build(const std::vector<int32_t>& vecLat, const std::vector<int32_t>& vecLon, const std::vector<arc_spec>& vecArcs);
+
+		size_t nodes() const { return m_vecLat.size(); }
+		size_t shortcuts() const { return m_nShortcuts; }
+
+		// Node nearest to a point within fMaxMeters, nNoNode if none
+		uint32_t nearestNode(int32_t nLat, int32_t nLon, double fMaxMeters, float* pMeters = nullptr) const;
+
+		// Shortest travel time between two nodes
+		uint32_t travelTime(uint32_t nFrom, uint32_t nTo) const;
+
+		// From every one of pFrom to nTo, or from nFrom to every one of pTo.
+		// The single end is searched once, then each of the others only up
+		// to where it meets that search
+		void manyToOne(const uint32_t* pFrom, size_t n, uint32_t nTo, uint32_t* pOut) const;
+		void oneToMany(uint32_t nFrom, const uint32_t* pTo, size_t n, uint32_t* pOut) const;
+
+	private:
+		// Per thread distances of one search, see road_graph.cpp
+		struct search_space;
+
+		// One direction of the hierarchy: arcs [vecFirst[v], vecFirst[v + 1])
+		// of node v, in contraction order numbering
+		struct csr
+		{
+			std::vector<uint32_t> vecFirst;
+			std::vector<uint32_t> vecHead;
+			std::vector<uint32_t> vecWeight;
+		};
+
+		void contract(const std::vector<arc_spec>& vecArcs);
+
+		// Stall on demand: v, reached at d going up g, is reached quicker
+		// through a higher node, down an arc of the opposite direction. No
+		// shortest path goes on from v then, its arcs are not followed
+		bool stalled(const csr& opposite, uint32_t v, uint32_t d, const search_space& space) const;
+
+		// Complete search of the nodes above nFrom in g, for the single end
+		// of manyToOne() and oneToMany()
+		void searchAll(const csr& g, const csr& opposite, uint32_t nFrom, search_space& space) const;
+
+		// Search of g from nFrom that stops once nothing closer than the
+		// best meeting with the complete search in other can come up
+		uint32_t searchTo(const csr& g, const csr& opposite, uint32_t nFrom, const search_space& other, search_space& space) const;
+
+		// Original node id to position in contraction order
+		std::vector<uint32_t> m_vecRank;
+
+		csr m_up;
+		csr m_down;
+		size_t m_nShortcuts = 0;
+
+		// By original id, and indexed in the grid for snapping points
+		std::vector<int32_t> m_vecLat;
+		std::vector<int32_t> m_vecLon;
+		std::unique_ptr<CSpatialGrid> m_pNodes;
+};
@@ -0,0 +1,295 @@
+#include <algorithm>
+#include <cmath>
+
+#include "spatial_grid.h"
+
+namespace
+{
+	// Metres per degree along a meridian, and along the equator
+	constexpr double fMetersPerDegree = 111320.0;
+	constexpr double fUnitsPerDegree = 1e7;
+	constexpr double fPi = 3.14159265358979323846;
+
+	bool byDistance(const spatial_hit& a, const spatial_hit& b)
+	{
+		return a.fMeters < b.fMeters;
+	}
+}
+
+CSpatialGrid::CSpatialGrid(double fCellMeters, size_t nBuckets)
+{
+	m_nCellUnits = std::max<int64_t>(1, int64_t(fCellMeters / fMetersPerDegree * fUnitsPerDegree));
+
+	size_t nSize = 1;
+	while (nSize < nBuckets)
+		nSize *= 2;
+	m_aBuckets.reset(new bucket[nSize]);
+	m_nBucketMask = nSize - 1;
+}
+
+size_t CSpatialGrid::bucket::find(uint32_t nId) const
+{
+	for (size_t i = 0; i < vecIds.size(); i++)
+	{
+		if (vecIds[i] == nId)
+			return i;
+	}
+	return vecIds.size();
+}
+
+void CSpatialGrid::bucket::erase(size_t i)
+{
+	// Order within a bucket does not matter, move the last entry here
+	size_t nLast = vecIds.size() - 1;
+	vecIds[i] = vecIds[nLast];
+	vecCells[i] = vecCells[nLast];
+	vecLat[i] = vecLat[nLast];
+	vecLon[i] = vecLon[nLast];
+	vecTimes[i] = vecTimes[nLast];
+
+	vecIds.pop_back();
+	vecCells.pop_back();
+	vecLat.pop_back();
+	vecLon.pop_back();
+	vecTimes.pop_back();
+}
+
+CSpatialGrid::bucket& CSpatialGrid::bucketOf(uint64_t nCell) const
+{
+	// Fibonacci hashing, neighbouring cells land far apart
+	return m_aBuckets[size_t((nCell * 0x9E3779B97F4A7C15ull) >> 32) & m_nBucketMask];
+}
+
+void CSpatialGrid::update(uint32_t nId, int32_t nLat, int32_t nLon, uint64_t nTime)
+{
+	uint64_t nCell = cellKey(row(nLat), col(nLon));
+
+	std::lock_guard<std::mutex> lock(m_mxWriters);
+
+	auto it = m_mapCells.find(nId);
+	if (it != m_mapCells.end())
+	{
+		bucket& from = bucketOf(it->second);
+		bucket& to = bucketOf(nCell);
+
+		// Same bucket, possibly another cell of it: moves in place
+		if (&from == &to)
+		{
+			std::unique_lock<std::shared_mutex> ul(from.mx);
+			size_t i = from.find(nId);
+			from.vecCells[i] = nCell;
+			from.vecLat[i] = nLat;
+			from.vecLon[i] = nLon;
+			from.vecTimes[i] = nTime;
+			it->second = nCell;
+			return;
+		}
+
+		// Both held, so no reader sees the vehicle in both buckets
+		std::unique_lock<std::shared_mutex> ulFrom(from.mx, std::defer_lock);
+		std::unique_lock<std::shared_mutex> ulTo(to.mx, std::defer_lock);
+		std::lock(ulFrom, ulTo);
+
+		from.erase(from.find(nId));
+		to.vecIds.push_back(nId);
+		to.vecCells.push_back(nCell);
+		to.vecLat.push_back(nLat);
+		to.vecLon.push_back(nLon);
+		to.vecTimes.push_back(nTime);
+		it->second = nCell;
+		return;
+	}
+
+	bucket& to = bucketOf(nCell);
+	std::unique_lock<std::shared_mutex> ul(to.mx);
+	to.vecIds.push_back(nId);
+	to.vecCells.push_back(nCell);
+	to.vecLat.push_back(nLat);
+	to.vecLon.push_back(nLon);
+	to.vecTimes.push_back(nTime);
+	m_mapCells.emplace(nId, nCell);
+}
+
+bool CSpatialGrid::remove(uint32_t nId)
+{
+	std::lock_guard<std::mutex> lock(m_mxWriters);
+
+	auto it = m_mapCells.find(nId);
+	if (it == m_mapCells.end())
+		return false;
+
+	bucket& b = bucketOf(it->second);
+	std::unique_lock<std::shared_mutex> ul(b.mx);
+	b.erase(b.find(nId));
+	m_mapCells.erase(it);
+	return true;
+}
+
+size_t CSpatialGrid::removeOlderThan(uint64_t nTime)
+{
+	std::lock_guard<std::mutex> lock(m_mxWriters);
+
+	size_t nRemoved = 0;
+	for (size_t n = 0; n <= m_nBucketMask; n++)
+	{
+		bucket& b = m_aBuckets[n];
+		std::unique_lock<std::shared_mutex> ul(b.mx);
+
+		// Backwards, erase() moves the last entry into the hole
+		for (size_t i = b.vecIds.size(); i > 0; i--)
+		{
+			if (b.vecTimes[i - 1] >= nTime)
+				continue;
+
+			m_mapCells.erase(b.vecIds[i - 1]);
+			b.erase(i - 1);
+			nRemoved++;
+		}
+	}
+	return nRemoved;
+}
+
+size_t CSpatialGrid::size() const
+{
+	std::lock_guard<std::mutex> lock(m_mxWriters);
+	return m_mapCells.size();
+}
+
+CSpatialGrid::query_frame CSpatialGrid::frame(int32_t nLat, int32_t nLon) const
+{
+	query_frame q;
+	q.nRow = row(nLat);
+	q.nCol = col(nLon);
+	q.fLat = double(nLat);
+	q.fLon = double(nLon);
+	q.fMetersPerLat = fMetersPerDegree / fUnitsPerDegree;
+	q.fMetersPerLon = q.fMetersPerLat * std::cos(double(nLat) / fUnitsPerDegree * fPi / 180.0);
+	q.fCellHeight = double(m_nCellUnits) * q.fMetersPerLat;
+	q.fCellWidth = double(m_nCellUnits) * q.fMetersPerLon;
+	return q;
+}
+
+template<typename F>
+void CSpatialGrid::scanCell(const query_frame& q, int64_t nRow, int64_t nCol, double fMaxSq, F&& fn) const
+{
+	uint64_t nCell = cellKey(nRow, nCol);
+	const bucket& b = bucketOf(nCell);
+
+	std::shared_lock<std::shared_mutex> sl(b.mx);
+
+	const size_t nCount = b.vecIds.size();
+	const uint64_t* pCells = b.vecCells.data();
+	const int32_t* pLat = b.vecLat.data();
+	const int32_t* pLon = b.vecLon.data();
+	for (size_t i = 0; i < nCount; i++)
+	{
+		if (pCells[i] != nCell)
+			continue;
+
+		double dy = (double(pLat[i]) - q.fLat) * q.fMetersPerLat;
+		double dx = (double(pLon[i]) - q.fLon) * q.fMetersPerLon;
+		double fSq = dx * dx + dy * dy;
+		if (fSq <= fMaxSq)
+			fn(b.vecIds[i], pLat[i], pLon[i], fSq);
+	}
+}
+
+size_t CSpatialGrid::nearest(int32_t nLat, int32_t nLon, size_t k, std::vector<spatial_hit>& vecOut, double fMaxMeters) const
+{
+	vecOut.clear();
+	if (k == 0)
+		return 0;
+
+	query_frame q = frame(nLat, nLon);
+	double fMaxSq = fMaxMeters * fMaxMeters;
+	double fStep = std::min(q.fCellWidth, q.fCellHeight);
+
+	// vecOut is a max-heap on squared distance until the end, its front
+	// is the candidate to beat
+	auto offer = [&](uint32_t nId, int32_t nHitLat, int32_t nHitLon, double fSq)
+	{
+		if (vecOut.size() == k && fSq >= vecOut.front().fMeters)
+			return;
+
+		// Seen already if it moved between two cells we scanned
+		for (const spatial_hit& hit : vecOut)
+		{
+			if (hit.nId == nId)
+				return;
+		}
+
+		if (vecOut.size() == k)
+		{
+			std::pop_heap(vecOut.begin(), vecOut.end(), byDistance);
+			vecOut.pop_back();
+		}
+		vecOut.push_back({ nId, nHitLat, nHitLon, float(fSq) });
+		std::push_heap(vecOut.begin(), vecOut.end(), byDistance);
+	};
+
+	// Rings of cells around the query's own. Everything in ring n is at
+	// least n - 1 cells away, once that is further than the k-th best
+	// candidate, or than fMaxMeters, no later ring can do better
+	for (int64_t n = 0; ; n++)
+	{
+		double fBound = n > 0 ? double(n - 1) * fStep : 0.0;
+		if (fBound > fMaxMeters)
+			break;
+		if (vecOut.size() == k && fBound * fBound > vecOut.front().fMeters)
+			break;
+
+		if (n == 0)
+		{
+			scanCell(q, q.nRow, q.nCol, fMaxSq, offer);
+			continue;
+		}
+
+		for (int64_t c = q.nCol - n; c <= q.nCol + n; c++)
+		{
+			scanCell(q, q.nRow - n, c, fMaxSq, offer);
+			scanCell(q, q.nRow + n, c, fMaxSq, offer);
+		}
+		for (int64_t r = q.nRow - n + 1; r < q.nRow + n; r++)
+		{
+			scanCell(q, r, q.nCol - n, fMaxSq, offer);
+			scanCell(q, r, q.nCol + n, fMaxSq, offer);
+		}
+	}
+
+	std::sort_heap(vecOut.begin(), vecOut.end(), byDistance);
+	for (spatial_hit& hit : vecOut)
+		hit.fMeters = std::sqrt(hit.fMeters);
+	return vecOut.size();
+}
+
+size_t CSpatialGrid::within(int32_t nLat, int32_t nLon, double fMeters, std::vector<spatial_hit>& vecOut) const
+{
+	vecOut.clear();
+
+	query_frame q = frame(nLat, nLon);
+	double fMaxSq = fMeters * fMeters;
+	int64_t nCols = int64_t(std::ceil(fMeters / q.fCellWidth));
+	int64_t nRows = int64_t(std::ceil(fMeters / q.fCellHeight));
+
+	for (int64_t r = q.nRow - nRows; r <= q.nRow + nRows; r++)
+	{
+		for (int64_t c = q.nCol - nCols; c <= q.nCol + nCols; c++)
+		{
+			scanCell(q, r, c, fMaxSq, [&](uint32_t nId, int32_t nHitLat, int32_t nHitLon, double fSq)
+			{
+				vecOut.push_back({ nId, nHitLat, nHitLon, float(fSq) });
+			});
+		}
+	}
+
+	// A vehicle that moved between two scanned cells is in twice, keep
+	// the first
+	std::sort(vecOut.begin(), vecOut.end(), [](const spatial_hit& a, const spatial_hit& b) { return a.nId < b.nId; });
+	vecOut.erase(std::unique(vecOut.begin(), vecOut.end(),
+		[](const spatial_hit& a, const spatial_hit& b) { return a.nId == b.nId; }), vecOut.end());
+
+	std::sort(vecOut.begin(), vecOut.end(), byDistance);
+	for (spatial_hit& hit : vecOut)
+		hit.fMeters = std::sqrt(hit.fMeters);
+	return vecOut.size();
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+// A vehicle found by a query, nearest first
+struct spatial_hit
+{
+	uint32_t nId = 0;
+	int32_t nLat = 0;
+	int32_t nLon = 0;
+	float fMeters = 0.0f;
+};
+
+// Live positions of vehicles on a uniform grid of lat/lon cells.
+//
+// The grid has no bounds: a cell is hashed into one of a fixed number of
+// buckets, and an entry remembers its cell, so a query scanning a cell
+// skips entries of other cells sharing the bucket. Every bucket keeps its
+// entries as parallel arrays (ids, cells, coordinates, times), so a scan
+// runs through a few contiguous arrays instead of chasing pointers.
+//
+// Coordinates are fixed point in units of 1e-7 degrees, like vehicle_state.
+// Distances are planar around the query point, good to well under a metre
+// at city scale.
+//
+// Updates take a writer mutex, so they are serialised, and then lock only
+// the buckets they touch. Queries never take the writer mutex, they share
+// the lock of one bucket at a time. A vehicle that moves to another cell
+// while a query runs may be missed by it, it is never reported twice.
+class CSpatialGrid
+{
+	public:
+		// fCellMeters is the cell edge along a meridian. nBuckets is rounded
+		// up to a power of two, a few times the number of vehicles keeps
+		// buckets short
+		explicit CSpatialGrid(double fCellMeters = 250.0, size_t nBuckets = 16384);
+		CSpatialGrid(const CSpatialGrid&) = delete;
+
+		// Insert or move a vehicle. nTime is whatever clock the caller
+		// uses, it is only compared in removeOlderThan()
+		void update(uint32_t nId, int32_t nLat, int32_t nLon, uint64_t nTime);
+		bool remove(uint32_t nId);
+
+		// Drop vehicles not updated since nTime, returns how many
+		size_t removeOlderThan(uint64_t nTime);
+
+		// Up to k vehicles nearest to the point and no further away than
+		// fMaxMeters, nearest first. vecOut is reused, so a caller keeping
+		// it around does not allocate per query. Returns the count
+		size_t nearest(int32_t nLat, int32_t nLon, size_t k, std::vector<spatial_hit>& vecOut,
+			double fMaxMeters = 5000.0) const;
+
+		// Every vehicle within fMeters of the point, nearest first
+		size_t within(int32_t nLat, int32_t nLon, double fMeters, std::vector<spatial_hit>& vecOut) const;
+
+		size_t size() const;
+
+	private:
+		struct bucket
+		{
+			mutable std::shared_mutex mx;
+			std::vector<uint32_t> vecIds;
+			std::vector<uint64_t> vecCells;
+			std::vector<int32_t> vecLat;
+			std::vector<int32_t> vecLon;
+			std::vector<uint64_t> vecTimes;
+
+			size_t find(uint32_t nId) const;
+			void erase(size_t i);
+		};
+
+		// Where a query point sits and how big its cells are there
+		struct query_frame
+		{
+			int64_t nRow;
+			int64_t nCol;
+			double fLat;
+			double fLon;
+			double fMetersPerLat;
+			double fMetersPerLon;
+			double fCellWidth;
+			double fCellHeight;
+		};
+
+		query_frame frame(int32_t nLat, int32_t nLon) const;
+
+		// Counted from the south pole and the antimeridian, never negative
+		int64_t row(int32_t nLat) const { return (int64_t(nLat) + 900000000) / m_nCellUnits; }
+		int64_t col(int32_t nLon) const { return (int64_t(nLon) + 1800000000) / m_nCellUnits; }
+
+		static uint64_t cellKey(int64_t nRow, int64_t nCol) { return (uint64_t(nRow) << 32) | uint32_t(nCol); }
+		bucket& bucketOf(uint64_t nCell) const;
+
+		// Test every entry of one cell against the point, calling fn with
+		// the id, position and squared distance of those within fMaxSq
+		template<typename F>
+		void scanCell(const query_frame& q, int64_t nRow, int64_t nCol, double fMaxSq, F&& fn) const;
+
+		// Cell edge in 1e-7 degrees, the same along both axes
+		int64_t m_nCellUnits;
+
+		std::unique_ptr<bucket[]> m_aBuckets;
+		size_t m_nBucketMask;
+
+		// Writers only: the cell each vehicle is in
+		mutable std::mutex m_mxWriters;
+		std::unordered_map<uint32_t, uint64_t> m_mapCells;
+};
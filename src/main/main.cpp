@@ -1,8 +1,15 @@
+#include <chrono>
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <mutex>
 #include <unordered_map>
 #include "server/server.h"
+#include "server/pickup_frame.h"
+#include "server/vehicle_codec.h"
+#include "dispatch/matcher.h"
+#include "geo/road_eta.h"
+#include "geo/spatial_grid.h"
 
 
 struct client_desc
@@ -16,7 +23,9 @@ struct client_desc
 class CListener : public CServer
 {
 	public:
-		CListener(uint32_t port) : CServer(port)
+		CListener(uint32_t port) : CServer(port),
+			m_roadEta(m_roads, m_etaCache),
+			m_matcher(m_grid, 2, [this](const pickup_assignment& assignment) { OnPickupAssigned(assignment); }, loadRoads())
 		{
 			m_text.open("books.txt", std::ofstream::app);
 			if (m_text.is_open())
@@ -24,43 +33,114 @@ class CListener : public CServer
 				std::cout << "Great! opened!" << std::endl;
 				m_text.flush();
 			}
+
+			m_matcher.start();
 		}
 
+		// Disconnects come from the asio threads
+		std::mutex m_mxClients;
 		std::unordered_map<uint32_t, client_desc> m_mapClients;
 	protected:
-		bool OnClientConnect(std::shared_ptr<CConnection> client) override
+		bool OnClientConnect(connection_handle client) override
 		{
 			// For now we will allow all
 			return true;
 		}
 
-		void OnClientValidated(std::shared_ptr<CConnection> client) override
+		void OnClientValidated(connection_handle client) override
 		{
 			// Client passed validation check, so send them a message informing
 			// them they can continue to communicate
 			std::string msg = "Hello, I am a server, please wellcome!\n";
-			client->send(msg);
+			messageClient(client, msg);
+		}
+
+		void OnClientAdopted(connection_handle client) override
+		{
+			// Came over from the process we replaced, already validated
+			CConnection* conn = getConnection(client);
+			if (conn)
+				std::cout << "[" << conn->getID() << "] Taken over" << std::endl;
 		}
 
-		void OnClientDisconnect(std::shared_ptr<CConnection> client) override
+		void OnClientDisconnect(connection_handle client) override
 		{
-			if (client)
+			// Nobody left to tell about a vehicle
+			m_matcher.cancelAll(pickupTag(client));
+
+			// Its vehicles may report again over a new connection
+			{
+				std::lock_guard<std::mutex> lock(m_mxVehicles);
+				for (auto it = m_mapVehicleOwners.begin(); it != m_mapVehicleOwners.end();)
+				{
+					if (it->second == client)
+						it = m_mapVehicleOwners.erase(it);
+					else
+						++it;
+				}
+			}
+
+			CConnection* conn = getConnection(client);
+			if (conn)
 			{
-				if (m_mapClients.find(client->getID()) == m_mapClients.end())
+				std::lock_guard<std::mutex> lock(m_mxClients);
+				if (m_mapClients.find(conn->getID()) == m_mapClients.end())
 				{
 					// client never added to roster, so just let it disappear
 				}
 				else
 				{
-					auto& pd = m_mapClients[client->getID()];
+					auto& pd = m_mapClients[conn->getID()];
 					std::cout << "[UNGRACEFUL REMOVAL]:" + std::to_string(pd.uID) + "\n";
-					m_mapClients.erase(client->getID());
+					m_mapClients.erase(conn->getID());
 				}
 			}
 		}
 
-		void OnMessage(std::shared_ptr<CConnection> client, std::string& msg) override
+		void OnMessage(connection_handle client, owned_message& msg) override
 		{
+			// Position reports only feed the grid, they are not logged
+			if (msg.type == vehicle_frame::nMarker)
+			{
+				if (!binaryFramed(client) || !vehicle_frame::isRaw(msg))
+					return;
+
+				// Stamped with our own clock, which the matcher ages the
+				// grid by, not with whatever the vehicle's clock says
+				vehicle_state state = vehicle_frame::decode(msg);
+				if (!ownsVehicle(client, state.nVehicle))
+					return;
+
+				m_grid.update(state.nVehicle, state.nLat, state.nLon, steadyMillis());
+				return;
+			}
+
+			// Pickup requests wait for the matcher's next window, so do
+			// cancels and vehicles coming free
+			if (msg.type == pickup_frame::nMarker)
+			{
+				if (!binaryFramed(client) || msg.size() != pickup_frame::nSize)
+					return;
+
+				pickup_frame frame = pickup_frame::decode(msg.data());
+				uint64_t nTag = pickupTag(client);
+				if (frame.nOp == 'R')
+				{
+					pickup_request request;
+					request.nRequest = frame.nRequest;
+					request.nTag = nTag;
+					request.nLat = frame.nLat;
+					request.nLon = frame.nLon;
+					request.nArrived = steadyMillis();
+					m_matcher.submit(request);
+				}
+				else if (frame.nOp == 'C')
+					m_matcher.cancel(nTag, frame.nRequest);
+				else if (frame.nOp == 'D' && ownsVehicle(client, frame.nVehicle))
+					m_matcher.release(frame.nVehicle);
+				return;
+			}
+
 			std::cout << "Hey! we received a message: " << msg << std::endl;
 			if (m_text.is_open())
 			{
@@ -70,8 +150,98 @@ class CListener : public CServer
 			else
 			std::cout << "text file is not opened, sorry!!!" << std::endl;
 		}
+		// Road travel times for the matcher if there is a road graph,
+		// straight lines otherwise
+		CMatcher::eta_t loadRoads()
+		{
+			if (!m_roads.load("roads.txt"))
+				return nullptr;
+
+			std::cout << "Roads: " << m_roads.nodes() << " nodes, " << m_roads.shortcuts() << " shortcuts" << std::endl;
+			return [this](int32_t nLat, int32_t nLon, const spatial_hit* pFrom, size_t nFrom, uint32_t* pSeconds)
+			{
+				m_roadEta.toPoint(nLat, nLon, pFrom, nFrom, pSeconds);
+			};
+		}
+
+		// On the matcher's window thread. Requests only come from clients
+		// with binary framing, so the reply can go out as it is
+		void OnPickupAssigned(const pickup_assignment& assignment)
+		{
+			connection_handle client;
+			client.nSlot = uint32_t(assignment.nTag >> 32);
+			client.nGeneration = uint32_t(assignment.nTag);
+
+			// Gone between the request and now, after its requests were
+			// cancelled. The vehicle would stay busy with nobody to release it
+			if (assignment.bMatched)
+			{
+				epoch_guard guard;
+				CConnection* conn = getConnection(client);
+				if (!conn || !conn->isConnected())
+				{
+					m_matcher.release(assignment.nVehicle);
+					return;
+				}
+			}
+
+			pickup_frame frame;
+			frame.nOp = assignment.bMatched ? 'A' : 'N';
+			frame.nRequest = assignment.nRequest;
+			frame.nVehicle = assignment.nVehicle;
+			frame.nEta = assignment.nEta;
+			messageClient(client, frame.encode());
+		}
+
 	private:
+		// Binary frames may contain newlines, text framing would split them
+		bool binaryFramed(connection_handle client)
+		{
+			CConnection* conn = getConnection(client);
+			return conn && (conn->getCapabilities() & capabilities::nBinaryFraming);
+		}
+
+		// A vehicle belongs to the connection that reported it first, only
+		// that one may move it or free it. A connection that is gone, or
+		// about to be, loses it to the next one
+		bool ownsVehicle(connection_handle client, uint32_t nVehicle)
+		{
+			std::lock_guard<std::mutex> lock(m_mxVehicles);
+			auto inserted = m_mapVehicleOwners.emplace(nVehicle, client);
+			if (inserted.second || inserted.first->second == client)
+				return true;
+
+			CConnection* owner = getConnection(inserted.first->second);
+			if (owner && owner->isConnected())
+				return false;
+
+			inserted.first->second = client;
+			return true;
+		}
+
+		// What the matcher knows a client's requests by
+		static uint64_t pickupTag(connection_handle client)
+		{
+			return (uint64_t(client.nSlot) << 32) | client.nGeneration;
+		}
+
+		static uint64_t steadyMillis()
+		{
+			return uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count());
+		}
+
 		std::ofstream m_text;
+		CRoadGraph m_roads;
+		CEtaCache m_etaCache;
+		CRoadEta m_roadEta;
+		CSpatialGrid m_grid;
+		CMatcher m_matcher;
+
+		// Vehicle id to the connection reporting it. Disconnects come from
+		// the asio threads
+		std::mutex m_mxVehicles;
+		std::unordered_map<uint32_t, connection_handle> m_mapVehicleOwners;
 };
 
 int main(int argc, char** argv)
@@ -79,10 +249,23 @@ int main(int argc, char** argv)
 	std::cout << "The program is running!" << std::endl;
 
 	CListener server(5566);
-	server.start();
 
-	while(1)
+	// Starting a second instance with --hot-restart hands everything over
+	// to it, and this one exits. To try it on one machine: start main
+	// --hot-restart, connect a client and keep it talking, then start a
+	// second main --hot-restart from a newer build. The first one logs
+	// "Handed over, retiring" and exits, the second "Adopted [id]" for
+	// each client, and the clients stay connected and keep their replies,
+	// including those to messages the first one was still handling
+	if (argc > 1 && std::string(argv[1]) == "--hot-restart")
+		server.setHotRestart("/tmp/pickmeup-5566.sock");
+
+	if (!server.start())
+		return 1;
+
+	while (!server.retired())
 		server.update();
 
+	server.stop();
 	return 0;
 }
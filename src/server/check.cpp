@@ -0,0 +1,248 @@
+#include <cstdio>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "conflating_queue.h"
+#include "vehicle_codec.h"
+
+// Self checks, run by ctest: vehicle states survive CVehicleEncoder for a
+// client that decodes them as vehicle_codec.h describes, and CKeyIndex
+// stays in step with a std::unordered_map through inserts and erases.
+// Prints what failed and exits non-zero.
+namespace
+{
+	size_t g_nFailed = 0;
+
+	void check(bool bOk, const char* pWhat)
+	{
+		if (!bOk)
+		{
+			std::printf("FAIL: %s\n", pWhat);
+			g_nFailed++;
+		}
+	}
+
+	// The client side of the wire format
+	struct reader
+	{
+		const uint8_t* p;
+		const uint8_t* pEnd;
+
+		bool bad = false;
+
+		uint64_t varint()
+		{
+			uint64_t nValue = 0;
+			for (size_t nShift = 0; nShift < 64; nShift += 7)
+			{
+				if (p == pEnd)
+					break;
+				uint8_t n = *p++;
+				nValue |= uint64_t(n & 0x7F) << nShift;
+				if (!(n & 0x80))
+					return nValue;
+			}
+			bad = true;
+			return 0;
+		}
+
+		int64_t zigzag()
+		{
+			uint64_t n = varint();
+			return int64_t(n >> 1) ^ -int64_t(n & 1);
+		}
+
+		uint8_t byte()
+		{
+			if (p == pEnd)
+			{
+				bad = true;
+				return 0;
+			}
+			return *p++;
+		}
+	};
+
+	// Applies one encoded frame to what the client knows, false if it does
+	// not parse or refers to a vehicle the client never got in full
+	bool apply(const owned_message& msg, std::unordered_map<uint32_t, vehicle_state>& mapKnown, uint32_t& nVehicle)
+	{
+		reader r{ reinterpret_cast<const uint8_t*>(msg.data()), reinterpret_cast<const uint8_t*>(msg.data()) + msg.size() };
+		if (r.byte() != vehicle_frame::nMarker)
+			return false;
+
+		uint8_t nOp = r.byte();
+		nVehicle = uint32_t(r.varint());
+		if (nOp == 'F')
+		{
+			vehicle_state& state = mapKnown[nVehicle];
+			state.nVehicle = nVehicle;
+			state.nRoute = uint32_t(r.varint());
+			state.nLat = int32_t(r.zigzag());
+			state.nLon = int32_t(r.zigzag());
+			state.nHeading = uint16_t(r.varint());
+			state.nSpeed = uint16_t(r.varint());
+			state.nOccupancy = r.byte();
+			state.nTime = r.varint();
+		}
+		else if (nOp == 'D')
+		{
+			auto it = mapKnown.find(nVehicle);
+			if (it == mapKnown.end())
+				return false;
+
+			vehicle_state& state = it->second;
+			uint8_t nMask = r.byte();
+			if (nMask & vehicle_frame::nRouteChanged)
+				state.nRoute = uint32_t(r.varint());
+			if (nMask & vehicle_frame::nLatChanged)
+				state.nLat = int32_t(state.nLat + r.zigzag());
+			if (nMask & vehicle_frame::nLonChanged)
+				state.nLon = int32_t(state.nLon + r.zigzag());
+			if (nMask & vehicle_frame::nHeadingChanged)
+				state.nHeading = uint16_t(r.varint());
+			if (nMask & vehicle_frame::nSpeedChanged)
+				state.nSpeed = uint16_t(r.varint());
+			if (nMask & vehicle_frame::nOccupancyChanged)
+				state.nOccupancy = r.byte();
+			if (nMask & vehicle_frame::nTimeChanged)
+				state.nTime = uint64_t(int64_t(state.nTime) + r.zigzag());
+		}
+		else
+			return false;
+
+		return !r.bad && r.p == r.pEnd;
+	}
+
+	bool same(const vehicle_state& a, const vehicle_state& b)
+	{
+		return a.nVehicle == b.nVehicle && a.nRoute == b.nRoute && a.nLat == b.nLat && a.nLon == b.nLon
+			&& a.nHeading == b.nHeading && a.nSpeed == b.nSpeed && a.nOccupancy == b.nOccupancy && a.nTime == b.nTime;
+	}
+
+	void checkVehicleCodec()
+	{
+		std::mt19937 rng(11);
+		std::uniform_int_distribution<int32_t> step(-2000, 2000);
+
+		// A few vehicles moving about, some fields changing rarely
+		std::vector<vehicle_state> vecFleet(20);
+		for (size_t v = 0; v < vecFleet.size(); v++)
+		{
+			vecFleet[v].nVehicle = uint32_t(v * 1000 + 1);
+			vecFleet[v].nRoute = uint32_t(rng() % 50);
+			vecFleet[v].nLat = 557500000 + step(rng) * 100;
+			vecFleet[v].nLon = -376000000 + step(rng) * 100;
+			vecFleet[v].nTime = 1700000000000ull;
+		}
+
+		for (bool bDeltas : { true, false })
+		{
+			CVehicleEncoder encoder;
+			std::unordered_map<uint32_t, vehicle_state> mapKnown;
+			size_t nDeltas = 0;
+			uint64_t nNow = 1;
+
+			for (size_t i = 0; i < 5000; i++)
+			{
+				vehicle_state& state = vecFleet[rng() % vecFleet.size()];
+				state.nLat += step(rng);
+				state.nLon += step(rng);
+				state.nTime += 1000 + rng() % 500;
+				if (rng() % 10 == 0)
+					state.nHeading = uint16_t(rng() % 360);
+				if (rng() % 10 == 0)
+					state.nSpeed = uint16_t(rng() % 3000);
+				if (rng() % 50 == 0)
+					state.nOccupancy = uint8_t(rng() % 4);
+				if (rng() % 200 == 0)
+					state.nRoute = uint32_t(rng() % 50);
+
+				owned_message msg = vehicle_frame::encode(state);
+				check(vehicle_frame::isRaw(msg) && same(vehicle_frame::decode(msg), state), "raw form round trips");
+
+				nNow += 1000000;
+				encoder.encode(msg, nNow, bDeltas);
+				nDeltas += msg.data()[1] == 'D';
+
+				uint32_t nVehicle = 0;
+				check(apply(msg, mapKnown, nVehicle), "encoded frame parses");
+				check(nVehicle == state.nVehicle && same(mapKnown[nVehicle], state), "client ends up with the state sent");
+			}
+
+			if (bDeltas)
+				check(nDeltas > 0, "deltas are used when allowed");
+			else
+				check(nDeltas == 0, "only full records without delta encoding");
+		}
+
+		// Unsent raw states kept for a session go out in full
+		vehicle_state state = vecFleet[0];
+		owned_message msg = vehicle_frame::encode(state);
+		vehicle_frame::toFull(msg);
+		std::unordered_map<uint32_t, vehicle_state> mapKnown;
+		uint32_t nVehicle = 0;
+		check(msg.data()[1] == 'F' && apply(msg, mapKnown, nVehicle) && same(mapKnown[nVehicle], state), "toFull makes a full record");
+	}
+
+	void checkKeyIndex()
+	{
+		std::mt19937 rng(5);
+		CKeyIndex index;
+		std::unordered_map<uint64_t, uint64_t> mapExpected;
+
+		// Few distinct keys, random so that probe runs form and erases
+		// have to shift entries back. Sequential ones hash without a clash
+		std::vector<uint64_t> vecKeys(300);
+		for (uint64_t& nKey : vecKeys)
+			nKey = (uint64_t(rng()) << 32 | rng()) | 1;
+
+		for (uint64_t nSeq = 0; nSeq < 200000; nSeq++)
+		{
+			uint64_t nKey = vecKeys[rng() % vecKeys.size()];
+			if (rng() % 3 == 0)
+			{
+				index.erase(nKey);
+				mapExpected.erase(nKey);
+			}
+			else
+			{
+				index.insert(nKey, nSeq);
+				mapExpected[nKey] = nSeq;
+			}
+
+			if (nSeq % 1000 != 0)
+				continue;
+
+			bool bSame = index.size() == mapExpected.size();
+			for (size_t i = 0; bSame && i < vecKeys.size(); i++)
+			{
+				uint64_t k = vecKeys[i];
+				uint64_t nFound = 0;
+				auto it = mapExpected.find(k);
+				bool bFound = index.find(k, nFound);
+				bSame = bFound == (it != mapExpected.end()) && (!bFound || nFound == it->second);
+			}
+			check(bSame, "key index agrees with unordered_map");
+		}
+
+		index.clear();
+		uint64_t nIgnored;
+		check(index.size() == 0 && !index.find(1, nIgnored), "cleared key index is empty");
+	}
+}
+
+int main()
+{
+	checkVehicleCodec();
+	checkKeyIndex();
+
+	if (g_nFailed != 0)
+	{
+		std::printf("%zu checks failed\n", g_nFailed);
+		return 1;
+	}
+	std::printf("server: all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <time.h>
+
+// Monotonic time in nanoseconds from CLOCK_MONOTONIC_COARSE: a few
+// milliseconds of resolution, read from the vDSO without a syscall. Good
+// enough for message ages and deadlines, cheap enough to call per message.
+struct coarse_clock
+{
+	static uint64_t now()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+		return uint64_t(ts.tv_sec) * 1000000000ull + uint64_t(ts.tv_nsec);
+	}
+
+	// Nanoseconds between two ticks of now(), 1 to 4 ms depending on the
+	// kernel's HZ
+	static uint64_t resolution()
+	{
+		static const uint64_t nResolution = []()
+		{
+			timespec ts;
+			clock_getres(CLOCK_MONOTONIC_COARSE, &ts);
+			return uint64_t(ts.tv_sec) * 1000000000ull + uint64_t(ts.tv_nsec);
+		}();
+		return nResolution;
+	}
+
+	static uint64_t toNanos(std::chrono::nanoseconds duration)
+	{
+		return duration.count() > 0 ? uint64_t(duration.count()) : 0;
+	}
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Overload detector for a queue, after CoDel (RFC 8289). It looks at the
+// sojourn time of every message taken off the queue. A queue that is merely
+// absorbing a burst drains back under the target within one interval; if
+// even the best sojourn time of a whole interval is above the target the
+// queue is standing, the consumer cannot keep up, and the detector enters
+// the overloaded state until a message gets through under the target again.
+//
+// Unlike CoDel proper it does not pace single drops by its control law.
+// While overloaded the caller sheds everything it considers low priority and
+// turns new clients away, the goal being bounded latency for what is left.
+class CCoDel
+{
+	public:
+		CCoDel(uint64_t nTarget, uint64_t nInterval): m_nTarget(nTarget), m_nInterval(nInterval)
+		{
+		}
+
+		void configure(uint64_t nTarget, uint64_t nInterval)
+		{
+			m_nTarget = nTarget;
+			m_nInterval = nInterval;
+		}
+
+		// Feed one dequeued message, returns whether the queue is overloaded
+		bool onDequeue(uint64_t nSojourn, uint64_t nNow)
+		{
+			if (nSojourn < m_nTarget)
+			{
+				// Good queue, whatever was building up has drained
+				m_nFirstAbove = 0;
+				if (m_bOverloaded.load(std::memory_order_relaxed))
+					m_bOverloaded.store(false, std::memory_order_relaxed);
+				return false;
+			}
+
+			if (m_nFirstAbove == 0)
+			{
+				// Give it one interval to come back under the target
+				m_nFirstAbove = nNow + m_nInterval;
+			}
+			else if (nNow >= m_nFirstAbove && !m_bOverloaded.load(std::memory_order_relaxed))
+			{
+				m_bOverloaded.store(true, std::memory_order_relaxed);
+				m_nEpisodes.store(m_nEpisodes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			}
+
+			return m_bOverloaded.load(std::memory_order_relaxed);
+		}
+
+		// The queue ran empty, which ends any overload
+		void onEmpty()
+		{
+			m_nFirstAbove = 0;
+			m_bOverloaded.store(false, std::memory_order_relaxed);
+		}
+
+		// May be read from any thread
+		bool overloaded() const { return m_bOverloaded.load(std::memory_order_relaxed); }
+
+		// How many times the queue went into overload
+		uint64_t episodes() const { return m_nEpisodes.load(std::memory_order_relaxed); }
+
+	private:
+		uint64_t m_nTarget;
+		uint64_t m_nInterval;
+
+		// End of the grace interval of the current above-target stretch,
+		// 0 while sojourn times are fine
+		uint64_t m_nFirstAbove = 0;
+
+		std::atomic<bool> m_bOverloaded{false};
+		std::atomic<uint64_t> m_nEpisodes{0};
+};
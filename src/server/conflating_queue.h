@@ -0,0 +1,197 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "message.h"
+#include "ring_buffer.h"
+
+// Open addressing map from a message key to the sequence number of the
+// queued message carrying it. Key 0 means "no key" and marks empty slots.
+class CKeyIndex
+{
+	public:
+		bool find(uint64_t nKey, uint64_t& nSeq) const
+		{
+			if (m_nCount == 0)
+				return false;
+
+			for (size_t i = slot(nKey); m_vecEntries[i].nKey != 0; i = next(i))
+			{
+				if (m_vecEntries[i].nKey == nKey)
+				{
+					nSeq = m_vecEntries[i].nSeq;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// Adds the key or moves it to a new sequence number
+		void insert(uint64_t nKey, uint64_t nSeq)
+		{
+			// Keep the load under one half, probes stay short
+			if ((m_nCount + 1) * 2 > m_vecEntries.size())
+				grow();
+
+			size_t i = slot(nKey);
+			while (m_vecEntries[i].nKey != 0 && m_vecEntries[i].nKey != nKey)
+				i = next(i);
+
+			if (m_vecEntries[i].nKey == 0)
+				m_nCount++;
+			m_vecEntries[i] = { nKey, nSeq };
+		}
+
+		void erase(uint64_t nKey)
+		{
+			if (m_nCount == 0)
+				return;
+
+			size_t i = slot(nKey);
+			while (m_vecEntries[i].nKey != nKey)
+			{
+				if (m_vecEntries[i].nKey == 0)
+					return;
+				i = next(i);
+			}
+
+			// Backward shift: pull later entries of the probe run into the
+			// hole so no tombstones are needed
+			size_t j = i;
+			while (true)
+			{
+				j = next(j);
+				if (m_vecEntries[j].nKey == 0)
+					break;
+
+				size_t nHome = slot(m_vecEntries[j].nKey);
+				bool bMovable = (j > i) ? (nHome <= i || nHome > j) : (nHome <= i && nHome > j);
+				if (bMovable)
+				{
+					m_vecEntries[i] = m_vecEntries[j];
+					i = j;
+				}
+			}
+
+			m_vecEntries[i] = entry();
+			m_nCount--;
+		}
+
+		void clear()
+		{
+			if (m_nCount == 0)
+				return;
+			std::fill(m_vecEntries.begin(), m_vecEntries.end(), entry());
+			m_nCount = 0;
+		}
+
+		size_t size() const { return m_nCount; }
+
+		// Room for nKeys keys before the next grow
+		void reserve(size_t nKeys)
+		{
+			while (m_vecEntries.size() < nKeys * 2)
+				grow();
+		}
+
+	private:
+		struct entry
+		{
+			uint64_t nKey = 0;
+			uint64_t nSeq = 0;
+		};
+
+		size_t slot(uint64_t nKey) const
+		{
+			// Fibonacci hashing, vehicle ids tend to be sequential
+			return size_t((nKey * 0x9E3779B97F4A7C15ull) >> 32) & (m_vecEntries.size() - 1);
+		}
+
+		size_t next(size_t i) const { return (i + 1) & (m_vecEntries.size() - 1); }
+
+		void grow()
+		{
+			std::vector<entry> vecOld(m_vecEntries.empty() ? 16 : m_vecEntries.size() * 2);
+			vecOld.swap(m_vecEntries);
+			m_nCount = 0;
+
+			for (const entry& e : vecOld)
+			{
+				if (e.nKey != 0)
+					insert(e.nKey, e.nSeq);
+			}
+		}
+
+		std::vector<entry> m_vecEntries;
+		size_t m_nCount = 0;
+};
+
+// FIFO of messages where a keyed message (owned_message::key != 0) replaces
+// a still queued one with the same key, in place. Only the newest value of
+// a key is ever delivered, and it goes out at the position the first
+// unsent one had, so a backlog of position updates collapses to one update
+// per vehicle instead of growing.
+class CConflatingQueue
+{
+	public:
+		// Appends msg or overwrites the queued message with the same key. In
+		// the second case returns true and sets nReplacedSize to the payload
+		// size of the message that was dropped
+		bool push(owned_message&& msg, size_t& nReplacedSize)
+		{
+			if (msg.key != 0)
+			{
+				uint64_t nSeq;
+				if (m_index.find(msg.key, nSeq))
+				{
+					owned_message& queued = m_qMessages[size_t(nSeq - m_nHeadSeq)];
+					nReplacedSize = queued.size();
+					queued = std::move(msg);
+					return true;
+				}
+				m_index.insert(msg.key, m_nHeadSeq + m_qMessages.size());
+			}
+
+			m_qMessages.push_back(std::move(msg));
+			return false;
+		}
+
+		owned_message& front() { return m_qMessages.front(); }
+
+		// Moves the front message out into msg
+		void pop_front(owned_message& msg)
+		{
+			uint64_t nKey = m_qMessages.front().key;
+			if (nKey != 0)
+				m_index.erase(nKey);
+
+			msg = std::move(m_qMessages.front());
+			m_qMessages.pop_front();
+			m_nHeadSeq++;
+		}
+
+		bool empty() const { return m_qMessages.empty(); }
+		size_t size() const { return m_qMessages.size(); }
+
+		void clear()
+		{
+			m_nHeadSeq += m_qMessages.size();
+			m_qMessages.clear();
+			m_index.clear();
+		}
+
+		void reserve(size_t nCapacity)
+		{
+			m_qMessages.reserve(nCapacity);
+			m_index.reserve(nCapacity);
+		}
+
+	private:
+		ring_buffer<owned_message> m_qMessages;
+
+		// Sequence number of the front message, keys map to these
+		uint64_t m_nHeadSeq = 0;
+		CKeyIndex m_index;
+};
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+
+// Names a connection without owning it: the pool slot plus the generation
+// the slot had when the handle was taken. Once the connection is released
+// the slot's generation moves on and old handles no longer resolve, so a
+// handle can be copied around freely without any reference counting.
+struct connection_handle
+{
+	static constexpr uint32_t nInvalidSlot = UINT32_MAX;
+
+	uint32_t nSlot = nInvalidSlot;
+	uint32_t nGeneration = 0;
+
+	bool valid() const { return nSlot != nInvalidSlot; }
+	explicit operator bool() const { return valid(); }
+
+	bool operator==(const connection_handle& other) const
+	{
+		return nSlot == other.nSlot && nGeneration == other.nGeneration;
+	}
+
+	bool operator!=(const connection_handle& other) const
+	{
+		return !(*this == other);
+	}
+};
@@ -0,0 +1,99 @@
+#include "connection_pool.h"
+#include "epoch.h"
+#include "server.h"
+
+CConnectionPool::CConnectionPool(size_t nCapacity, std::function<std::unique_ptr<CConnection>(size_t)> fnCreate):
+	m_fnCreate(std::move(fnCreate)), m_vecConnections(nCapacity)
+{
+	m_vecFree.reserve(nCapacity);
+	m_vecRetired.reserve(nCapacity);
+
+	// Push in reverse so slot 0 is handed out first
+	for (size_t i = nCapacity; i > 0; i--)
+		m_vecFree.push_back(i - 1);
+}
+
+CConnection* CConnectionPool::acquire(asio::ip::tcp::socket& socket)
+{
+	size_t nSlot;
+	{
+		scoped_lock lock(m_mxPool);
+		if (m_vecFree.empty())
+			reclaim();
+
+		if (m_vecFree.empty())
+			return nullptr;
+
+		nSlot = m_vecFree.back();
+		m_vecFree.pop_back();
+	}
+
+	CConnection* conn = m_vecConnections[nSlot].get();
+	conn->reset(std::move(socket));
+	conn->activate();
+	return conn;
+}
+
+void CConnectionPool::release(CConnection* conn)
+{
+	if (!conn)
+		return;
+
+	// From here on no new lookup will find it
+	conn->deactivate();
+
+	scoped_lock lock(m_mxPool);
+	m_vecRetired.push_back({ conn->getSlot(), CEpochManager::current() });
+	reclaim();
+}
+
+CConnection* CConnectionPool::resolve(connection_handle handle)
+{
+	if (handle.nSlot >= m_vecConnections.size())
+		return nullptr;
+
+	// Not created yet means never handed out, no handle can name it
+	CConnection* conn = m_vecConnections[handle.nSlot].get();
+	if (!conn || conn->getGeneration() != handle.nGeneration)
+		return nullptr;
+
+	return conn;
+}
+
+void CConnectionPool::reclaim()
+{
+	if (m_vecRetired.empty())
+		return;
+
+	CEpochManager::tryAdvance();
+
+	// Retired in epoch order, so stop at the first one still in use
+	size_t nReclaimed = 0;
+	while (nReclaimed < m_vecRetired.size() && CEpochManager::isSafe(m_vecRetired[nReclaimed].nEpoch))
+	{
+		m_vecFree.push_back(m_vecRetired[nReclaimed].nSlot);
+		nReclaimed++;
+	}
+
+	m_vecRetired.erase(m_vecRetired.begin(), m_vecRetired.begin() + nReclaimed);
+}
+
+void CConnectionPool::create(size_t nFirst, size_t nStride)
+{
+	// Distinct slots per caller, the vector itself is never resized
+	for (size_t i = nFirst; i < m_vecConnections.size(); i += nStride)
+	{
+		if (m_vecConnections[i])
+			continue;
+
+		m_vecConnections[i] = m_fnCreate(i);
+		m_vecConnections[i]->setSlot(i);
+		m_vecConnections[i]->warm();
+	}
+}
+
+size_t CConnectionPool::available()
+{
+	scoped_lock lock(m_mxPool);
+	return m_vecFree.size();
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#define ASIO_STANDALONE
+#include <asio.hpp>
+
+#include "connection_handle.h"
+
+class CConnection;
+
+// Fixed set of connection objects created up front, so accepting a client
+// never touches the allocator. Released objects keep their buffers and are
+// handed out again on the next accept.
+//
+// The objects are not made by the constructor but by create(), which each
+// asio thread calls for the slots it serves after it has been placed. They
+// and their buffers are then first touched there, and with a NUMA node set
+// for the thread their pages come from that node.
+//
+// Connections are addressed through connection_handle. A released slot is
+// first parked until CEpochManager says no reader can still be using it,
+// only then it goes back on the free list.
+class CConnectionPool
+{
+	public:
+		// fnCreate is called once per slot with the slot's index, from
+		// create()
+		CConnectionPool(size_t nCapacity, std::function<std::unique_ptr<CConnection>(size_t)> fnCreate);
+		CConnectionPool(const CConnectionPool&) = delete;
+
+		// Takes a free connection and moves the socket into it. Returns
+		// nullptr when every slot is in use, the socket is then left with
+		// the caller
+		CConnection* acquire(asio::ip::tcp::socket& socket);
+
+		// Invalidates every handle to the connection and retires its slot
+		void release(CConnection* conn);
+
+		// Connection behind the handle, or nullptr if it has been released.
+		// The pointer stays valid while the caller holds an epoch_guard
+		CConnection* resolve(connection_handle handle);
+
+		// Create the connections of every nStride-th slot from nFirst on,
+		// and touch their buffers so the pages are already mapped when the
+		// first burst of clients arrives, see CConnection::warm(). Every
+		// slot has to be created before the pool is used, and the calls
+		// ordered before that use
+		void create(size_t nFirst = 0, size_t nStride = 1);
+
+		// Connection object of a slot whatever its state, for walking all of
+		// them on the asio thread once every slot has been created
+		CConnection* at(size_t nSlot) { return m_vecConnections[nSlot].get(); }
+
+		size_t capacity() const { return m_vecConnections.size(); }
+		size_t available();
+
+	private:
+		// Move retired slots whose epoch has passed to the free list, needs
+		// m_mxPool held
+		void reclaim();
+
+		struct retired_slot
+		{
+			size_t nSlot;
+			uint64_t nEpoch;
+		};
+
+		std::function<std::unique_ptr<CConnection>(size_t)> m_fnCreate;
+		std::vector<std::unique_ptr<CConnection>> m_vecConnections;
+
+		// Indices into m_vecConnections, used as a LIFO so that the most
+		// recently released (cache-warm) connection is reused first
+		std::vector<size_t> m_vecFree;
+
+		// Released slots in retirement order
+		std::vector<retired_slot> m_vecRetired;
+		std::mutex m_mxPool;
+};
@@ -0,0 +1,125 @@
+#include "epoch.h"
+
+#include <atomic>
+
+namespace
+{
+	constexpr uint64_t nInactive = UINT64_MAX;
+
+	struct alignas(64) thread_record
+	{
+		std::atomic<uint64_t> nEpoch{nInactive};
+		std::atomic<bool> bUsed{false};
+	};
+
+	std::atomic<uint64_t> g_nEpoch{2};
+	thread_record g_aRecords[CEpochManager::nMaxThreads];
+
+	// Threads inside a guard without a record, they hold the epoch where it is
+	std::atomic<size_t> g_nOverflow{0};
+
+	// Claims a record for the thread on first use and frees it on exit.
+	// nullptr while all of them are taken
+	struct record_holder
+	{
+		thread_record* pRecord = nullptr;
+		size_t nDepth = 0;
+		bool bOverflow = false;
+
+		thread_record* get()
+		{
+			if (!pRecord)
+			{
+				for (auto& record : g_aRecords)
+				{
+					bool bExpected = false;
+					if (record.bUsed.compare_exchange_strong(bExpected, true))
+					{
+						pRecord = &record;
+						break;
+					}
+				}
+			}
+			return pRecord;
+		}
+
+		~record_holder()
+		{
+			if (pRecord)
+			{
+				pRecord->nEpoch.store(nInactive);
+				pRecord->bUsed.store(false);
+			}
+		}
+	};
+
+	thread_local record_holder t_record;
+}
+
+uint64_t CEpochManager::current()
+{
+	return g_nEpoch.load();
+}
+
+bool CEpochManager::tryAdvance()
+{
+	if (g_nOverflow.load() != 0)
+		return false;
+
+	uint64_t nEpoch = g_nEpoch.load();
+	for (auto& record : g_aRecords)
+	{
+		uint64_t nLocal = record.nEpoch.load();
+		if (nLocal != nInactive && nLocal != nEpoch)
+			return false;
+	}
+
+	return g_nEpoch.compare_exchange_strong(nEpoch, nEpoch + 1);
+}
+
+bool CEpochManager::isSafe(uint64_t nEpoch)
+{
+	return g_nEpoch.load() >= nEpoch + 2;
+}
+
+void CEpochManager::enter()
+{
+	if (t_record.nDepth++ != 0)
+		return;
+
+	thread_record* pRecord = t_record.get();
+	if (!pRecord)
+	{
+		// Counted before any handle is resolved. An advance that missed
+		// the count moves the epoch once at most, like one that missed a
+		// record's announcement below
+		t_record.bOverflow = true;
+		g_nOverflow.fetch_add(1);
+		return;
+	}
+
+	// Until the announcement is seen the record reads as inactive and
+	// the epoch may move on, more than once. Announce again until what
+	// was announced is still current, sequentially consistent so that
+	// it is visible before any handle is resolved
+	uint64_t nEpoch;
+	do
+	{
+		nEpoch = g_nEpoch.load();
+		pRecord->nEpoch.store(nEpoch);
+	} while (g_nEpoch.load() != nEpoch);
+}
+
+void CEpochManager::exit()
+{
+	if (--t_record.nDepth != 0)
+		return;
+
+	if (t_record.bOverflow)
+	{
+		t_record.bOverflow = false;
+		g_nOverflow.fetch_sub(1, std::memory_order_release);
+	}
+	else
+		t_record.pRecord->nEpoch.store(nInactive, std::memory_order_release);
+}
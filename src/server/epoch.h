@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Epoch based reclamation.
+//
+// A thread that looks objects up through handles does so inside an
+// epoch_guard. Objects are retired together with the epoch current at the
+// time, and may only be reused once the global epoch is two steps further:
+// by then every thread that could still see the old object has left its
+// guard. Entering and leaving a guard is a single store, no shared counter
+// is touched per object.
+class CEpochManager
+{
+	public:
+		// Threads with a record of their own. Any further threads still
+		// work, but while one of them is inside a guard the epoch stands
+		// still and nothing retired meanwhile is reused
+		static constexpr size_t nMaxThreads = 64;
+
+		static uint64_t current();
+
+		// Move the global epoch forward if every thread inside a guard has
+		// already observed the current one
+		static bool tryAdvance();
+
+		// True when something retired at nEpoch cannot be referenced anymore
+		static bool isSafe(uint64_t nEpoch);
+
+		static void enter();
+		static void exit();
+};
+
+// Keeps the calling thread inside the current epoch for its lifetime, may
+// be nested
+class epoch_guard
+{
+	public:
+		epoch_guard() { CEpochManager::enter(); }
+		~epoch_guard() { CEpochManager::exit(); }
+
+		epoch_guard(const epoch_guard&) = delete;
+		epoch_guard& operator=(const epoch_guard&) = delete;
+};
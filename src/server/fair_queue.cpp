@@ -0,0 +1,123 @@
+#include "fair_queue.h"
+#include "server.h"
+
+CFairQueue::CFairQueue(size_t nFlows): m_vecFlows(nFlows ? nFlows : 1)
+{
+	m_qActive.reserve(m_vecFlows.size());
+}
+
+bool CFairQueue::push_back(owned_message&& msg)
+{
+	{
+		scoped_lock lock(m_mxQueue);
+		size_t nFlow = flowOf(msg);
+		flow& f = m_vecFlows[nFlow];
+
+		size_t nReplacedSize;
+		if (f.qMessages.push(std::move(msg), nReplacedSize))
+		{
+			// Took the place of an older one, nothing new to wake up for
+			m_nConflated++;
+			return false;
+		}
+		m_nCount++;
+
+		if (!f.bActive)
+		{
+			f.bActive = true;
+			f.nDeficit = 0;
+			m_qActive.push_back(std::move(nFlow));
+		}
+	}
+
+	std::unique_lock<std::mutex> ul(m_mxBlocking);
+	m_cvBlocking.notify_one();
+	return true;
+}
+
+bool CFairQueue::pop_front(owned_message& msg)
+{
+	scoped_lock lock(m_mxQueue);
+
+	while (!m_qActive.empty())
+	{
+		size_t nFlow = m_qActive.front();
+		flow& f = m_vecFlows[nFlow];
+
+		if (!f.bInTurn)
+		{
+			f.nDeficit += f.nQuantum;
+			f.bInTurn = true;
+		}
+
+		// Empty messages still cost something, or they would be free
+		size_t nCost = std::max<size_t>(f.qMessages.front().size(), 1);
+		if (nCost <= f.nDeficit)
+		{
+			f.nDeficit -= nCost;
+			f.qMessages.pop_front(msg);
+			m_nCount--;
+
+			if (f.qMessages.empty())
+			{
+				// Idle flows do not bank credit
+				f.bActive = false;
+				f.bInTurn = false;
+				f.nDeficit = 0;
+				m_qActive.pop_front();
+			}
+			return true;
+		}
+
+		// Turn is over, the unused deficit carries to the next round
+		f.bInTurn = false;
+		m_qActive.pop_front();
+		m_qActive.push_back(std::move(nFlow));
+	}
+
+	return false;
+}
+
+void CFairQueue::setWeight(size_t nFlow, uint32_t nWeight)
+{
+	if (nFlow >= m_vecFlows.size())
+		return;
+
+	scoped_lock lock(m_mxQueue);
+	m_vecFlows[nFlow].nQuantum = size_t(std::max<uint32_t>(nWeight, 1)) * nBaseQuantum;
+}
+
+bool CFairQueue::empty()
+{
+	scoped_lock lock(m_mxQueue);
+	return m_nCount == 0;
+}
+
+size_t CFairQueue::count()
+{
+	scoped_lock lock(m_mxQueue);
+	return m_nCount;
+}
+
+uint64_t CFairQueue::conflated()
+{
+	scoped_lock lock(m_mxQueue);
+	return m_nConflated;
+}
+
+void CFairQueue::wait()
+{
+	// Checked under the blocking mutex, a push cannot slip in between the
+	// check and the wait
+	std::unique_lock<std::mutex> ul(m_mxBlocking);
+	while (empty() && !m_bInterrupted)
+		m_cvBlocking.wait(ul);
+	m_bInterrupted = false;
+}
+
+void CFairQueue::interrupt()
+{
+	std::unique_lock<std::mutex> ul(m_mxBlocking);
+	m_bInterrupted = true;
+	m_cvBlocking.notify_all();
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "conflating_queue.h"
+#include "message.h"
+#include "ring_buffer.h"
+
+// Incoming message queue with one sub-queue per connection slot, served by
+// deficit round robin. Every client with pending messages gets a turn in
+// which it may hand out up to its quantum (weight * nBaseQuantum bytes) of
+// payload, so a client bursting thousands of messages only delays the
+// others by one quantum instead of by its whole burst. Order within one
+// client is preserved.
+//
+// Keyed messages are conflated per client: a newer message with the same
+// key overwrites the queued one and takes its place in line.
+class CFairQueue
+{
+	public:
+		static constexpr size_t nBaseQuantum = 256;
+
+		explicit CFairQueue(size_t nFlows);
+		CFairQueue(const CFairQueue&) = delete;
+
+		// Queues behind the other messages of msg.remote, or replaces its
+		// queued message with the same key and returns false
+		bool push_back(owned_message&& msg);
+
+		// Next message in round robin order, false when nothing is queued
+		bool pop_front(owned_message& msg);
+
+		// Relative share of a slot, takes effect from its next turn
+		void setWeight(size_t nFlow, uint32_t nWeight);
+
+		bool empty();
+		size_t count();
+
+		// Messages overwritten by a newer one with the same key so far
+		uint64_t conflated();
+
+		// Blocks until something is queued or interrupt() is called
+		void wait();
+
+		// Wake up a waiter even though nothing was queued
+		void interrupt();
+
+	private:
+		struct flow
+		{
+			CConflatingQueue qMessages;
+			size_t nQuantum = nBaseQuantum;
+			size_t nDeficit = 0;
+
+			// In m_qActive
+			bool bActive = false;
+			// Its quantum for the current turn has been granted
+			bool bInTurn = false;
+		};
+
+		size_t flowOf(const owned_message& msg) const
+		{
+			return msg.remote.nSlot < m_vecFlows.size() ? msg.remote.nSlot : 0;
+		}
+
+		std::vector<flow> m_vecFlows;
+
+		// Flows with messages, the front one has the turn
+		ring_buffer<size_t> m_qActive;
+		size_t m_nCount = 0;
+		uint64_t m_nConflated = 0;
+
+		std::mutex m_mxQueue;
+		std::condition_variable m_cvBlocking;
+		std::mutex m_mxBlocking;
+		bool m_bInterrupted = false;
+};
@@ -0,0 +1,285 @@
+#include "handshake.h"
+#include "clock.h"
+
+#include <cstring>
+#include <iostream>
+#include <random>
+
+namespace
+{
+	// SipHash-2-4, short keyed hash meant for exactly this kind of use
+	uint64_t rotl(uint64_t x, int b)
+	{
+		return (x << b) | (x >> (64 - b));
+	}
+
+	void sipRound(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3)
+	{
+		v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+		v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+		v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+		v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+	}
+
+	uint64_t sipHash(const uint64_t aKey[2], const uint8_t* pData, size_t nSize)
+	{
+		uint64_t v0 = 0x736f6d6570736575ull ^ aKey[0];
+		uint64_t v1 = 0x646f72616e646f6dull ^ aKey[1];
+		uint64_t v2 = 0x6c7967656e657261ull ^ aKey[0];
+		uint64_t v3 = 0x7465646279746573ull ^ aKey[1];
+
+		size_t nBlocks = nSize / 8;
+		for (size_t i = 0; i < nBlocks; i++)
+		{
+			uint64_t m = 0;
+			for (size_t j = 0; j < 8; j++)
+				m |= uint64_t(pData[i * 8 + j]) << (8 * j);
+
+			v3 ^= m;
+			sipRound(v0, v1, v2, v3);
+			sipRound(v0, v1, v2, v3);
+			v0 ^= m;
+		}
+
+		uint64_t b = uint64_t(nSize) << 56;
+		for (size_t j = 0; j < nSize % 8; j++)
+			b |= uint64_t(pData[nBlocks * 8 + j]) << (8 * j);
+
+		v3 ^= b;
+		sipRound(v0, v1, v2, v3);
+		sipRound(v0, v1, v2, v3);
+		v0 ^= b;
+
+		v2 ^= 0xff;
+		for (int i = 0; i < 4; i++)
+			sipRound(v0, v1, v2, v3);
+
+		return v0 ^ v1 ^ v2 ^ v3;
+	}
+}
+
+CHandshakeCookies::CHandshakeCookies()
+{
+	std::random_device rd;
+	m_aKey[0] = (uint64_t(rd()) << 32) | rd();
+	m_aKey[1] = (uint64_t(rd()) << 32) | rd();
+}
+
+uint64_t CHandshakeCookies::cookie(const asio::ip::tcp::endpoint& remote, uint64_t nWindow) const
+{
+	// Address, port and window, 16 + 2 + 8 bytes at most
+	uint8_t aData[26] = {};
+	size_t nSize = 0;
+
+	if (remote.address().is_v4())
+	{
+		auto bytes = remote.address().to_v4().to_bytes();
+		std::copy(bytes.begin(), bytes.end(), aData);
+		nSize = bytes.size();
+	}
+	else
+	{
+		auto bytes = remote.address().to_v6().to_bytes();
+		std::copy(bytes.begin(), bytes.end(), aData);
+		nSize = bytes.size();
+	}
+
+	aData[nSize++] = uint8_t(remote.port());
+	aData[nSize++] = uint8_t(remote.port() >> 8);
+	for (size_t i = 0; i < 8; i++)
+		aData[nSize++] = uint8_t(nWindow >> (8 * i));
+
+	return sipHash(m_aKey, aData, nSize);
+}
+
+uint64_t CHandshakeCookies::challenge(const asio::ip::tcp::endpoint& remote, uint64_t nNow) const
+{
+	return cookie(remote, nNow / nWindowNs);
+}
+
+bool CHandshakeCookies::verify(const asio::ip::tcp::endpoint& remote, uint64_t nResponse, uint64_t nNow, bool& bHello) const
+{
+	bHello = (nResponse & nHelloFlag) != (answer(0) & nHelloFlag);
+	nResponse ^= bHello ? nHelloFlag : 0;
+
+	uint64_t nWindow = nNow / nWindowNs;
+	if (nResponse == answer(cookie(remote, nWindow)))
+		return true;
+
+	// Challenged just before the window turned
+	return nWindow > 0 && nResponse == answer(cookie(remote, nWindow - 1));
+}
+
+CHandshakeStage::CHandshakeStage(asio::io_context& asioContext, size_t nMaxPending,
+	std::function<void(asio::ip::tcp::socket, const hello_frame&)> fnValidated):
+	m_timerSweep(asioContext), m_fnValidated(std::move(fnValidated))
+{
+	m_vecSlots.reserve(nMaxPending);
+	m_vecFree.reserve(nMaxPending);
+	for (size_t i = 0; i < nMaxPending; i++)
+		m_vecSlots.emplace_back(asioContext);
+
+	for (size_t i = nMaxPending; i > 0; i--)
+		m_vecFree.push_back(i - 1);
+}
+
+bool CHandshakeStage::begin(asio::ip::tcp::socket& socket)
+{
+	if (m_vecFree.empty())
+		return false;
+
+	std::error_code ec;
+	asio::ip::tcp::endpoint remote = socket.remote_endpoint(ec);
+	if (ec)
+		return false;
+
+	size_t nSlot = m_vecFree.back();
+	m_vecFree.pop_back();
+
+	pending_handshake& p = m_vecSlots[nSlot];
+	p.socket = std::move(socket);
+	p.nStarted = coarse_clock::now();
+	p.nChallenge = m_cookies.challenge(remote, p.nStarted);
+	p.nResponse = 0;
+
+	uint32_t nGeneration = p.nGeneration;
+	asio::async_write(p.socket, asio::buffer(&p.nChallenge, sizeof(uint64_t)),
+		[this, nSlot, nGeneration](std::error_code ec, std::size_t)
+		{
+			if (m_vecSlots[nSlot].nGeneration != nGeneration)
+				return;
+
+			if (ec)
+				close(nSlot);
+		});
+
+	readAnswer(nSlot, nGeneration);
+
+	if (!m_bSweeping)
+		sweep();
+	return true;
+}
+
+void CHandshakeStage::readAnswer(size_t nSlot, uint32_t nGeneration)
+{
+	pending_handshake& p = m_vecSlots[nSlot];
+	asio::async_read(p.socket, asio::buffer(&p.nResponse, sizeof(uint64_t)),
+		[this, nSlot, nGeneration](std::error_code ec, std::size_t)
+		{
+			pending_handshake& p = m_vecSlots[nSlot];
+			if (p.nGeneration != nGeneration)
+				return;
+
+			if (ec)
+			{
+				std::cout << "Client Disconnected (ReadValidation)" << std::endl;
+				close(nSlot);
+				return;
+			}
+
+			// Recomputed from the address, nothing was stored for it
+			std::error_code ecRemote;
+			asio::ip::tcp::endpoint remote = p.socket.remote_endpoint(ecRemote);
+			bool bHello = false;
+			if (ecRemote || !m_cookies.verify(remote, p.nResponse, coarse_clock::now(), bHello))
+			{
+				// Client gave incorrect data, so disconnect
+				std::cout << "Client Disconnected (Fail Validation)" << std::endl;
+				m_nFailed.fetch_add(1, std::memory_order_relaxed);
+				close(nSlot);
+				return;
+			}
+
+			if (bHello)
+				readHello(nSlot, nGeneration);
+			else
+				validated(nSlot, hello_frame());
+		});
+}
+
+void CHandshakeStage::readHello(size_t nSlot, uint32_t nGeneration)
+{
+	static_assert(sizeof(uint64_t) == hello_frame::nSize, "the hello is read into nResponse");
+
+	pending_handshake& p = m_vecSlots[nSlot];
+	asio::async_read(p.socket, asio::buffer(&p.nResponse, hello_frame::nSize),
+		[this, nSlot, nGeneration](std::error_code ec, std::size_t)
+		{
+			pending_handshake& p = m_vecSlots[nSlot];
+			if (p.nGeneration != nGeneration)
+				return;
+
+			if (ec)
+			{
+				close(nSlot);
+				return;
+			}
+
+			char aHello[hello_frame::nSize];
+			std::memcpy(aHello, &p.nResponse, sizeof(aHello));
+			validated(nSlot, hello_frame::decode(aHello));
+		});
+}
+
+void CHandshakeStage::validated(size_t nSlot, const hello_frame& hello)
+{
+	pending_handshake& p = m_vecSlots[nSlot];
+
+	// The slot is free again before the server gets the socket
+	asio::ip::tcp::socket socket = std::move(p.socket);
+	p.socket = asio::ip::tcp::socket(socket.get_executor());
+	p.nGeneration++;
+	m_vecFree.push_back(nSlot);
+
+	m_fnValidated(std::move(socket), hello);
+}
+
+void CHandshakeStage::close(size_t nSlot)
+{
+	pending_handshake& p = m_vecSlots[nSlot];
+
+	std::error_code ignored;
+	p.socket.shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+	p.socket.close(ignored);
+	p.nGeneration++;
+	m_vecFree.push_back(nSlot);
+}
+
+void CHandshakeStage::closeAll()
+{
+	for (size_t i = 0; i < m_vecSlots.size(); i++)
+	{
+		if (m_vecSlots[i].socket.is_open())
+			close(i);
+	}
+}
+
+void CHandshakeStage::sweep()
+{
+	// One timer for every pending handshake, ticking only while there are any
+	uint64_t nNow = coarse_clock::now();
+	for (size_t i = 0; i < m_vecSlots.size(); i++)
+	{
+		pending_handshake& p = m_vecSlots[i];
+		if (p.socket.is_open() && nNow - p.nStarted > m_nTimeout)
+		{
+			m_nFailed.fetch_add(1, std::memory_order_relaxed);
+			close(i);
+		}
+	}
+
+	m_bSweeping = pending() > 0;
+	if (!m_bSweeping)
+		return;
+
+	m_timerSweep.expires_after(std::chrono::seconds(1));
+	m_timerSweep.async_wait([this](std::error_code ec)
+		{
+			if (ec)
+			{
+				m_bSweeping = false;
+				return;
+			}
+			sweep();
+		});
+}
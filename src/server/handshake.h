@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#define ASIO_STANDALONE
+#include <asio.hpp>
+
+#include "protocol.h"
+
+// Handshake challenges derived SYN cookie style: the challenge is a keyed
+// hash of the client's address and the current time window, so checking
+// the answer only needs the key, nothing is remembered per client.
+class CHandshakeCookies
+{
+	public:
+		// Challenges stay valid for one to two windows
+		static constexpr uint64_t nWindowNs = 16000000000ull;
+
+		// answer() always leaves 0xC0 in the top byte. Clients flip this bit
+		// of it to say a hello_frame follows the answer
+		static constexpr uint64_t nHelloFlag = 0x8000000000000000ull;
+
+		// Draws a fresh random key
+		CHandshakeCookies();
+
+		uint64_t challenge(const asio::ip::tcp::endpoint& remote, uint64_t nNow) const;
+
+		// The answer must match the challenge of this or the previous window.
+		// bHello tells whether the client set nHelloFlag
+		bool verify(const asio::ip::tcp::endpoint& remote, uint64_t nResponse, uint64_t nNow, bool& bHello) const;
+
+		// What a client is expected to send back for a challenge
+		static uint64_t answer(uint64_t nChallenge)
+		{
+			uint64_t out = nChallenge ^ 0xDEADBEEFC0DECAFE;
+			out = (out & 0xF0F0F0F0F0F0F0) >> 4 | (out & 0x0F0F0F0F0F0F0F) << 4;
+			return out ^ 0xC0DEFACE12345678;
+		}
+
+	private:
+		uint64_t cookie(const asio::ip::tcp::endpoint& remote, uint64_t nWindow) const;
+
+		uint64_t m_aKey[2];
+};
+
+// Accepted sockets that have not answered the handshake yet. Each one only
+// takes a small fixed slot: the socket and the two 8 byte words of the
+// exchange. Buffers, queues and the rest of a CConnection are handed out
+// once the answer checks out, so a flood of clients that never answer
+// costs next to nothing and cannot use up the connection pool.
+//
+// Only used from the asio thread.
+class CHandshakeStage
+{
+	public:
+		// fnValidated gets the socket and the client's hello, an empty one
+		// from clients that did not send any
+		CHandshakeStage(asio::io_context& asioContext, size_t nMaxPending,
+			std::function<void(asio::ip::tcp::socket, const hello_frame&)> fnValidated);
+		CHandshakeStage(const CHandshakeStage&) = delete;
+
+		// Send the challenge and wait for the answer. Takes the socket and
+		// returns true, or leaves it alone if every slot is in use
+		bool begin(asio::ip::tcp::socket& socket);
+
+		// Clients that do not answer within nTimeout are dropped
+		void setTimeout(uint64_t nTimeout) { m_nTimeout = nTimeout; }
+
+		// Drop every handshake still in progress
+		void closeAll();
+
+		size_t pending() const { return m_vecSlots.size() - m_vecFree.size(); }
+
+		// Wrong answers and timeouts so far
+		uint64_t failed() const { return m_nFailed.load(std::memory_order_relaxed); }
+
+	private:
+		struct pending_handshake
+		{
+			explicit pending_handshake(asio::io_context& asioContext): socket(asioContext) {}
+
+			asio::ip::tcp::socket socket;
+			uint64_t nChallenge = 0;
+
+			// The answer, then the hello_frame if one follows
+			uint64_t nResponse = 0;
+			uint64_t nStarted = 0;
+
+			// Moves on whenever the slot is closed, so handlers of a
+			// previous client can tell the slot is no longer theirs
+			uint32_t nGeneration = 0;
+		};
+
+		void readAnswer(size_t nSlot, uint32_t nGeneration);
+		void readHello(size_t nSlot, uint32_t nGeneration);
+		void validated(size_t nSlot, const hello_frame& hello);
+		void close(size_t nSlot);
+		void sweep();
+
+		asio::steady_timer m_timerSweep;
+		bool m_bSweeping = false;
+
+		CHandshakeCookies m_cookies;
+		std::function<void(asio::ip::tcp::socket, const hello_frame&)> m_fnValidated;
+
+		std::vector<pending_handshake> m_vecSlots;
+		std::vector<size_t> m_vecFree;
+
+		uint64_t m_nTimeout = 5000000000ull;
+		std::atomic<uint64_t> m_nFailed{0};
+};
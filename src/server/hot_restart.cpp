@@ -0,0 +1,140 @@
+#include "hot_restart.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+	bool makeAddress(const std::string& strPath, sockaddr_un& addr)
+	{
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strPath.empty() || strPath.size() >= sizeof(addr.sun_path))
+			return false;
+		std::memcpy(addr.sun_path, strPath.data(), strPath.size());
+		return true;
+	}
+}
+
+int CHotRestart::listen(const std::string& strPath)
+{
+	sockaddr_un addr;
+	if (!makeAddress(strPath, addr))
+		return -1;
+
+	int nSocket = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (nSocket < 0)
+		return -1;
+
+	// Left behind by the process we took over from, or by a crash
+	::unlink(strPath.c_str());
+
+	if (::bind(nSocket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(nSocket, 1) < 0)
+	{
+		::close(nSocket);
+		return -1;
+	}
+	return nSocket;
+}
+
+int CHotRestart::connect(const std::string& strPath)
+{
+	sockaddr_un addr;
+	if (!makeAddress(strPath, addr))
+		return -1;
+
+	int nSocket = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (nSocket < 0)
+		return -1;
+
+	if (::connect(nSocket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+	{
+		::close(nSocket);
+		return -1;
+	}
+	return nSocket;
+}
+
+int CHotRestart::accept(int nListener)
+{
+	return ::accept4(nListener, nullptr, nullptr, SOCK_CLOEXEC);
+}
+
+bool CHotRestart::send(int nSocket, const handoff_record& rec, int nFd)
+{
+	iovec iov;
+	iov.iov_base = const_cast<handoff_record*>(&rec);
+	iov.iov_len = sizeof(rec);
+
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	alignas(cmsghdr) char aControl[CMSG_SPACE(sizeof(int))] = {};
+	if (nFd >= 0)
+	{
+		msg.msg_control = aControl;
+		msg.msg_controllen = sizeof(aControl);
+
+		cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		std::memcpy(CMSG_DATA(cmsg), &nFd, sizeof(int));
+	}
+
+	ssize_t nSent;
+	do
+	{
+		nSent = ::sendmsg(nSocket, &msg, MSG_NOSIGNAL);
+	} while (nSent < 0 && errno == EINTR);
+
+	return nSent == ssize_t(sizeof(rec));
+}
+
+bool CHotRestart::receive(int nSocket, handoff_record& rec, int& nFd, int nTimeoutMs)
+{
+	nFd = -1;
+
+	pollfd pfd = { nSocket, POLLIN, 0 };
+	if (::poll(&pfd, 1, nTimeoutMs) <= 0)
+		return false;
+
+	iovec iov;
+	iov.iov_base = &rec;
+	iov.iov_len = sizeof(rec);
+
+	alignas(cmsghdr) char aControl[CMSG_SPACE(sizeof(int))] = {};
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = aControl;
+	msg.msg_controllen = sizeof(aControl);
+
+	ssize_t nRead;
+	do
+	{
+		nRead = ::recvmsg(nSocket, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+	} while (nRead < 0 && errno == EINTR);
+
+	for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			std::memcpy(&nFd, CMSG_DATA(cmsg), sizeof(int));
+	}
+
+	bool bValid = nRead == ssize_t(sizeof(rec)) && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+		&& rec.nRecordMagic == handoff_record::nMagic && rec.nPending <= handoff_record::nMaxPending
+		&& rec.nTopics <= handoff_record::nMaxTopics;
+	if (!bValid && nFd >= 0)
+	{
+		::close(nFd);
+		nFd = -1;
+	}
+	return bValid;
+}
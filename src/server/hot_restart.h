@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// One message of the handoff between a retiring server process and its
+// successor. Sockets travel next to it as SCM_RIGHTS ancillary data.
+//
+// A connection's topics follow its connection record, so the successor
+// subscribes and joins it again: the client keeps its feeds. State joins
+// start over from the successor's snapshot. Vehicle states need nothing,
+// a new connection sends every vehicle in full first. Sessions are not
+// handed over, start() refuses them together with hot restart.
+struct handoff_record
+{
+	static constexpr uint32_t nMagic = 0x504d5548;		// "HUMP"
+	static constexpr size_t nMaxPending = 16;
+	static constexpr size_t nMaxTopics = 32;
+
+	enum kind : uint8_t
+	{
+		// The listening socket, nId is the next client id to hand out
+		listener = 1,
+		// An established connection, with what was already read from it
+		connection = 2,
+		// Nothing more will follow
+		done = 3,
+		// Topics the connection just handed over, nId, is subscribed to
+		// or has joined the state of. As many records as it takes
+		subscriptions = 4,
+		state_joins = 5
+	};
+
+	uint32_t nRecordMagic = nMagic;
+	uint8_t nKind = done;
+	uint8_t nClass = 0;
+	uint16_t nPending = 0;
+	uint32_t nId = 0;
+
+	// Bytes read from the client but not yet framed into a message
+	char aPending[nMaxPending] = {};
+
+	// What was negotiated in the handshake, see protocol.h
+	uint8_t nVersion = 0;
+	uint32_t nCapabilities = 0;
+
+	uint16_t nTopics = 0;
+	uint64_t aTopics[nMaxTopics] = {};
+};
+
+// Unix socket plumbing for hot restarts. Both ends talk SOCK_SEQPACKET, so
+// every record arrives whole and with its own socket attached. Functions
+// report failure instead of throwing, a failed handoff leaves the old
+// process serving.
+class CHotRestart
+{
+	public:
+		// Bind and listen on strPath for a successor, replacing a stale
+		// socket file. Returns the socket or -1
+		static int listen(const std::string& strPath);
+
+		// Connect to the process listening on strPath, -1 if there is none
+		static int connect(const std::string& strPath);
+
+		static int accept(int nListener);
+
+		// Send rec with nFd attached, nFd < 0 sends the record alone
+		static bool send(int nSocket, const handoff_record& rec, int nFd);
+
+		// Wait up to nTimeoutMs for a record. nFd is the socket that came
+		// with it or -1. False on timeout, close or a malformed record
+		static bool receive(int nSocket, handoff_record& rec, int& nFd, int nTimeoutMs);
+};
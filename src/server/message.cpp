@@ -0,0 +1,17 @@
+#include "message.h"
+#include "slab_allocator.h"
+
+char* allocate_payload(size_t nSize)
+{
+	return static_cast<char*>(CSlabAllocator::allocate(nSize));
+}
+
+void free_payload(char* pData, size_t nSize)
+{
+	CSlabAllocator::deallocate(pData, nSize);
+}
+
+size_t payload_capacity(size_t nSize)
+{
+	return CSlabAllocator::blockSize(nSize);
+}
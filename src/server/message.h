@@ -0,0 +1,269 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+#include "clock.h"
+#include "connection_handle.h"
+
+// Outbound lanes, most urgent first
+enum class message_priority : uint8_t
+{
+	urgent,
+	normal,
+	bulk,
+	count
+};
+
+// Storage for payloads that do not fit inline, backed by CSlabAllocator.
+// nSize passed to free_payload must be the capacity that was allocated
+char* allocate_payload(size_t nSize);
+void free_payload(char* pData, size_t nSize);
+
+// Usable size of the buffer allocate_payload returns for nSize bytes
+size_t payload_capacity(size_t nSize);
+
+// A message tagged with the connection it came from. Short payloads (bus
+// position updates are 40-80 bytes) are kept inside the message itself, only
+// larger ones spill to a separately allocated buffer.
+//
+// A spilled payload can be made shared with share(): copies then point at
+// the same buffer and only bump a reference count, for messages fanned out
+// to many clients. A shared payload is never written to again, assign()
+// and prepare() give the message a buffer of its own.
+struct owned_message
+{
+	static constexpr size_t nInlineSize = 96;
+
+	// Slot and generation rather than a shared_ptr, copying a message never
+	// touches a reference count
+	connection_handle remote;
+
+	// What kind of message this is. With the plain text framing it is the
+	// first byte of the payload
+	uint8_t type = 0;
+
+	message_priority priority = message_priority::normal;
+
+	// Written without the binary framing's length prefix, for the hello
+	// reply that tells the client about the framing in the first place
+	bool bUnframed = false;
+
+	// Messages with the same non-zero key supersede each other in queues
+	// that conflate, e.g. position updates of one vehicle
+	uint64_t key = 0;
+
+	// coarse_clock time the message was read or created
+	uint64_t nTimestamp = 0;
+
+	// coarse_clock time after which the message is not worth handling or
+	// sending anymore, 0 if it never expires
+	uint64_t nDeadline = 0;
+
+	owned_message() = default;
+
+	owned_message(connection_handle conn, const char* pData, size_t nSize): remote(conn)
+	{
+		assign(pData, nSize);
+	}
+
+	owned_message(const owned_message& other)
+	{
+		copyHeader(other);
+		if (other.m_pShared)
+			addRef(other);
+		else
+			assign(other.data(), other.size());
+	}
+
+	owned_message(owned_message&& other) noexcept
+	{
+		take(other);
+	}
+
+	owned_message& operator=(const owned_message& other)
+	{
+		if (this != &other)
+		{
+			copyHeader(other);
+			if (other.m_pShared)
+			{
+				release();
+				addRef(other);
+			}
+			else
+				assign(other.data(), other.size());
+		}
+		return *this;
+	}
+
+	owned_message& operator=(owned_message&& other) noexcept
+	{
+		if (this != &other)
+		{
+			release();
+			take(other);
+		}
+		return *this;
+	}
+
+	~owned_message() { release(); }
+
+	// Replace the payload, reusing a spilled buffer when it is big enough
+	void assign(const char* pData, size_t nSize)
+	{
+		std::memcpy(prepare(nSize), pData, nSize);
+	}
+
+	// Size the payload to nSize bytes and return where they go, so a socket
+	// can read straight into the message. The old contents are lost
+	char* prepare(size_t nSize)
+	{
+		char* pDest = m_aInline;
+		if (nSize > nInlineSize)
+		{
+			if (nSize > m_nCapacity)
+			{
+				release();
+				size_t nCapacity = payload_capacity(nSize);
+				m_pHeap = allocate_payload(nCapacity);
+				m_nCapacity = uint32_t(nCapacity);
+			}
+			pDest = m_pHeap;
+		}
+		else
+		{
+			release();
+		}
+
+		m_nSize = uint32_t(nSize);
+		return pDest;
+	}
+
+	// Move a spilled payload to a reference counted buffer, so copying the
+	// message no longer copies the payload. Inline payloads are left alone,
+	// they are about as cheap to copy as a reference count is to touch
+	void share()
+	{
+		if (!m_pHeap || m_pShared)
+			return;
+
+		size_t nCapacity = payload_capacity(sizeof(shared_header) + m_nSize);
+		char* pBlock = allocate_payload(nCapacity);
+		shared_header* pShared = new (pBlock) shared_header{ {1}, uint32_t(nCapacity) };
+		std::memcpy(pBlock + sizeof(shared_header), m_pHeap, m_nSize);
+
+		uint32_t nSize = m_nSize;
+		release();
+		m_pShared = pShared;
+		m_pHeap = pBlock + sizeof(shared_header);
+		m_nSize = nSize;
+	}
+
+	// Expire ttl after the timestamp, stamping the message now if it has
+	// not been yet
+	void setTtl(std::chrono::nanoseconds ttl)
+	{
+		if (nTimestamp == 0)
+			nTimestamp = coarse_clock::now();
+		nDeadline = nTimestamp + coarse_clock::toNanos(ttl);
+	}
+
+	bool expired(uint64_t nNow) const { return nDeadline != 0 && nNow > nDeadline; }
+
+	const char* data() const { return m_pHeap ? m_pHeap : m_aInline; }
+	size_t size() const { return m_nSize; }
+	bool empty() const { return m_nSize == 0; }
+	bool isInline() const { return m_pHeap == nullptr; }
+	bool isShared() const { return m_pShared != nullptr; }
+
+	std::string_view view() const { return std::string_view(data(), m_nSize); }
+	std::string str() const { return std::string(data(), m_nSize); }
+
+	// Again, a friendly string maker
+	friend std::ostream& operator<<(std::ostream& os, const owned_message& msg)
+	{
+		os << msg.view();
+		return os;
+	}
+
+	private:
+		// Everything but the payload
+		void copyHeader(const owned_message& other)
+		{
+			remote = other.remote;
+			type = other.type;
+			priority = other.priority;
+			bUnframed = other.bUnframed;
+			key = other.key;
+			nTimestamp = other.nTimestamp;
+			nDeadline = other.nDeadline;
+		}
+
+		void release()
+		{
+			if (m_pShared)
+			{
+				// The last copy frees the buffer, whichever thread it is on
+				if (m_pShared->nRefs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				{
+					uint32_t nCapacity = m_pShared->nCapacity;
+					m_pShared->~shared_header();
+					free_payload(reinterpret_cast<char*>(m_pShared), nCapacity);
+				}
+				m_pShared = nullptr;
+				m_pHeap = nullptr;
+			}
+			else if (m_pHeap)
+			{
+				free_payload(m_pHeap, m_nCapacity);
+				m_pHeap = nullptr;
+				m_nCapacity = 0;
+			}
+		}
+
+		// Steal the payload of a message, leaving it empty
+		void take(owned_message& other)
+		{
+			copyHeader(other);
+			m_nSize = other.m_nSize;
+			m_nCapacity = other.m_nCapacity;
+			m_pHeap = other.m_pHeap;
+			m_pShared = other.m_pShared;
+			if (!m_pHeap)
+				std::memcpy(m_aInline, other.m_aInline, m_nSize);
+
+			other.m_pHeap = nullptr;
+			other.m_pShared = nullptr;
+			other.m_nCapacity = 0;
+			other.m_nSize = 0;
+		}
+
+		// Share the payload of a message whose payload is shared, needs
+		// this message's own payload released
+		void addRef(const owned_message& other)
+		{
+			other.m_pShared->nRefs.fetch_add(1, std::memory_order_relaxed);
+			m_pShared = other.m_pShared;
+			m_pHeap = other.m_pHeap;
+			m_nSize = other.m_nSize;
+		}
+
+		// Sits in front of a shared payload, in the same slab block
+		struct shared_header
+		{
+			std::atomic<uint32_t> nRefs;
+			uint32_t nCapacity;
+		};
+
+		char* m_pHeap = nullptr;
+		shared_header* m_pShared = nullptr;
+		uint32_t m_nSize = 0;
+		uint32_t m_nCapacity = 0;
+		char m_aInline[nInlineSize];
+};
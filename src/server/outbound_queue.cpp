@@ -0,0 +1,94 @@
+#include "outbound_queue.h"
+
+bool COutboundQueue::push(owned_message&& msg)
+{
+	size_t nLane = size_t(msg.priority);
+	if (nLane >= nLanes)
+		nLane = nLanes - 1;
+
+	lane& l = m_aLanes[nLane];
+	if (l.nQuota > 0 && l.nBytes + msg.size() > l.nQuota)
+	{
+		add(l.stats.nMessagesDropped, 1);
+		add(l.stats.nBytesDropped, msg.size());
+		return false;
+	}
+
+	size_t nSize = msg.size();
+	size_t nReplacedSize;
+	if (l.qMessages.push(std::move(msg), nReplacedSize))
+	{
+		l.nBytes -= nReplacedSize;
+		add(l.stats.nMessagesConflated, 1);
+	}
+	else
+	{
+		m_nCount++;
+	}
+
+	l.nBytes += nSize;
+	store(l.stats.nBytesQueued, l.nBytes);
+	if (l.nBytes > l.stats.nBytesQueuedPeak.load(std::memory_order_relaxed))
+		store(l.stats.nBytesQueuedPeak, l.nBytes);
+
+	return true;
+}
+
+bool COutboundQueue::pop(owned_message& msg, uint64_t nNow)
+{
+	for (auto& l : m_aLanes)
+	{
+		while (!l.qMessages.empty())
+		{
+			l.qMessages.pop_front(msg);
+			m_nCount--;
+
+			l.nBytes -= msg.size();
+			store(l.stats.nBytesQueued, l.nBytes);
+
+			if (msg.expired(nNow))
+			{
+				add(l.stats.nMessagesExpired, 1);
+				continue;
+			}
+
+			add(l.stats.nMessagesSent, 1);
+			add(l.stats.nBytesSent, msg.size());
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void COutboundQueue::clear()
+{
+	for (auto& l : m_aLanes)
+	{
+		l.qMessages.clear();
+		l.nBytes = 0;
+		store(l.stats.nBytesQueued, 0);
+	}
+	m_nCount = 0;
+}
+
+void COutboundQueue::reserve(size_t nCapacity)
+{
+	for (auto& l : m_aLanes)
+		l.qMessages.reserve(nCapacity);
+}
+
+void COutboundQueue::reset()
+{
+	clear();
+	for (auto& l : m_aLanes)
+	{
+		store(l.stats.nMessagesSent, 0);
+		store(l.stats.nBytesSent, 0);
+		store(l.stats.nMessagesDropped, 0);
+		store(l.stats.nBytesDropped, 0);
+		store(l.stats.nMessagesConflated, 0);
+		store(l.stats.nMessagesExpired, 0);
+		store(l.stats.nBytesQueuedPeak, 0);
+	}
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include "conflating_queue.h"
+#include "message.h"
+#include "ring_buffer.h"
+
+// Counters of one priority lane. Written by the asio thread only, may be
+// read from anywhere
+struct lane_stats
+{
+	std::atomic<uint64_t> nMessagesSent{0};
+	std::atomic<uint64_t> nBytesSent{0};
+
+	// Refused because the lane was over its byte quota
+	std::atomic<uint64_t> nMessagesDropped{0};
+	std::atomic<uint64_t> nBytesDropped{0};
+
+	// Overwritten while queued by a newer message with the same key
+	std::atomic<uint64_t> nMessagesConflated{0};
+
+	// Thrown away unsent because their deadline had passed
+	std::atomic<uint64_t> nMessagesExpired{0};
+
+	std::atomic<uint64_t> nBytesQueued{0};
+	std::atomic<uint64_t> nBytesQueuedPeak{0};
+};
+
+// Outgoing messages of one connection, split into lanes by priority.
+// pop() always serves the most urgent non-empty lane, so a notification
+// queued behind a pile of bulk data goes out as soon as the frame being
+// written is done. Every lane caps the bytes it holds; a message that does
+// not fit is refused rather than letting the lane grow without bound.
+// Keyed messages conflate within their lane, see CConflatingQueue.
+//
+// Only used from the asio thread, there is no locking.
+class COutboundQueue
+{
+	public:
+		static constexpr size_t nLanes = size_t(message_priority::count);
+
+		// 0 means no limit
+		void setQuota(message_priority priority, size_t nBytes) { m_aLanes[size_t(priority)].nQuota = nBytes; }
+
+		// Takes the message, or drops it and returns false if its lane is full
+		bool push(owned_message&& msg);
+
+		// Most urgent message that has not expired by nNow. Expired ones met
+		// on the way are dropped and counted. False if nothing is left
+		bool pop(owned_message& msg, uint64_t nNow);
+
+		bool empty() const { return m_nCount == 0; }
+		size_t count() const { return m_nCount; }
+
+		void clear();
+		void reserve(size_t nCapacity);
+
+		// Also clears the counters, used when a pooled connection is reused
+		void reset();
+
+		const lane_stats& stats(message_priority priority) const { return m_aLanes[size_t(priority)].stats; }
+
+	private:
+		static void store(std::atomic<uint64_t>& counter, uint64_t nValue)
+		{
+			counter.store(nValue, std::memory_order_relaxed);
+		}
+
+		static void add(std::atomic<uint64_t>& counter, uint64_t nValue)
+		{
+			store(counter, counter.load(std::memory_order_relaxed) + nValue);
+		}
+
+		struct lane
+		{
+			CConflatingQueue qMessages;
+			size_t nBytes = 0;
+			size_t nQuota = 0;
+			lane_stats stats;
+		};
+
+		std::array<lane, nLanes> m_aLanes;
+		size_t m_nCount = 0;
+};
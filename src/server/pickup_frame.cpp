@@ -0,0 +1,46 @@
+#include "pickup_frame.h"
+
+namespace
+{
+	void putU32(char* p, uint32_t nValue)
+	{
+		for (size_t i = 0; i < 4; i++)
+			p[i] = char(nValue >> (8 * i));
+	}
+
+	uint32_t getU32(const char* p)
+	{
+		uint32_t nValue = 0;
+		for (size_t i = 0; i < 4; i++)
+			nValue |= uint32_t(uint8_t(p[i])) << (8 * i);
+		return nValue;
+	}
+}
+
+owned_message pickup_frame::encode() const
+{
+	char aData[nSize];
+	aData[0] = char(nMarker);
+	aData[1] = char(nOp);
+	putU32(aData + 2, nRequest);
+	putU32(aData + 6, uint32_t(nLat));
+	putU32(aData + 10, uint32_t(nLon));
+	putU32(aData + 14, nVehicle);
+	putU32(aData + 18, nEta);
+
+	owned_message msg(connection_handle(), aData, nSize);
+	msg.type = nMarker;
+	return msg;
+}
+
+pickup_frame pickup_frame::decode(const char* pData)
+{
+	pickup_frame frame;
+	frame.nOp = uint8_t(pData[1]);
+	frame.nRequest = getU32(pData + 2);
+	frame.nLat = int32_t(getU32(pData + 6));
+	frame.nLon = int32_t(getU32(pData + 10));
+	frame.nVehicle = getU32(pData + 14);
+	frame.nEta = getU32(pData + 18);
+	return frame;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+
+#include "message.h"
+
+// Pickup requests and their outcome, both directions. Fixed size and
+// binary like session_frame: the marker byte, an op, then the fields,
+// little endian. Fields an op has no use for are sent as 0.
+//
+// Only for clients with capabilities::nBinaryFraming. The fields may hold
+// any byte, newlines included, which newline framing would cut apart, and
+// replies would go out without a delimiter. The server ignores these
+// frames from other clients, so they never get a reply either.
+//
+//  client -> server  'R' pick me up at nLat, nLon, the client numbers its
+//                        requests with nRequest
+//                    'C' cancel request nRequest, frees its vehicle if it
+//                        has one
+//                    'D' vehicle nVehicle dropped its rider off and takes
+//                        requests again, only taken from the connection
+//                        that reports the vehicle's position
+//  server -> client  'A' vehicle nVehicle takes request nRequest, nEta
+//                        seconds away
+//                    'N' no vehicle for request nRequest, it is dropped
+struct pickup_frame
+{
+	static constexpr uint8_t nMarker = 0x05;
+	static constexpr size_t nSize = 22;
+
+	uint8_t nOp = 0;
+	uint32_t nRequest = 0;
+	// 1e-7 degrees, like vehicle_state
+	int32_t nLat = 0;
+	int32_t nLon = 0;
+	uint32_t nVehicle = 0;
+	uint32_t nEta = 0;
+
+	owned_message encode() const;
+	static pickup_frame decode(const char* pData);
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+
+#include "message.h"
+
+// Highest protocol version the server speaks. A client that sends no
+// hello_frame speaks version 0: text lines in, raw bytes out
+constexpr uint8_t nProtocolVersion = 1;
+
+// What a client can do beyond version 0, negotiated in the handshake
+struct capabilities
+{
+	// Messages in both directions are preceded by their length, 2 bytes
+	// little endian, instead of relying on newlines
+	static constexpr uint32_t nBinaryFraming = 1u << 0;
+
+	// Several queued messages may go out in one write
+	static constexpr uint32_t nBatching = 1u << 1;
+
+	// Keyed messages may be replaced by newer ones before they are sent.
+	// Version 0 clients always get this
+	static constexpr uint32_t nConflation = 1u << 2;
+
+	// Payload compression. Reserved, the server has no codec yet and never
+	// grants it
+	static constexpr uint32_t nCompression = 1u << 3;
+
+	// A session is opened right away, see session_frame
+	static constexpr uint32_t nResumption = 1u << 4;
+
+	// Vehicle states go out as deltas against the last one the client
+	// got, see vehicle_frame
+	static constexpr uint32_t nDeltaEncoding = 1u << 5;
+};
+
+// A client announces that it sends one of these by setting
+// CHandshakeCookies::nHelloFlag in its handshake answer, and sends it
+// right after. The server replies with the version and capabilities it
+// granted, as the first bytes it writes, before any framing applies. The
+// client waits for the reply before sending anything else.
+//
+// Layout: marker, version, capabilities (4 bytes little endian), 2 zero bytes
+struct hello_frame
+{
+	static constexpr uint8_t nMarker = 0x02;
+	static constexpr size_t nSize = 8;
+
+	uint8_t nVersion = 0;
+	uint32_t nCapabilities = 0;
+
+	owned_message encode() const
+	{
+		char aData[nSize] = {};
+		aData[0] = char(nMarker);
+		aData[1] = char(nVersion);
+		for (size_t i = 0; i < 4; i++)
+			aData[2 + i] = char(nCapabilities >> (8 * i));
+
+		owned_message msg(connection_handle(), aData, nSize);
+		msg.type = nMarker;
+		msg.priority = message_priority::urgent;
+		msg.bUnframed = true;
+		return msg;
+	}
+
+	// Version 0 and nothing granted if it is not a hello at all
+	static hello_frame decode(const char* pData)
+	{
+		hello_frame frame;
+		if (uint8_t(pData[0]) != nMarker)
+			return frame;
+
+		frame.nVersion = uint8_t(pData[1]);
+		for (size_t i = 0; i < 4; i++)
+			frame.nCapabilities |= uint32_t(uint8_t(pData[2 + i])) << (8 * i);
+		return frame;
+	}
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Double ended queue on top of a circular array. Unlike std::deque it keeps
+// its storage when drained, so a queue in steady state never allocates.
+// Capacity doubles when full and is always a power of two.
+template<typename T>
+class ring_buffer
+{
+	public:
+		bool empty() const { return m_nCount == 0; }
+		size_t size() const { return m_nCount; }
+		size_t capacity() const { return m_vecSlots.size(); }
+
+		T& front() { return m_vecSlots[m_nHead]; }
+		T& back() { return m_vecSlots[index(m_nCount - 1)]; }
+
+		// Access by position from the front
+		T& operator[](size_t i) { return m_vecSlots[index(i)]; }
+
+		void push_back(T&& item)
+		{
+			if (m_nCount == m_vecSlots.size())
+				grow();
+
+			m_vecSlots[index(m_nCount)] = std::move(item);
+			m_nCount++;
+		}
+
+		void push_front(T&& item)
+		{
+			if (m_nCount == m_vecSlots.size())
+				grow();
+
+			m_nHead = (m_nHead + m_vecSlots.size() - 1) & (m_vecSlots.size() - 1);
+			m_vecSlots[m_nHead] = std::move(item);
+			m_nCount++;
+		}
+
+		void pop_front()
+		{
+			// Drop whatever resources the slot still holds
+			m_vecSlots[m_nHead] = T();
+			m_nHead = (m_nHead + 1) & (m_vecSlots.size() - 1);
+			m_nCount--;
+		}
+
+		void pop_back()
+		{
+			m_vecSlots[index(m_nCount - 1)] = T();
+			m_nCount--;
+		}
+
+		void clear()
+		{
+			while (!empty())
+				pop_front();
+			m_nHead = 0;
+		}
+
+		void reserve(size_t nCapacity)
+		{
+			while (m_vecSlots.size() < nCapacity)
+				grow();
+		}
+
+	private:
+		size_t index(size_t i) const
+		{
+			return (m_nHead + i) & (m_vecSlots.size() - 1);
+		}
+
+		void grow()
+		{
+			std::vector<T> vecSlots(m_vecSlots.empty() ? 16 : m_vecSlots.size() * 2);
+			for (size_t i = 0; i < m_nCount; i++)
+				vecSlots[i] = std::move(m_vecSlots[index(i)]);
+
+			m_vecSlots.swap(vecSlots);
+			m_nHead = 0;
+		}
+
+		std::vector<T> m_vecSlots;
+		size_t m_nHead = 0;
+		size_t m_nCount = 0;
+};
@@ -1,24 +1,132 @@
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include "server.h"
+#include "slab_allocator.h"
 
 #include <asio.hpp>
 #include <asio/ts/buffer.hpp>
 #include <asio/ts/internet.hpp>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+namespace
+{
+	// Idle polls spent spinning, then yielding, before falling back to
+	// blocking waits of nBusyPollSleep
+	constexpr size_t nBusyPollSpins = 20000;
+	constexpr size_t nBusyPollYields = 40000;
+	constexpr auto nBusyPollSleep = std::chrono::milliseconds(1);
+
+	// How long a new process waits for its predecessor's listener, and how
+	// often a retiring one looks for clients ready to be handed over
+	constexpr int nHandoffTimeoutMs = 5000;
+	constexpr auto nDrainTick = std::chrono::milliseconds(10);
+
+	// Messages update() handles inside one epoch guard
+	constexpr size_t nUpdateBatch = 64;
+
+	void cpuRelax()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	}
+
+	void refuseSocket(asio::ip::tcp::socket& socket)
+	{
+		std::error_code ignored;
+		socket.shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+		socket.close(ignored);
+	}
+
+	void tuneSocket(asio::ip::tcp::socket& socket)
+	{
+		std::error_code ec;
+		socket.set_option(asio::ip::tcp::no_delay(true), ec);
+
+#ifdef TCP_QUICKACK
+		// Not sticky, the kernel may go back to delayed acks later on
+		int nOne = 1;
+		setsockopt(socket.native_handle(), IPPROTO_TCP, TCP_QUICKACK, &nOne, sizeof(nOne));
+#endif
+	}
+}
+
+CServer::~CServer()
+{
+	stop();
+}
+
 void CServer::update()
 {
-	m_qMessagesIn.wait();
+	// Once retired there is nothing left to wait for, only leftovers
+	if (!retired())
+		m_qMessagesIn.wait();
 
-	// Process as many messages as you can up to the value
-	// specified
-	while (!m_qMessagesIn.empty())
+	// Process as many messages as you can, taking turns between clients
+	owned_message msg;
+	bool bDrained = false;
+	while (!bDrained)
 	{
-		// Grab the front message
-		owned_message msg = m_qMessagesIn.pop_front();
+		// Handles resolved by the handlers below stay valid until the end
+		// of the batch. Left between batches, so the epoch still moves on,
+		// and released slots come back, when the queue never runs dry
+		epoch_guard guard;
+
+		for (size_t n = 0; n < nUpdateBatch; n++)
+		{
+			if (!m_qMessagesIn.pop_front(msg))
+			{
+				bDrained = true;
+				break;
+			}
+
+			uint64_t nNow = coarse_clock::now();
 
-		// Pass to message handler
-		OnMessage(msg.remote, msg.msg);
+			// Anything that went stale while we were behind is dropped
+			// unhandled, catching up should mean less work, not more
+			if (msg.expired(nNow))
+			{
+				m_nExpiredIn.fetch_add(1, std::memory_order_relaxed);
+				inboundDone(msg.remote);
+				continue;
+			}
+
+			// The queue has been standing for too long, keep the latency of
+			// what matters bounded by skipping what does not
+			if (m_bLoadShedding && m_codelIn.onDequeue(nNow > msg.nTimestamp ? nNow - msg.nTimestamp : 0, nNow)
+				&& m_aSheddableTypes[msg.type])
+			{
+				m_nShedIn.fetch_add(1, std::memory_order_relaxed);
+				inboundDone(msg.remote);
+				continue;
+			}
+
+			// Pass to message handler, or to the client's mailbox when
+			// handlers run on the worker pool
+			if (m_poolWorkers)
+			{
+				m_poolWorkers->post(msg.remote.nSlot, std::move(msg));
+			}
+			else
+			{
+				connection_handle client = msg.remote;
+				OnMessage(client, msg);
+				inboundDone(client);
+			}
+		}
 	}
+
+	// Drained to the bottom, nothing is standing in the queue anymore
+	if (m_bLoadShedding)
+		m_codelIn.onEmpty();
+
+	// Inbound payloads were allocated on the asio thread, send the blocks
+	// freed above back to it in one go
+	CSlabAllocator::flush();
 }
 
 void CServer::listen_connections()
@@ -32,15 +140,34 @@ void CServer::listen_connections()
 				// Display some useful(?) information
 				std::cout << "[SERVER] New Connection: " << socket.remote_endpoint() << "\n";
 
-				//Create a new connection to handle this client
-				std::shared_ptr<CConnection> newconn = std::make_shared<CConnection>(m_asioContext, std::move(socket), m_qMessagesIn);
+				if (m_bLowLatencySockets)
+					tuneSocket(socket);
 
-				m_deqConnections.push_back(std::move(newconn));
+				// A new client would only make an overloaded server worse
+				// for everyone already connected
+				if (isOverloaded())
+				{
+					std::cout << "[SERVER] Connection Refused: overloaded\n";
+					m_nRefusedOverloaded.fetch_add(1, std::memory_order_relaxed);
+					refuseSocket(socket);
+					this->listen_connections();
+					return;
+				}
 
-				m_deqConnections.back()->connectToClient(this, nClientID++);
+				// Only a small handshake slot until the client has answered,
+				// the connection itself comes from the pool afterwards
+				if (!m_handshakes.begin(socket))
+				{
+					std::cout << "[SERVER] Connection Refused: too many handshakes in progress\n";
+					refuseSocket(socket);
+				}
 			}
 			else
 			{
+				// Closed because the listening socket went to a successor
+				if (!m_asioAcceptor.is_open())
+					return;
+
 				// Error has occurred during acceptance
 				std::cout << "[SERVER] New Connection Error: " << ec.message() << "\n";
 			}
@@ -49,172 +176,1498 @@ void CServer::listen_connections()
 		});
 }
 
-void CServer::messageClient(std::shared_ptr<CConnection> client, const std::string& msg)
+void CServer::acceptValidated(asio::ip::tcp::socket socket, const hello_frame& hello)
 {
-	if (client && client->isConnected())
+	// Take a preallocated connection to handle this client
+	CConnection* newconn = m_poolConnections.acquire(socket);
+	if (!newconn)
 	{
-		// ...and post the message via the connection
-		client->send(msg);
+		// Pool is exhausted - refuse rather than grow. The socket was
+		// not taken by the pool, so it is still ours to close
+		std::cout << "[SERVER] Connection Refused: at capacity (" << m_poolConnections.capacity() << ")\n";
+		refuseSocket(socket);
+		return;
 	}
-	else
+
+	// Unclassified until the application says otherwise
+	setupConnection(newconn, client_class::unclassified);
+
+	// From here on the connection belongs to the asio thread of its shard,
+	// which is this one unless there are several
+	uint32_t nId = nClientID++;
+	asio::dispatch(newconn->context(), [this, newconn, nId, hello]()
+		{
+			// A client that said hello gets the reply before anything else,
+			// it has to know how the rest is framed
+			uint32_t nGranted = 0;
+			if (hello.nVersion > 0)
+			{
+				uint32_t nOffered = m_nOfferedCapabilities;
+				if (!m_bSessions)
+					nOffered &= ~capabilities::nResumption;
+
+				hello_frame reply;
+				reply.nVersion = std::min(hello.nVersion, nProtocolVersion);
+				reply.nCapabilities = nGranted = hello.nCapabilities & nOffered;
+				newconn->setCapabilities(reply.nVersion, nGranted);
+				newconn->sendControl(reply.encode());
+			}
+
+			newconn->connectToClient(this, nId);
+
+			if (nGranted & capabilities::nResumption)
+			{
+				session_frame open;
+				open.nOp = 'N';
+				handleSessionFrame(newconn->handle(), open);
+			}
+		});
+}
+
+void CServer::setupConnection(CConnection* conn, client_class cls)
+{
+	for (size_t i = 0; i < m_aLaneQuotas.size(); i++)
+		conn->setLaneQuota(message_priority(i), m_aLaneQuotas[i]);
+
+	conn->setClass(cls);
+	conn->setRateLimit(m_aClassRates[size_t(cls)].fRate, m_aClassRates[size_t(cls)].fBurst);
+	m_qMessagesIn.setWeight(conn->getSlot(), m_aClassWeights[size_t(cls)]);
+}
+
+void CServer::messageClient(connection_handle client, owned_message&& msg)
+{
+	epoch_guard guard;
+
+	CConnection* conn = m_poolConnections.resolve(client);
+	if (conn && conn->isConnected())
+		conn->send(std::move(msg));
+}
+
+void CServer::messageClient(connection_handle client, const std::string& msg, message_priority priority, uint64_t nKey)
+{
+	epoch_guard guard;
+
+	// A client that cannot be reached has already closed its socket and
+	// is on its way back to the pool, nothing to do for it here
+	CConnection* conn = m_poolConnections.resolve(client);
+	if (conn && conn->isConnected())
 	{
-		// If we cant communicate with client then we may as 
-		// well remove the client - let the server know, it may
-		// be tracking it somehow
-		OnClientDisconnect(client);
+		// ...and post the message via the connection
+		conn->send(msg, priority, nKey);
+	}
+}
+
+void CServer::setClientClass(connection_handle client, client_class cls)
+{
+	epoch_guard guard;
+
+	CConnection* conn = m_poolConnections.resolve(client);
+	if (!conn)
+		return;
+
+	conn->setClass(cls);
+	conn->setRateLimit(m_aClassRates[size_t(cls)].fRate, m_aClassRates[size_t(cls)].fBurst);
+	m_qMessagesIn.setWeight(client.nSlot, m_aClassWeights[size_t(cls)]);
+}
+
+CConnection* CServer::getConnection(connection_handle client)
+{
+	return m_poolConnections.resolve(client);
+}
 
-		// Off you go now, bye bye!
-		client.reset();
+void CServer::inboundDone(connection_handle client)
+{
+	// Counted on the connection the message came from. One released since
+	// has been reset, and maybe reused, and is not touched
+	CConnection* conn = m_poolConnections.resolve(client);
+	if (conn)
+		conn->inboundDone();
+}
+
+void CServer::releaseConnection(connection_handle client)
+{
+	// If the handle is stale it has already been released by someone else
+	CConnection* conn = m_poolConnections.resolve(client);
+	if (!conn)
+		return;
 
-		// Then physically remove it from the container
-		m_deqConnections.erase( std::remove(m_deqConnections.begin(), m_deqConnections.end(), client), m_deqConnections.end());
+	// The client may come back for its session, keep what it has not seen
+	session* s = conn->getSession() ? m_sessions.find(conn->getSession()) : nullptr;
+	if (s && s->bound == client)
+	{
+		// Never written, so vehicle states are still raw. There is no
+		// baseline to encode against on the connection coming back
+		owned_message msg;
+		while (conn->popUnsent(msg))
+		{
+			vehicle_frame::toFull(msg);
+			m_sessions.record(*s, msg);
+		}
+		m_sessions.detach(*s, coarse_clock::now());
 	}
+	conn->setSession(0);
+
+	m_topics.unsubscribeAll(client);
+	m_stateTopics.unsubscribeAll(client);
+
+	// Let the server know, it may be tracking it somehow
+	OnClientDisconnect(client);
+
+	// Off you go now, back to the pool
+	m_poolConnections.release(conn);
 }
 
-bool CServer::start()
+void CServer::transferConnection(connection_handle client)
 {
-	try
+	CConnection* conn = m_poolConnections.resolve(client);
+	if (!conn)
+		return;
+
+	handoff_record rec;
+	uint32_t nId = conn->getID();
+	int nFd = conn->detach(rec);
+	bool bSent = nFd >= 0 && m_nSuccessor >= 0 && CHotRestart::send(m_nSuccessor, rec, nFd);
+
+	// Its feeds follow, the successor subscribes it again
+	if (bSent)
 	{
-		listen_connections();
+		handOverTopics(handoff_record::subscriptions, nId, m_topics.topicsOf(client));
+		handOverTopics(handoff_record::state_joins, nId, m_stateTopics.topicsOf(client));
+	}
+
+	// The successor has its own copy of the descriptor now
+	if (nFd >= 0)
+		::close(nFd);
 
-		m_threadContext = std::thread([this]() { m_asioContext.run(); });
+	if (!bSent)
+	{
+		std::cout << "[SERVER] Could not hand over [" << nId << "], dropping it\n";
+		releaseConnection(client);
+		return;
 	}
-	catch (std::exception& e)
+
+	// The client lives on in the successor, it has not disconnected
+	m_topics.unsubscribeAll(client);
+	m_stateTopics.unsubscribeAll(client);
+	m_poolConnections.release(conn);
+}
+
+void CServer::handOverTopics(handoff_record::kind nKind, uint32_t nId, const std::vector<uint64_t>& vecTopics)
+{
+	for (size_t i = 0; i < vecTopics.size(); i += handoff_record::nMaxTopics)
 	{
-		// Something prohibited the server from listening
-		std::cerr << "[SERVER] Exception: " << e.what() << "\n";
-		return false;
+		handoff_record rec;
+		rec.nKind = nKind;
+		rec.nId = nId;
+		rec.nTopics = uint16_t(std::min(vecTopics.size() - i, handoff_record::nMaxTopics));
+		std::copy(vecTopics.begin() + i, vecTopics.begin() + i + rec.nTopics, rec.aTopics);
+
+		// The connection is over there already, it just misses a feed
+		if (!CHotRestart::send(m_nSuccessor, rec, -1))
+			std::cout << "[SERVER] Could not hand over the topics of [" << nId << "]\n";
 	}
+}
 
-	std::cout << "[SERVER] Started!\n";
-	return true;
+bool CServer::subscribe(connection_handle client, uint64_t nTopic)
+{
+	epoch_guard guard;
+
+	// Keeps handles of long gone clients out of the index. One that closes
+	// right after this is cleaned up when its slot subscribes next
+	CConnection* conn = m_poolConnections.resolve(client);
+	if (!conn || !conn->isConnected())
+		return false;
+
+	return m_topics.subscribe(nTopic, client);
 }
 
-void CConnection::writeValidation()
+bool CServer::unsubscribe(connection_handle client, uint64_t nTopic)
 {
-	asio::async_write(m_socket, asio::buffer(&m_nHandshakeOut, sizeof(uint64_t)),
-		[this](std::error_code ec, std::size_t length)
-		{
-			if (!ec)
-			{
-				std::cout << "[" << id << "] Validation sent, let`s wait for a response" << std::endl;
-				// Validation data sent, clients should sit and wait
-				// for a response (or a closure)
-			}
-			else
-			{
-				m_socket.close();
-			}
-		});
+	return m_topics.unsubscribe(nTopic, client);
 }
 
-void CConnection::readValidation(CServer *server)
+void CServer::publish(uint64_t nTopic, const std::string& msg, message_priority priority, uint64_t nKey)
 {
-	asio::async_read(m_socket, asio::buffer(&m_nHandshakeIn, sizeof(uint64_t)),
-		[this, server](std::error_code ec, std::size_t length)
-		{
-			if (!ec)
+	owned_message out(connection_handle(), msg.data(), msg.size());
+	out.priority = priority;
+	out.key = nKey;
+	publish(nTopic, std::move(out));
+}
+
+void CServer::publish(uint64_t nTopic, owned_message&& msg)
+{
+	publishTo(m_topics, nTopic, std::move(msg));
+}
+
+void CServer::publishTo(const CTopicIndex& index, uint64_t nTopic, owned_message&& msg)
+{
+	auto job = std::make_shared<fanout_job>();
+	job->report.nTag = nTopic;
+	job->msg = std::move(msg);
+	job->vecPartitions.resize(ioThreads());
+
+	// The subscriber array is only safe to read inside the index, so it is
+	// split while walking it
+	index.forEach(nTopic, [&](connection_handle client) { job->vecPartitions[client.nSlot % ioThreads()].push_back(client); });
+	startFanout(std::move(job));
+}
+
+void CServer::fanOut(const std::vector<connection_handle>& vecRecipients, owned_message&& msg, uint64_t nTag)
+{
+	auto job = std::make_shared<fanout_job>();
+	job->report.nTag = nTag;
+	job->msg = std::move(msg);
+	job->vecPartitions.resize(ioThreads());
+
+	for (const connection_handle& client : vecRecipients)
+	{
+		if (client.valid())
+			job->vecPartitions[client.nSlot % ioThreads()].push_back(client);
+	}
+	startFanout(std::move(job));
+}
+
+void CServer::startFanout(std::shared_ptr<fanout_job> job)
+{
+	job->report.nStarted = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count());
+	if (job->msg.nTimestamp == 0)
+		job->msg.nTimestamp = coarse_clock::now();
+
+	// Shared once here, every copy queued later is a reference count bump
+	job->msg.share();
+
+	size_t nPartitions = 0;
+	for (const auto& vecPartition : job->vecPartitions)
+	{
+		job->report.nRecipients += vecPartition.size();
+		if (!vecPartition.empty())
+			nPartitions++;
+	}
+
+	if (nPartitions == 0)
+	{
+		job->report.nFinished = job->report.nStarted;
+		OnFanoutComplete(job->report);
+		return;
+	}
+
+	// Set before any thread can finish its part
+	job->nPending.store(nPartitions, std::memory_order_relaxed);
+	for (size_t i = 0; i < job->vecPartitions.size(); i++)
+	{
+		if (job->vecPartitions[i].empty())
+			continue;
+
+		asio::post(shardContext(i), [this, job, i]()
 			{
-				// Compare sent data to actual solution
-				//if (m_nHandshakeIn == m_nHandshakeCheck)
+				fanout_shard& shard = m_vecFanoutShards[i];
+				shard.qJobs.push_back(std::shared_ptr<fanout_job>(job));
+				if (!shard.bScheduled)
 				{
-					// Client has provided valid solution, so allow it to connect properly
-					std::cout << "Client Validated" << std::endl;
-					server->OnClientValidated(this->shared_from_this());
-
-					// Sit waiting to receive data now
-					readData();
+					shard.bScheduled = true;
+					runFanout(i);
 				}
-			//	else
-			//	{
-					// Client gave incorrect data, so disconnect
-			//		std::cout << "Client Disconnected (Fail Validation)" << std::endl;
-			//		m_socket.close();
-			//	}
-			} else
-			{
-				// Some biggerfailure occured
-				std::cout << "Client Disconnected (ReadValidation)" << std::endl;
-				m_socket.close();
-			}
-		});
+			});
+	}
 }
 
-void CConnection::connectToClient(CServer *server, uint32_t uid)
+void CServer::runFanout(size_t nShard)
 {
-	if (!m_socket.is_open())
+	fanout_shard& shard = m_vecFanoutShards[nShard];
+	std::shared_ptr<fanout_job> job = shard.qJobs.front();
+
+	const std::vector<connection_handle>& vecPartition = job->vecPartitions[nShard];
+	size_t nEnd = std::min(shard.nOffset + nFanoutChunk, vecPartition.size());
+
+	// Every client of the partition is served by this thread, which owns
+	// its lifetime, so the handles stay good without an epoch guard
+	size_t nDelivered = 0;
+	for (size_t i = shard.nOffset; i < nEnd; i++)
 	{
-		std::cout << "ERROR: socket is not open, restart server" << std::endl;
-		return;
+		CConnection* conn = m_poolConnections.resolve(vecPartition[i]);
+		if (!conn || !conn->isConnected())
+			continue;
+
+		conn->queueOut(owned_message(job->msg));
+		nDelivered++;
 	}
+	job->nDelivered.fetch_add(nDelivered, std::memory_order_relaxed);
+	m_nPublished.fetch_add(nDelivered, std::memory_order_relaxed);
 
-	id = uid;
+	shard.nOffset = nEnd;
+	if (nEnd == vecPartition.size())
+	{
+		shard.qJobs.pop_front();
+		shard.nOffset = 0;
 
-	writeValidation();
+		// The last thread to finish reports
+		if (job->nPending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			job->report.nDelivered = job->nDelivered.load(std::memory_order_relaxed);
+			job->report.nFinished = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count());
+			OnFanoutComplete(job->report);
+		}
+	}
 
-	readValidation(server);
+	// Go to the back of the line, reads and writes queued meanwhile first
+	if (shard.qJobs.empty())
+		shard.bScheduled = false;
+	else
+		asio::post(shardContext(nShard), [this, nShard]() { runFanout(nShard); });
 }
 
-void CConnection::addToIncomingMessageQueue()
+bool CServer::setState(uint64_t nTopic, uint64_t nKey, const std::string& value)
 {
-	m_qMessagesIn.push_back({ this->shared_from_this(), m_msgTemporaryIn });
+	scoped_lock lock(m_mxState);
 
-	readData();
+	owned_message delta;
+	if (!m_state.set(nTopic, nKey, value.data(), value.size(), delta))
+		return false;
+
+	publishTo(m_stateTopics, nTopic, std::move(delta));
+	return true;
 }
 
-void CConnection::writeData()
+void CServer::eraseState(uint64_t nTopic, uint64_t nKey)
 {
-	asio::async_write(m_socket, asio::buffer(m_qMessagesOut.front(), m_qMessagesOut.front().length()),
-		[this](std::error_code ec, std::size_t length)
+	scoped_lock lock(m_mxState);
+
+	owned_message delta;
+	if (m_state.erase(nTopic, nKey, delta))
+		publishTo(m_stateTopics, nTopic, std::move(delta));
+}
+
+bool CServer::joinState(connection_handle client, uint64_t nTopic)
+{
+	epoch_guard guard;
+
+	CConnection* conn = m_poolConnections.resolve(client);
+	if (!conn || !conn->isConnected() || !(conn->getCapabilities() & capabilities::nBinaryFraming))
+		return false;
+
+	if (nTopic == 0)
+		return false;
+
+	// Joining again while joined just starts over from a new snapshot
+	scoped_lock lock(m_mxState);
+	m_stateTopics.subscribe(nTopic, client);
+
+	// Posted to the client's asio thread ahead of the fan-out of any later
+	// change, which is only started under the same lock. Deltas and the
+	// snapshot share the normal lane and no key, so nothing reorders or
+	// conflates them on the way out
+	for (const owned_message& part : m_state.snapshot(nTopic))
+		conn->send(owned_message(part));
+	return true;
+}
+
+uint64_t CServer::stateVersion(uint64_t nTopic)
+{
+	scoped_lock lock(m_mxState);
+	return m_state.version(nTopic);
+}
+
+uint64_t CServer::snapshotsBuilt()
+{
+	scoped_lock lock(m_mxState);
+	return m_state.snapshotsBuilt();
+}
+
+void CServer::messageSession(uint64_t nToken, owned_message&& msg)
+{
+	if (msg.nTimestamp == 0)
+		msg.nTimestamp = coarse_clock::now();
+
+	// Sessions live on the asio thread
+	asio::post(m_asioContext,
+		[this, nToken, msg = std::move(msg)]() mutable
 		{
-			if (!ec)
-			{
-				// Sending was successful, so we are done with the message
-				// and remove it from the queue
-				m_qMessagesOut.pop_front();
+			session* s = m_sessions.find(nToken);
+			if (!s)
+				return;
+
+			CConnection* conn = s->bound.valid() ? m_poolConnections.resolve(s->bound) : nullptr;
+			if (conn && conn->isConnected())
+				conn->send(std::move(msg));
+			else
+				m_sessions.record(*s, msg);		// replayed when the client is back
+		});
+}
+
+void CServer::handleSessionFrame(connection_handle client, const session_frame& frame)
+{
+	CConnection* conn = m_poolConnections.resolve(client);
+	if (!conn || !m_bSessions)
+		return;
+
+	session* s = conn->getSession() ? m_sessions.find(conn->getSession()) : nullptr;
+	session_frame reply;
 
-				// If the queue still has messages in it, then issue the task to
-				// send the next messages' header.
-				if (!m_qMessagesOut.empty())
+	switch (frame.nOp)
+	{
+		case 'N':
+			if (!s)
+			{
+				m_sessions.expire(coarse_clock::now());
+				s = m_sessions.open(conn->getID(), client);
+				if (!s)
 				{
-					writeData();
+					// Better no session than one with a guessable token
+					std::cerr << "[SERVER] No random source for session tokens\n";
+					break;
 				}
+				conn->setSession(s->nToken);
+			}
+			reply.nOp = 'S';
+			reply.nToken = s->nToken;
+			reply.nSeq = s->nNextSeq;
+			conn->sendControl(reply.encode());
+			break;
+
+		case 'A':
+			if (s)
+				m_sessions.ack(*s, frame.nSeq);
+			break;
+
+		case 'R':
+			if (session* resumed = m_sessions.find(frame.nToken))
+			{
+				resumeSession(conn, *resumed, frame.nSeq);
 			}
 			else
 			{
-				// Sending failed, see WriteHeader() equivalent for description :P
-				std::cout << "[" << id << "] Write Body Fail.\n";
-				m_socket.close();
+				// Expired or never existed, the client starts over on a new one
+				m_sessions.expire(coarse_clock::now());
+				if (!s)
+				{
+					s = m_sessions.open(conn->getID(), client);
+					if (!s)
+					{
+						std::cerr << "[SERVER] No random source for session tokens\n";
+						break;
+					}
+					conn->setSession(s->nToken);
+				}
+				reply.nOp = 'X';
+				reply.nToken = s->nToken;
+				reply.nSeq = s->nNextSeq;
+				conn->sendControl(reply.encode());
 			}
-		});
+			break;
+	}
 }
 
-void CConnection::send(const std::string& msg)
+void CServer::resumeSession(CConnection* conn, session& s, uint64_t nSeq)
 {
-	asio::post(m_asioContext,
-		[this, msg]()
+	connection_handle client = conn->handle();
+
+	// Still held by the connection the client left behind, which may not
+	// have noticed yet that it is dead
+	if (s.bound.valid() && s.bound != client)
+	{
+		CConnection* old = m_poolConnections.resolve(s.bound);
+		if (old)
 		{
-			// If the queue has a message in it, then we must 
-			// assume that it is in the process of asynchronously being written.
-			// Either way add the message to the queue to be output. If no messages
-			// were available to be written, then start the process of writing the
-			// message at the front of the queue.
-			bool bWritingMessage = !m_qMessagesOut.empty();
-			m_qMessagesOut.push_back(msg);
-			if (!bWritingMessage)
+			owned_message msg;
+			while (old->popUnsent(msg))
 			{
-				writeData();
+				vehicle_frame::toFull(msg);
+				m_sessions.record(s, msg);
 			}
-		});
+			old->setSession(0);
+			old->close();
+		}
+	}
+
+	// A session opened on this connection before is left to expire
+	if (conn->getSession() != 0 && conn->getSession() != s.nToken)
+	{
+		if (session* other = m_sessions.find(conn->getSession()))
+			m_sessions.detach(*other, coarse_clock::now());
+	}
+
+	s.bound = client;
+	conn->setSession(s.nToken);
+	conn->setID(s.nClientId);
+
+	session_frame reply;
+	reply.nToken = s.nToken;
+	if (m_sessions.canReplay(s, nSeq))
+	{
+		m_sessions.ack(s, nSeq);
+		reply.nOp = 'R';
+		reply.nSeq = nSeq;
+		conn->sendControl(reply.encode());
+
+		// Copies, they stay in the session until acknowledged
+		for (size_t i = 0; i < s.qUnacked.size(); i++)
+			conn->sendControl(owned_message(s.qUnacked[i]));
+	}
+	else
+	{
+		// Part of the gap is gone, the client has to fetch full state
+		m_sessions.ack(s, s.nNextSeq);
+		reply.nOp = 'X';
+		reply.nSeq = s.nNextSeq;
+		conn->sendControl(reply.encode());
+	}
+
+	OnClientResumed(client, s.nToken);
 }
 
-size_t CConnection::readData()
+void CServer::recordSent(uint64_t nToken, const owned_message& msg)
 {
-	size_t res = 0;
+	session* s = m_sessions.find(nToken);
+	if (s)
+		m_sessions.record(*s, msg);
+}
 
-	if (!m_socket.is_open())
+bool CServer::dispatchDirect(owned_message& msg)
+{
+	if (m_aDispatchModes[msg.type] != dispatch_mode::direct)
+		return false;
+
+	// We are on the asio thread, which owns connection lifetimes, so the
+	// handle stays good for the whole call without an epoch guard
+	OnMessage(msg.remote, msg);
+	return true;
+}
+
+bool CServer::start()
+{
+	// Both keep their state on the first asio thread only
+	if (ioThreads() > 1 && (m_bSessions || !m_strHotRestartPath.empty()))
 	{
-		std::cout << "[CONNECTION] Cannot read data, socket is closet(((" << std::endl;
+		std::cerr << "[SERVER] Sessions and hot restart need a single asio thread\n";
+		return false;
+	}
+
+	// The successor would not know the tokens
+	if (m_bSessions && !m_strHotRestartPath.empty())
+	{
+		std::cerr << "[SERVER] Sessions are not handed over in a hot restart, enable one or the other\n";
+		return false;
+	}
+
+	try
+	{
+		if (m_nWorkerThreads > 0)
+		{
+			// One mailbox per pool slot
+			m_poolWorkers = std::make_unique<CWorkerPool>(m_nWorkerThreads, m_poolConnections.capacity(),
+				[this](owned_message& msg)
+				{
+					connection_handle client = msg.remote;
+					OnMessage(client, msg);
+					inboundDone(client);
+				},
+				[this](size_t nWorker)
+				{
+					// Spread the workers one per CPU of the list
+					cpu_placement place = placement(thread_role::worker);
+					if (!place.vecCpus.empty())
+						place.vecCpus = { place.vecCpus[nWorker % place.vecCpus.size()] };
+					if (!place.empty() && !CThreadAffinity::apply(place))
+						std::cerr << "[SERVER] Could not place worker " << nWorker << "\n";
+				});
+		}
+
+		// Either the previous process gives us its listening socket, or
+		// this is a plain start and we bind the port ourselves
+		if (!m_strHotRestartPath.empty() && takeOver())
+			std::cout << "[SERVER] Took over from the previous process\n";
+		if (!m_asioAcceptor.is_open())
+			openAcceptor();
+
+		if (!m_strHotRestartPath.empty())
+			listenForSuccessor();
+
+		listen_connections();
+
+		m_threadContext = std::thread([this]() { runShard(m_asioContext, 0); });
+		for (size_t i = 0; i < m_vecIoShards.size(); i++)
+			m_vecShardThreads.emplace_back([this, i]() { runShard(*m_vecIoShards[i], i + 1); });
+
+		// The pool is only complete once every asio thread has made its
+		// connections, handles from the caller's side need all of them
+		std::unique_lock<std::mutex> lock(m_mxShardsReady);
+		m_cvShardsReady.wait(lock, [this]() { return m_nShardsReady == ioThreads(); });
+	}
+	catch (std::exception& e)
+	{
+		// Something prohibited the server from listening
+		std::cerr << "[SERVER] Exception: " << e.what() << "\n";
+		return false;
+	}
+
+	std::cout << "[SERVER] Started!\n";
+	return true;
+}
+
+void CServer::stop()
+{
+	m_asioContext.stop();
+	for (auto& context : m_vecIoShards)
+		context->stop();
+
+	if (m_threadContext.joinable())
+		m_threadContext.join();
+	for (std::thread& thread : m_vecShardThreads)
+	{
+		if (thread.joinable())
+			thread.join();
+	}
+	m_vecShardThreads.clear();
+}
+
+std::vector<std::unique_ptr<asio::io_context>> CServer::makeShards(size_t nIoThreads)
+{
+	std::vector<std::unique_ptr<asio::io_context>> vecShards;
+	for (size_t i = 1; i < nIoThreads; i++)
+		vecShards.push_back(std::make_unique<asio::io_context>(1));
+	return vecShards;
+}
+
+void CServer::runShard(asio::io_context& context, size_t nShard)
+{
+	// Several asio threads are spread one per CPU of the list
+	cpu_placement place = placement(thread_role::io);
+	if (ioThreads() > 1 && !place.vecCpus.empty())
+		place.vecCpus = { place.vecCpus[nShard % place.vecCpus.size()] };
+	if (!place.empty() && !CThreadAffinity::apply(place))
+		std::cerr << "[SERVER] Could not place asio thread " << nShard << "\n";
+
+	// Connections and their buffers are made and faulted in now, not
+	// during the first rush, and from here so they are local to the
+	// thread serving them. Any thread may reach any slot once clients
+	// arrive, so nobody goes on before every shard has its part
+	m_poolConnections.create(nShard, ioThreads());
+	{
+		std::unique_lock<std::mutex> lock(m_mxShardsReady);
+		m_nShardsReady++;
+		m_cvShardsReady.notify_all();
+		m_cvShardsReady.wait(lock, [this]() { return m_nShardsReady == ioThreads(); });
+	}
+
+	// The other shards have nothing to do until the first client arrives
+	auto work = asio::make_work_guard(context);
+	if (nShard == 0)
+		work.reset();
+
+	if (m_bBusyPoll)
+		pollContext(context);
+	else
+		context.run();
+}
+
+void CServer::openAcceptor()
+{
+	asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), m_nPort);
+	m_asioAcceptor.open(endpoint.protocol());
+	m_asioAcceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+	m_asioAcceptor.bind(endpoint);
+	m_asioAcceptor.listen();
+}
+
+bool CServer::takeOver()
+{
+	// Nobody listening there means there is nothing to take over
+	int nPredecessor = CHotRestart::connect(m_strHotRestartPath);
+	if (nPredecessor < 0)
+		return false;
+
+	handoff_record rec;
+	int nFd;
+	if (!CHotRestart::receive(nPredecessor, rec, nFd, nHandoffTimeoutMs) || rec.nKind != handoff_record::listener || nFd < 0)
+	{
+		std::cerr << "[SERVER] Previous process did not hand over its listening socket\n";
+		if (nFd >= 0)
+			::close(nFd);
+		::close(nPredecessor);
+		return false;
+	}
+
+	m_asioAcceptor.assign(asio::ip::tcp::v4(), nFd);
+
+	// Carry on numbering where it stopped, adopted clients keep their ids
+	nClientID = rec.nId;
+
+	// Its clients follow one by one while it drains
+	m_descPredecessor.assign(nPredecessor);
+	receiveHandoff();
+	return true;
+}
+
+void CServer::receiveHandoff()
+{
+	m_descPredecessor.async_wait(asio::posix::stream_descriptor::wait_read,
+		[this](std::error_code ec)
+		{
+			if (ec)
+				return;
+
+			// Readable, so a record or the hang-up is waiting
+			handoff_record rec;
+			int nFd;
+			if (!CHotRestart::receive(m_descPredecessor.native_handle(), rec, nFd, 0) || rec.nKind == handoff_record::done)
+			{
+				std::cout << "[SERVER] Handoff from the previous process finished\n";
+				m_descPredecessor.close(ec);
+				return;
+			}
+
+			if (rec.nKind == handoff_record::connection && nFd >= 0)
+				adoptConnection(rec, nFd);
+			else if (nFd >= 0)
+				::close(nFd);
+			else if (rec.nKind == handoff_record::subscriptions || rec.nKind == handoff_record::state_joins)
+				adoptTopics(rec);
+
+			receiveHandoff();
+		});
+}
+
+void CServer::adoptConnection(const handoff_record& rec, int nFd)
+{
+	asio::ip::tcp::socket socket(m_asioContext);
+	std::error_code ec;
+	socket.assign(asio::ip::tcp::v4(), nFd, ec);
+	if (ec)
+	{
+		::close(nFd);
+		return;
+	}
+
+	CConnection* conn = m_poolConnections.acquire(socket);
+	if (!conn)
+	{
+		std::cout << "[SERVER] Cannot adopt [" << rec.nId << "]: at capacity (" << m_poolConnections.capacity() << ")\n";
+		refuseSocket(socket);
+		return;
+	}
+
+	client_class cls = rec.nClass < size_t(client_class::count) ? client_class(rec.nClass) : client_class::unclassified;
+	setupConnection(conn, cls);
+	conn->adopt(this, rec);
+
+	// Its topics come next
+	m_lastAdopted = conn->handle();
+	m_nLastAdoptedId = rec.nId;
+
+	std::cout << "[SERVER] Adopted [" << rec.nId << "]\n";
+	OnClientAdopted(conn->handle());
+}
+
+void CServer::adoptTopics(const handoff_record& rec)
+{
+	// Topics of a connection we could not adopt are of no use
+	if (rec.nId != m_nLastAdoptedId || !m_lastAdopted.valid())
+		return;
+
+	for (size_t i = 0; i < rec.nTopics; i++)
+	{
+		if (rec.nKind == handoff_record::subscriptions)
+			subscribe(m_lastAdopted, rec.aTopics[i]);
+		else
+			joinState(m_lastAdopted, rec.aTopics[i]);
+	}
+}
+
+void CServer::listenForSuccessor()
+{
+	int nListener = CHotRestart::listen(m_strHotRestartPath);
+	if (nListener < 0)
+	{
+		std::cerr << "[SERVER] Cannot listen for a successor on " << m_strHotRestartPath << "\n";
+		return;
+	}
+
+	m_descSuccessors.assign(nListener);
+	acceptSuccessor();
+}
+
+void CServer::acceptSuccessor()
+{
+	m_descSuccessors.async_wait(asio::posix::stream_descriptor::wait_read,
+		[this](std::error_code ec)
+		{
+			if (ec)
+				return;
+
+			int nSuccessor = CHotRestart::accept(m_descSuccessors.native_handle());
+			if (nSuccessor < 0)
+			{
+				acceptSuccessor();
+				return;
+			}
+
+			handOff(nSuccessor);
+		});
+}
+
+void CServer::handOff(int nSuccessor)
+{
+	std::cout << "[SERVER] Successor connected, handing over\n";
+
+	handoff_record rec;
+	rec.nKind = handoff_record::listener;
+	rec.nId = nClientID;
+	if (!CHotRestart::send(nSuccessor, rec, m_asioAcceptor.native_handle()))
+	{
+		std::cerr << "[SERVER] Could not hand over the listening socket, still serving\n";
+		::close(nSuccessor);
+		acceptSuccessor();
+		return;
+	}
+
+	// Only one successor. It accepts from the shared listening socket from
+	// now on, pending connections included
+	std::error_code ec;
+	m_descSuccessors.close(ec);
+	m_asioAcceptor.close(ec);
+
+	m_nSuccessor = nSuccessor;
+	m_nDrainDeadline = coarse_clock::now() + m_nDrainTimeout;
+	drainHandoff();
+}
+
+void CServer::drainHandoff()
+{
+	bool bExpired = coarse_clock::now() >= m_nDrainDeadline;
+	size_t nLive = 0;
+
+	for (size_t i = 0; i < m_poolConnections.capacity(); i++)
+	{
+		// Even generations sit in the pool
+		CConnection* conn = m_poolConnections.at(i);
+		if ((conn->getGeneration() & 1) == 0)
+			continue;
+
+		if (bExpired)
+		{
+			conn->close();
+			continue;
+		}
+
+		// Every client still here has passed the handshake. One already
+		// parked may be waiting for its last messages to be handled
+		if (m_bHandOffConnections && conn->isConnected() && conn->isValidated())
+		{
+			if (!conn->isHandingOff())
+				conn->handOff();
+			else
+				conn->finishHandOff();
+		}
+		nLive++;
+	}
+
+	// Clients still in the handshake get a connection, and so a handoff,
+	// on a later tick
+	if (bExpired)
+		m_handshakes.closeAll();
+	else
+		nLive += m_handshakes.pending();
+
+	if (nLive > 0 && !bExpired)
+	{
+		m_timerDrain.expires_after(nDrainTick);
+		m_timerDrain.async_wait([this](std::error_code ec)
+			{
+				if (!ec)
+					drainHandoff();
+			});
+		return;
+	}
+
+	// Releases of the connections closed above are queued, let them go first
+	asio::post(m_asioContext, [this]() { retire(); });
+}
+
+void CServer::retire()
+{
+	handoff_record rec;
+	rec.nKind = handoff_record::done;
+	CHotRestart::send(m_nSuccessor, rec, -1);
+	::close(m_nSuccessor);
+	m_nSuccessor = -1;
+
+	std::cout << "[SERVER] Handed over, retiring\n";
+	m_bRetired.store(true, std::memory_order_release);
+	m_qMessagesIn.interrupt();
+}
+
+size_t CServer::alignIrqs(const std::string& strInterface)
+{
+	const std::vector<int>& vecCpus = placement(thread_role::io).vecCpus;
+	if (vecCpus.empty())
+		return 0;
+
+	size_t nMoved = 0;
+	for (int nIrq : CThreadAffinity::irqsOfInterface(strInterface))
+	{
+		if (CThreadAffinity::setIrqAffinity(nIrq, vecCpus))
+			nMoved++;
+		else
+			std::cerr << "[SERVER] Could not set affinity of IRQ " << nIrq << "\n";
+	}
+	return nMoved;
+}
+
+void CServer::pollContext(asio::io_context& context)
+{
+	size_t nIdle = 0;
+
+	// Like run(), return once the context is out of work
+	while (!context.stopped())
+	{
+		if (context.poll() > 0)
+		{
+			nIdle = 0;
+			continue;
+		}
+
+		nIdle++;
+		if (nIdle < nBusyPollSpins)
+		{
+			cpuRelax();
+		}
+		else if (nIdle < nBusyPollYields)
+		{
+			std::this_thread::yield();
+		}
+		else if (context.run_one_for(nBusyPollSleep) > 0)
+		{
+			// Something arrived while we were parked, go back to spinning
+			nIdle = 0;
+		}
+	}
+}
+
+void CConnection::connectToClient(CServer *server, uint32_t uid)
+{
+	if (!m_socket.is_open())
+	{
+		std::cout << "ERROR: socket is not open, restart server" << std::endl;
+		return;
+	}
+
+	// Only called once the client has answered the handshake
+	id = uid;
+	m_pServer = server;
+	m_bValidHandshake = true;
+
+	std::cout << "Client Validated" << std::endl;
+	server->OnClientValidated(handle());
+
+	// Sit waiting to receive data now
+	readData();
+}
+
+void CConnection::reset(asio::ip::tcp::socket socket)
+{
+	// Sockets are accepted on the first asio thread. One this connection
+	// serves from another thread is moved over to that thread's reactor
+	if (&socket.get_executor().context() != &m_asioContext && socket.is_open())
+	{
+		std::error_code ec;
+		asio::ip::tcp::socket moved(m_asioContext);
+		moved.assign(socket.local_endpoint(ec).protocol(), socket.release(), ec);
+		socket = std::move(moved);
+	}
+
+	m_socket = std::move(socket);
+
+	m_qMessagesOut.reset();
+	m_vecOut.clear();
+	m_bWriting = false;
+	m_msgIn = owned_message();
+	m_bReadingBody = false;
+	m_nVersion = 0;
+	m_nCapabilities.store(0, std::memory_order_relaxed);
+	m_qControl.clear();
+	m_encoderVehicles.clear();
+	m_nSession.store(0, std::memory_order_relaxed);
+	m_incomMsgBuff.consume(m_incomMsgBuff.size());
+
+	m_bValidHandshake = false;
+	m_bHandingOff = false;
+	m_bReadParked = false;
+	m_bRepliesFlushed = false;
+	m_nInbound.store(0, std::memory_order_relaxed);
+
+	m_bucket.configure(0.0, 1.0);
+	m_nThrottledNs.store(0, std::memory_order_relaxed);
+	m_nThrottleCount.store(0, std::memory_order_relaxed);
+
+	id = 0;
+	m_pServer = nullptr;
+}
+
+void CConnection::warm()
+{
+	// Write to every buffer once so the pages are really mapped, reserving
+	// alone only maps them on first use
+	auto buf = m_incomMsgBuff.prepare(m_incomMsgBuff.max_size() - m_incomMsgBuff.size());
+	std::memset(buf.data(), 0, buf.size());
+
+	// Ring slots are constructed when they are reserved
+	m_qMessagesOut.reserve(nWarmMessages);
+	m_qControl.reserve(nWarmMessages);
+
+	m_vecOut.resize(nMaxBatch);
+	m_vecOut.clear();
+	m_vecBuffers.resize(nMaxBatch * 2);
+	m_vecBuffers.clear();
+}
+
+void CConnection::setCapabilities(uint8_t nVersion, uint32_t nCapabilities)
+{
+	m_nVersion = nVersion;
+	m_nCapabilities.store(nCapabilities, std::memory_order_relaxed);
+}
+
+void CConnection::setRateLimit(double fRate, double fBurst)
+{
+	// The bucket belongs to the read loop on the asio thread. The handle
+	// check skips the update if the connection was reused in the meantime
+	asio::post(m_asioContext, [this, client = handle(), fRate, fBurst]()
+		{
+			if (handle() == client)
+				m_bucket.configure(fRate, fBurst);
+		});
+}
+
+bool CConnection::handOff()
+{
+	// Cancelling would abort the write as well, and half a binary frame
+	// cannot be handed over
+	if (m_bWriting || m_bReadingBody || !m_socket.is_open())
+		return false;
+
+	// The aborted read, or the throttle timer, lands in readData(), which
+	// parks instead of reading on
+	m_bHandingOff = true;
+	std::error_code ec;
+	m_socket.cancel(ec);
+	m_timerThrottle.cancel();
+	return true;
+}
+
+void CConnection::finishHandOff()
+{
+	// Whatever got queued meanwhile goes out first, writeData() comes back
+	// here once it is idle
+	if (!m_bHandingOff || !m_bReadParked || m_bWriting)
+		return;
+
+	// Messages already read would be handled here after the client has
+	// gone, and their replies lost. The server's drain tick asks again
+	if (inbound() != 0)
+		return;
+
+	// Replies of the handlers that just finished were posted to this
+	// thread, maybe behind us. Let them reach the lanes first
+	if (!m_bRepliesFlushed)
+	{
+		m_bRepliesFlushed = true;
+		asio::post(m_asioContext, [this, client = handle()]()
+			{
+				if (handle() == client)
+					finishHandOff();
+			});
+		return;
+	}
+
+	m_bHandingOff = false;
+	m_bReadParked = false;
+	m_bRepliesFlushed = false;
+	if (m_pServer)
+		m_pServer->transferConnection(handle());
+}
+
+int CConnection::detach(handoff_record& rec)
+{
+	rec.nKind = handoff_record::connection;
+	rec.nClass = uint8_t(m_class);
+	rec.nId = id;
+	rec.nVersion = m_nVersion;
+	rec.nCapabilities = getCapabilities();
+	rec.nPending = uint16_t(std::min(m_incomMsgBuff.size(), handoff_record::nMaxPending));
+	std::memcpy(rec.aPending, m_incomMsgBuff.data().data(), rec.nPending);
+
+	// Leaves the socket closed on our side, late sends just fail
+	std::error_code ec;
+	int nFd = m_socket.release(ec);
+	m_timerThrottle.cancel();
+	return ec ? -1 : nFd;
+}
+
+void CConnection::adopt(CServer* server, const handoff_record& rec)
+{
+	id = rec.nId;
+	m_pServer = server;
+	m_bValidHandshake = true;
+	setCapabilities(rec.nVersion, rec.nCapabilities);
+
+	auto buf = m_incomMsgBuff.prepare(rec.nPending);
+	std::memcpy(buf.data(), rec.aPending, rec.nPending);
+	m_incomMsgBuff.commit(rec.nPending);
+
+	readData();
+}
+
+void CConnection::sendControl(owned_message&& msg)
+{
+	m_qControl.push_back(std::move(msg));
+	if (!m_bWriting)
+		writeData();
+}
+
+void CConnection::disconnect()
+{
+	// Both the read and the write side may fail, only the first one counts
+	if (!m_socket.is_open())
+		return;
+
+	m_socket.close();
+	m_timerThrottle.cancel();
+
+	// Closing queued the aborted handlers of this socket, post the release
+	// behind them so none of them runs after the connection is reused
+	CServer* server = m_pServer;
+	if (server)
+		asio::post(m_asioContext, [server, client = handle()]() { server->releaseConnection(client); });
+}
+
+void CConnection::addToIncomingMessageQueue()
+{
+	// Same framing as std::getline: everything up to the first newline, or
+	// the whole buffer if there is none, with the newline itself dropped.
+	// The bytes go straight from the streambuf into the message
+	const char* pData = static_cast<const char*>(m_incomMsgBuff.data().data());
+	size_t nAvailable = m_incomMsgBuff.size();
+
+	const char* pEnd = static_cast<const char*>(std::memchr(pData, '\n', nAvailable));
+	size_t nLength = pEnd ? size_t(pEnd - pData) : nAvailable;
+
+	// Session frames are binary and fixed size, no newline to look for
+	if (nAvailable > 0 && uint8_t(pData[0]) == session_frame::nMarker && m_pServer && m_pServer->sessionsEnabled())
+	{
+		readSessionFrame();
+		return;
+	}
+
+	owned_message msg(handle(), pData, nLength);
+	m_incomMsgBuff.consume(pEnd ? nLength + 1 : nLength);
+	queueMessage(std::move(msg));
+
+	readData();
+}
+
+void CConnection::queueMessage(owned_message&& msg)
+{
+	msg.type = msg.empty() ? 0 : uint8_t(msg.data()[0]);
+	msg.nTimestamp = coarse_clock::now();
+	if (m_pServer)
+		m_pServer->stampDeadline(msg);
+
+	if (!m_pServer || !m_pServer->dispatchDirect(msg))
+	{
+		if (m_pServer)
+			m_pServer->keyMessage(msg);
+
+		// Counted before it can be handled, and not at all if it only
+		// took the place of a queued one
+		m_nInbound.fetch_add(1, std::memory_order_acq_rel);
+		if (!m_qMessagesIn.push_back(std::move(msg)))
+			m_nInbound.fetch_sub(1, std::memory_order_acq_rel);
+	}
+}
+
+void CConnection::readFrame()
+{
+	// The streambuf only holds bytes here after an adopt
+	size_t nHave = m_incomMsgBuff.size();
+	asio::async_read(m_socket, m_incomMsgBuff, asio::transfer_exactly(nHave >= 2 ? 0 : 2 - nHave),
+		[this](std::error_code ec, std::size_t)
+		{
+			if (ec)
+			{
+				readFailed(ec);
+				return;
+			}
+
+			const uint8_t* pHeader = static_cast<const uint8_t*>(m_incomMsgBuff.data().data());
+			size_t nLength = size_t(pHeader[0]) | size_t(pHeader[1]) << 8;
+			m_incomMsgBuff.consume(2);
+			readFrameBody(nLength);
+		});
+}
+
+void CConnection::readFrameBody(size_t nLength)
+{
+	// Straight into the message, whatever is buffered first
+	char* pBody = m_msgIn.prepare(nLength);
+	size_t nBuffered = std::min(nLength, m_incomMsgBuff.size());
+	std::memcpy(pBody, m_incomMsgBuff.data().data(), nBuffered);
+	m_incomMsgBuff.consume(nBuffered);
+
+	// handOff() waits for the body, half a message cannot move
+	m_bReadingBody = true;
+	asio::async_read(m_socket, asio::buffer(pBody + nBuffered, nLength - nBuffered),
+		[this](std::error_code ec, std::size_t)
+		{
+			m_bReadingBody = false;
+			if (ec)
+			{
+				readFailed(ec);
+				return;
+			}
+
+			owned_message msg = std::move(m_msgIn);
+			msg.remote = handle();
+
+			if (msg.size() == session_frame::nSize && uint8_t(msg.data()[0]) == session_frame::nMarker
+				&& m_pServer && m_pServer->sessionsEnabled())
+				m_pServer->handleSessionFrame(handle(), session_frame::decode(msg.data()));
+			else
+				queueMessage(std::move(msg));
+
+			readData();
+		});
+}
+
+void CConnection::readFailed(std::error_code ec)
+{
+	if (m_bHandingOff && ec == asio::error::operation_aborted)
+	{
+		// Cancelled by handOff(), nothing was lost
+		readData();
+	}
+	else
+	{
+		// Reading form the client went wrong, most likely a disconnect
+		// has occurred. Close the socket and let the system tidy it up later.
+		std::cout << "[ Read Header Fail.\n";
+		disconnect();
+	}
+}
+
+void CConnection::readSessionFrame()
+{
+	size_t nHave = std::min(m_incomMsgBuff.size(), session_frame::nSize);
+	std::memcpy(m_aSessionFrame, m_incomMsgBuff.data().data(), nHave);
+	m_incomMsgBuff.consume(nHave);
+
+	asio::async_read(m_socket, asio::buffer(m_aSessionFrame + nHave, session_frame::nSize - nHave),
+		[this](std::error_code ec, std::size_t)
+		{
+			if (ec)
+			{
+				// Also when cancelled by handOff(), half a frame cannot move
+				disconnect();
+				return;
+			}
+
+			if (m_pServer)
+				m_pServer->handleSessionFrame(handle(), session_frame::decode(m_aSessionFrame));
+			readData();
+		});
+}
+
+bool CConnection::nextOut(owned_message& msg)
+{
+	// Session frames and replays go first, they are not recorded again
+	if (!m_qControl.empty())
+	{
+		msg = std::move(m_qControl.front());
+		m_qControl.pop_front();
+		return true;
+	}
+
+	// Most urgent lane first. Lower lanes only get the socket between
+	// frames, so an urgent message waits for one frame at most. Messages
+	// that went stale while queued are dropped on the way
+	uint64_t nNow = coarse_clock::now();
+	if (!m_qMessagesOut.pop(msg, nNow))
+		return false;
+
+	// Encoded against what this client has, so only now that it is sure
+	// to be written. Before the session records it, a replay has to send
+	// exactly these bytes again
+	if (msg.type == vehicle_frame::nMarker)
+		m_encoderVehicles.encode(msg, nNow, getCapabilities() & capabilities::nDeltaEncoding);
+
+	// Kept by the session until the client acknowledges it
+	uint64_t nSession = getSession();
+	if (nSession != 0 && m_pServer)
+		m_pServer->recordSent(nSession, msg);
+	return true;
+}
+
+void CConnection::writeData()
+{
+	// The messages being written are moved out of the queues first, the
+	// ring storage may move its elements while the write is in flight.
+	// Clients that can take it get a whole batch in one write
+	uint32_t nCapabilities = getCapabilities();
+	size_t nMax = (nCapabilities & capabilities::nBatching) ? nMaxBatch : 1;
+
+	m_vecOut.clear();
+	owned_message msg;
+	while (m_vecOut.size() < nMax && nextOut(msg))
+	{
+		if ((nCapabilities & capabilities::nBinaryFraming) && msg.size() > UINT16_MAX)
+		{
+			std::cout << "[" << id << "] Message too long for binary framing, dropped\n";
+			continue;
+		}
+		m_vecOut.push_back(std::move(msg));
+	}
+
+	if (m_vecOut.empty())
+	{
+		m_bWriting = false;
+
+		// Payloads were allocated by the senders' threads, hand
+		// the freed blocks back to them while we are idle
+		CSlabAllocator::flush();
+
+		if (m_bHandingOff)
+			finishHandOff();
+		return;
+	}
+	m_bWriting = true;
+
+	// Buffers only once the vector is complete, it may have moved
+	m_vecBuffers.clear();
+	for (size_t i = 0; i < m_vecOut.size(); i++)
+	{
+		const owned_message& out = m_vecOut[i];
+
+		// The hello reply tells the client about the framing, it has none
+		if ((nCapabilities & capabilities::nBinaryFraming) && !out.bUnframed)
+		{
+			m_aLengths[i][0] = uint8_t(out.size());
+			m_aLengths[i][1] = uint8_t(out.size() >> 8);
+			m_vecBuffers.push_back(asio::buffer(m_aLengths[i]));
+		}
+		m_vecBuffers.push_back(asio::buffer(out.data(), out.size()));
+	}
+
+	asio::async_write(m_socket, m_vecBuffers,
+		[this](std::error_code ec, std::size_t length)
+		{
+			if (!ec)
+			{
+				// Sending was successful, so we are done with the messages.
+				// Issue the task to send the next ones, if there are any
+				writeData();
+			}
+			else
+			{
+				// Sending failed, see WriteHeader() equivalent for description :P
+				std::cout << "[" << id << "] Write Body Fail.\n";
+				m_bWriting = false;
+				disconnect();
+			}
+		});
+}
+
+void CConnection::send(const std::string& msg, message_priority priority, uint64_t nKey)
+{
+	// Built on the caller's thread, so the payload comes from its slab cache
+	owned_message out(handle(), msg.data(), msg.size());
+	out.priority = priority;
+	out.key = nKey;
+	out.nTimestamp = coarse_clock::now();
+
+	send(std::move(out));
+}
+
+void CConnection::send(owned_message&& out)
+{
+	connection_handle client = handle();
+	out.remote = client;
+	if (out.nTimestamp == 0)
+		out.nTimestamp = coarse_clock::now();
+
+	// The connection may have gone back to the pool, and even be serving
+	// someone else, by the time this runs. Only the asio thread can tell,
+	// the generation is checked there again
+	asio::post(m_asioContext, [this, client, out = std::move(out)]() mutable
+		{
+			if (handle() == client)
+				queueOut(std::move(out));
+		});
+}
+
+void CConnection::queueOut(owned_message&& out)
+{
+	out.remote = handle();
+
+	// If a write is in flight the message simply joins the queue and
+	// will be picked up when the current one completes. Otherwise
+	// start the process of writing the message at the front of the queue.
+	bool bWritingMessage = m_bWriting;
+	if (!conflates())
+		out.key = 0;
+	if (!m_qMessagesOut.push(std::move(out)))
+		return;		// lane over quota, counted in its stats
+	if (!bWritingMessage)
+	{
+		writeData();
+	}
+}
+
+size_t CConnection::readData()
+{
+	size_t res = 0;
+
+	if (!m_socket.is_open())
+	{
+		std::cout << "[CONNECTION] Cannot read data, socket is closet(((" << std::endl;
+		return res;
+	}
+
+	// Stop here, the connection is moving to another process
+	if (m_bHandingOff)
+	{
+		m_bReadParked = true;
+		finishHandOff();
+		return res;
+	}
+
+	// Every message costs a token. Out of tokens means we simply do not
+	// read for a while, nothing already sent by the client is lost
+	uint64_t nNow = coarse_clock::now();
+	if (!m_bucket.take(nNow))
+	{
+		// No token can show up before the coarse clock ticks again, an
+		// earlier wake-up would only find the bucket empty and sleep again
+		uint64_t nWait = std::max(m_bucket.wait(nNow), coarse_clock::resolution());
+		m_nThrottleCount.store(m_nThrottleCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+		m_timerThrottle.expires_after(std::chrono::nanoseconds(nWait));
+		m_timerThrottle.async_wait([this, client = handle(), nNow](std::error_code ec)
+			{
+				// Cancelled by disconnect(), the connection is going away.
+				// Cancelled by handOff(), readData() parks the connection
+				if (handle() != client || (ec && !m_bHandingOff))
+					return;
+
+				uint64_t nWaited = coarse_clock::now() - nNow;
+				m_nThrottledNs.store(m_nThrottledNs.load(std::memory_order_relaxed) + nWaited, std::memory_order_relaxed);
+				readData();
+			});
+		return res;
+	}
+
+	if (getCapabilities() & capabilities::nBinaryFraming)
+	{
+		readFrame();
 		return res;
 	}
 
@@ -228,9 +1681,6 @@ size_t CConnection::readData()
 				if (length > 0)
 				{
 					//std::cout << "Data for client has been read succesfully! " << length << std::endl;
-					std::istream s(&this->m_incomMsgBuff);
-					s >> std::noskipws;
-					std::getline(s, m_msgTemporaryIn);
 					addToIncomingMessageQueue();
 				}
 				else
@@ -241,10 +1691,7 @@ size_t CConnection::readData()
 			}
 			else
 			{
-				// Reading form the client went wrong, most likely a disconnect
-				// has occurred. Close the socket and let the system tidy it up later.
-				std::cout << "[ Read Header Fail.\n";
-				m_socket.close();
+				readFailed(ec);
 			}
 		});
 
@@ -1,31 +1,81 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <condition_variable>
 #include <deque>
 #include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <vector>
 
 #define ASIO_STANDALONE
 #include <asio.hpp>
 #include <asio/ts/buffer.hpp>
 #include <asio/ts/internet.hpp>
 
+#include "codel.h"
+#include "connection_handle.h"
+#include "connection_pool.h"
+#include "epoch.h"
+#include "fair_queue.h"
+#include "handshake.h"
+#include "hot_restart.h"
+#include "message.h"
+#include "outbound_queue.h"
+#include "protocol.h"
+#include "ring_buffer.h"
+#include "session_store.h"
+#include "state_store.h"
+#include "thread_affinity.h"
+#include "token_bucket.h"
+#include "vehicle_codec.h"
+#include "topic_index.h"
+#include "worker_pool.h"
+
 // "Encrypt" data
 
 
 class CConnection;
 class CServer;
 
-struct owned_message
+// Kind of client on the other end, decides its share of the incoming queue
+enum class client_class : uint8_t
 {
-	std::shared_ptr<CConnection> remote = nullptr;
-	std::string msg;
+	unclassified,
+	rider,
+	bus,
+	dispatch,
+	count
+};
 
-	// Again, a friendly string maker
-	friend std::ostream& operator<<(std::ostream& os, const owned_message& msg)
-	{
-		os << msg.msg;
-		return os;
-	}
+// Where OnMessage runs for a message type
+enum class dispatch_mode : uint8_t
+{
+	// Pushed to the incoming queue and handled by update() or the workers
+	queued,
+	// Handled right away on the asio thread that read it. Saves the queue
+	// round trip and the wake-up, but blocks reading from every client
+	// while it runs, so only for cheap non-blocking handlers
+	direct
+};
+
+// Outcome of one fan-out, handed to CServer::OnFanoutComplete. Times are
+// steady_clock nanoseconds
+struct fanout_report
+{
+	// Topic for publish(), whatever the caller passed for fanOut()
+	uint64_t nTag = 0;
+
+	size_t nRecipients = 0;
+	// Recipients still connected when their turn came
+	size_t nDelivered = 0;
+
+	uint64_t nStarted = 0;
+	uint64_t nFinished = 0;
+
+	uint64_t nanos() const { return nFinished - nStarted; }
 };
 
 class scoped_lock
@@ -88,9 +138,14 @@ class tsqueue
 
 		// Adds an item to back of Queue
 		void push_back(const T& item)
+		{
+			push_back(T(item));
+		}
+
+		void push_back(T&& item)
 		{
 			scoped_lock lock(muxQueue);
-			deqQueue.emplace_back(std::move(item));
+			deqQueue.push_back(std::move(item));
 
 			std::unique_lock<std::mutex> ul(muxBlocking);
 			cvBlocking.notify_one();
@@ -100,7 +155,7 @@ class tsqueue
 		void push_front(const T& item)
 		{
 			scoped_lock lock(muxQueue);
-			deqQueue.emplace_front(std::move(item));
+			deqQueue.push_front(T(item));
 
 			std::unique_lock<std::mutex> ul(muxBlocking);
 			cvBlocking.notify_one();
@@ -120,6 +175,13 @@ class tsqueue
 			return deqQueue.size();
 		}
 
+		// Makes room for nCapacity items without further allocation
+		void reserve(size_t nCapacity)
+		{
+			scoped_lock lock(muxQueue);
+			deqQueue.reserve(nCapacity);
+		}
+
 		// Clears Queue
 		void clear()
 		{
@@ -138,110 +200,742 @@ class tsqueue
 
 		protected:
 			std::mutex muxQueue;
-			std::deque<T> deqQueue;
+			// Ring storage rather than std::deque, so steady traffic
+			// does not allocate and free a block every few items
+			ring_buffer<T> deqQueue;
 			std::condition_variable cvBlocking;
 			std::mutex muxBlocking;
 };
 
-class CConnection : public std::enable_shared_from_this<CConnection>
+class CConnection
 {
 	public:
-		CConnection(asio::io_context& asioContext, asio::ip::tcp::socket socket, tsqueue<owned_message>& qIn):
-			m_asioContext(asioContext), m_socket(std::move(socket)), m_qMessagesIn(qIn), m_incomMsgBuff(16)
-		{
-			m_nHandshakeOut = uint64_t(std::chrono::system_clock::now().time_since_epoch().count());
+		// Most messages one write takes with capabilities::nBatching
+		static constexpr size_t nMaxBatch = 16;
+
+		// Messages per outgoing lane warm() makes room for
+		static constexpr size_t nWarmMessages = 64;
 
-			// Pre-calculate the result for checking when the client responds
-			m_nHandshakeCheck = scramble(m_nHandshakeOut);
+		// Connections are created once by the server's pool, on the asio
+		// thread serving them, and then reused. The socket is attached
+		// later by reset()
+		CConnection(asio::io_context& asioContext, CFairQueue& qIn):
+			m_asioContext(asioContext), m_socket(asioContext), m_qMessagesIn(qIn), m_incomMsgBuff(16), m_timerThrottle(asioContext)
+		{
 		}
 
-		void send(const std::string& msg);
+		// Any thread. The message is for the client being served right now:
+		// if the connection is released, or serving someone else, by the
+		// time the asio thread gets to it, it is dropped.
+		// A non-zero key lets the message replace an unsent one with the same key
+		void send(const std::string& msg, message_priority priority = message_priority::normal, uint64_t nKey = 0);
+
+		// Send a prepared message, keeping its priority, key and deadline
+		void send(owned_message&& msg);
+
+		// Same as send() for callers already on the asio thread, the message
+		// goes straight into the lanes without a post
+		void queueOut(owned_message&& msg);
+
+		// Start serving a client that has passed the handshake
 		void connectToClient(CServer *server, uint32_t id);
 
+		// Prepare a pooled connection for a freshly accepted socket. Buffers
+		// keep whatever capacity they have grown to
+		void reset(asio::ip::tcp::socket socket);
+
+		// Pre-fault the read buffer at its full size, and size and touch the
+		// outgoing lanes, their key indexes and the write batch for
+		// nWarmMessages. Run on the asio thread, so the pages land on its
+		// NUMA node
+		void warm();
+
+		// Context of the asio thread serving this connection, everything
+		// marked "asio thread only" has to run there
+		asio::io_context& context() { return m_asioContext; };
+
 		bool isConnected() { return m_socket.is_open();};
+		bool isValidated() { return m_bValidHandshake; };
 		uint32_t getID() {return id;};
+		void setID(uint32_t uid) { id = uid; };
+
+		// Protocol version and capabilities agreed on in the handshake.
+		// Set on the asio thread before the connection starts reading
+		void setCapabilities(uint8_t nVersion, uint32_t nCapabilities);
+		uint8_t getVersion() { return m_nVersion; };
+		uint32_t getCapabilities() { return m_nCapabilities.load(std::memory_order_relaxed); };
+
+		// Token of the resumable session the client is on, 0 for none
+		uint64_t getSession() { return m_nSession.load(std::memory_order_relaxed); };
+		void setSession(uint64_t nToken) { m_nSession.store(nToken, std::memory_order_relaxed); };
+
+		// Asio thread only. Session frames and replayed messages, written
+		// ahead of the lanes and never recorded in the session again
+		void sendControl(owned_message&& msg);
+
+		// Asio thread only. Takes the next message still waiting in the
+		// lanes, used to move them into the session when the client leaves
+		bool popUnsent(owned_message& msg) { return m_qMessagesOut.pop(msg, coarse_clock::now()); };
+
+		// Hot restart, asio thread only. handOff() parks the read loop at the
+		// next message boundary; once every message already read has been
+		// handled and the writer is idle too, the server is asked to pass
+		// the socket on. Refused while a write is in flight
+		bool handOff();
+		bool isHandingOff() { return m_bHandingOff; };
+
+		// Try to complete a handoff that was waiting for messages of this
+		// client to be handled, called again by the server until it is done
+		void finishHandOff();
+
+		// Messages read from the client that are queued or being handled.
+		// inboundDone() is called by the server once OnMessage has returned
+		// for one, or it was dropped unhandled
+		uint32_t inbound() { return m_nInbound.load(std::memory_order_acquire); };
+		void inboundDone() { m_nInbound.fetch_sub(1, std::memory_order_acq_rel); };
+
+		// Describe the connection in rec and give up the socket without
+		// closing it. Returns the descriptor, -1 on failure
+		int detach(handoff_record& rec);
+
+		// Continue a connection handed over by the previous process: no
+		// handshake, reading resumes with the bytes it had already read
+		void adopt(CServer* server, const handoff_record& rec);
+
+		// Close from the server's side
+		void close() { disconnect(); };
+
+		client_class getClass() { return m_class; };
+		void setClass(client_class cls) { m_class = cls; };
+
+		// Messages per second this client may send, with bursts up to fBurst.
+		// Applied on the asio thread, 0 lifts the limit
+		void setRateLimit(double fRate, double fBurst);
+
+		// Total time reads were held back by the rate limit
+		uint64_t getThrottledNanos() { return m_nThrottledNs.load(std::memory_order_relaxed); };
+		uint64_t getThrottleCount() { return m_nThrottleCount.load(std::memory_order_relaxed); };
+
+		// Byte limit of one outgoing lane, set by the server on accept
+		void setLaneQuota(message_priority priority, size_t nBytes) { m_qMessagesOut.setQuota(priority, nBytes); };
+		const lane_stats& getLaneStats(message_priority priority) { return m_qMessagesOut.stats(priority); };
+
+		size_t getSlot() { return m_nSlot; };
+		void setSlot(size_t nSlot) { m_nSlot = nSlot; };
+
+		// Odd while the connection is handed out, even while it sits in
+		// the pool. Every acquire and release moves it on by one
+		uint32_t getGeneration() { return m_nGeneration.load(std::memory_order_acquire); };
+		void activate() { m_nGeneration.fetch_add(1, std::memory_order_release); };
+		void deactivate() { m_nGeneration.fetch_add(1, std::memory_order_release); };
+
+		connection_handle handle() { return { uint32_t(m_nSlot), getGeneration() }; };
 	protected:
-		void writeValidation();
-		void readValidation(CServer *server);
+		// Close the socket and hand the connection back to the server
+		void disconnect();
 
 		size_t readData();
 		void addToIncomingMessageQueue();
 
+		// Length prefixed messages, capabilities::nBinaryFraming
+		void readFrame();
+		void readFrameBody(size_t nLength);
+
+		// Stamp a message read from the client and pass it on
+		void queueMessage(owned_message&& msg);
+
+		// A read failed or was cancelled
+		void readFailed(std::error_code ec);
+
+		// Rest of a session frame whose marker byte has been read
+		void readSessionFrame();
+
 		void writeData();
 
-		uint64_t scramble(uint64_t nInput)
-		{
-			uint64_t out = nInput ^ 0xDEADBEEFC0DECAFE;
-			out = (out & 0xF0F0F0F0F0F0F0) >> 4 | (out & 0x0F0F0F0F0F0F0F) << 4;
-			return out ^ 0xC0DEFACE12345678;
-		}
+		// Next message to write, false if there is none
+		bool nextOut(owned_message& msg);
+
+		// Version 0 clients always conflate
+		bool conflates() { return m_nVersion == 0 || (getCapabilities() & capabilities::nConflation); };
 
 		asio::ip::tcp::socket m_socket;
 
 		// This context is shared with the whole asio instance
 		asio::io_context& m_asioContext;
 
-		tsqueue<owned_message>& m_qMessagesIn;
-		tsqueue<std::string> m_qMessagesOut;
+		CFairQueue& m_qMessagesIn;
+		// Only touched on the asio thread
+		COutboundQueue m_qMessagesOut;
 
-		asio::streambuf m_incomMsgBuff;
-		std::string m_msgTemporaryIn;
+		// Messages currently handed to async_write with their length
+		// prefixes, only touched on the asio thread
+		std::vector<owned_message> m_vecOut;
+		std::vector<asio::const_buffer> m_vecBuffers;
+		std::array<std::array<uint8_t, 2>, nMaxBatch> m_aLengths;
+		bool m_bWriting = false;
+
+		// Binary framed message being read
+		owned_message m_msgIn;
+		bool m_bReadingBody = false;
+
+		uint8_t m_nVersion = 0;
+		std::atomic<uint32_t> m_nCapabilities{0};
+
+		// Last vehicle states written, see vehicle_frame. Asio thread only
+		CVehicleEncoder m_encoderVehicles;
+
+		// See sendControl(), only touched on the asio thread
+		ring_buffer<owned_message> m_qControl;
+		char m_aSessionFrame[session_frame::nSize];
+		std::atomic<uint64_t> m_nSession{0};
 
-		uint64_t m_nHandshakeOut = 0;
-		uint64_t m_nHandshakeIn = 0;
-		uint64_t m_nHandshakeCheck = 0;
+		asio::streambuf m_incomMsgBuff;
 
+		// A client over its rate is not dropped, its next read is just
+		// postponed until the bucket has a token again. TCP flow control
+		// then slows the sender down
+		CTokenBucket m_bucket;
+		asio::steady_timer m_timerThrottle;
+		std::atomic<uint64_t> m_nThrottledNs{0};
+		std::atomic<uint64_t> m_nThrottleCount{0};
 
 		bool m_bValidHandshake = false;
-		bool m_bConnectionEstablished = false;
+
+		bool m_bHandingOff = false;
+		bool m_bReadParked = false;
+		// Replies to the last handled messages have had their turn
+		bool m_bRepliesFlushed = false;
+
+		std::atomic<uint32_t> m_nInbound{0};
 
 		uint32_t id = 0;
+
+		client_class m_class = client_class::unclassified;
+
+		// Position inside the server's connection pool
+		size_t m_nSlot = 0;
+		std::atomic<uint32_t> m_nGeneration{0};
+
+		CServer* m_pServer = nullptr;
 };
 
 class CServer
 {
 	public:
-		CServer(uint32_t port): m_asioAcceptor(m_asioContext, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port))
+		// Recipients one asio thread queues a fan-out message to before it
+		// lets other handlers run
+		static constexpr size_t nFanoutChunk = 512;
+
+		// nMaxConnections connection objects are allocated by start(), each
+		// on the asio thread that will serve it and after that thread has
+		// been placed, so with a NUMA node set for the asio threads the
+		// connections and their buffers are local to it. Clients beyond
+		// that are refused at accept time.
+		//
+		// With nIoThreads above one the pool is split into that many shards,
+		// slot i served by asio thread i % nIoThreads. Accepting and the
+		// handshake stay on the first thread, a validated client then moves
+		// to its shard for good. Reads, writes and direct dispatch run on
+		// all of them in parallel, so OnMessageKey and directly dispatched
+		// OnMessage have to be thread safe. Sessions and hot restart keep
+		// their state on a single thread and cannot be combined with it
+		CServer(uint32_t port, size_t nMaxConnections = 1024, size_t nIoThreads = 1):
+			m_qMessagesIn(nMaxConnections),
+			m_vecIoShards(makeShards(nIoThreads)), m_vecFanoutShards(ioThreads()),
+			m_poolConnections(nMaxConnections,
+				[this](size_t nSlot) { return std::make_unique<CConnection>(shardContext(nSlot), m_qMessagesIn); }),
+			m_handshakes(m_asioContext, nMaxConnections,
+				[this](asio::ip::tcp::socket socket, const hello_frame& hello) { acceptValidated(std::move(socket), hello); }),
+			m_topics(nMaxConnections), m_stateTopics(nMaxConnections),
+			m_asioAcceptor(m_asioContext), m_descSuccessors(m_asioContext), m_descPredecessor(m_asioContext),
+			m_timerDrain(m_asioContext), m_nPort(port)
 		{
 		}
 
+		virtual ~CServer();
+
+		// Binds the port, or inherits the listening socket when taking over
+		// from a previous process
 		bool start();
 		void update();
 
-		void messageClient(std::shared_ptr<CConnection> client, const std::string& msg);
+		// Stops the asio thread, connections are left as they are
+		void stop();
+
+		// Zero downtime upgrades. The server listens on the unix socket
+		// strPath for a newer process. When one connects it gets the
+		// listening socket right away, then the socket and read state of
+		// every validated client as soon as that client is between
+		// messages, and this process retires. Clients still here after
+		// drain are closed. A server started with a path an older process
+		// listens on takes over from it instead of binding the port.
+		// Clients keep their subscriptions and state joins, sessions do
+		// not carry over and cannot be combined with this. Must be called
+		// before start()
+		void setHotRestart(const std::string& strPath, bool bHandOffConnections = true,
+			std::chrono::nanoseconds drain = std::chrono::seconds(5))
+		{
+			m_strHotRestartPath = strPath;
+			m_bHandOffConnections = bHandOffConnections;
+			m_nDrainTimeout = coarse_clock::toNanos(drain);
+		}
+
+		// Capabilities granted to clients that ask for them, see protocol.h.
+		// Defaults to everything the server supports
+		void setCapabilities(uint32_t nOffered) { m_nOfferedCapabilities = nOffered; }
+
+		// Let clients open sessions they can resume from another connection,
+		// see session_frame. Up to nMaxUnacked messages written to a client
+		// are kept until it acknowledges them, a session whose client has
+		// been gone for ttl is dropped. Must be called before start()
+		void setSessionResumption(bool bEnable, size_t nMaxUnacked = 256,
+			std::chrono::nanoseconds ttl = std::chrono::seconds(60))
+		{
+			m_bSessions = bEnable;
+			m_sessions.configure(nMaxUnacked, coarse_clock::toNanos(ttl));
+		}
+
+		bool sessionsEnabled() { return m_bSessions; }
+
+		// Everything has been handed to the successor. update() returns
+		// from then on and the application should call stop() and exit
+		bool retired() { return m_bRetired.load(std::memory_order_acquire); }
+
+		// Hand OnMessage to nWorkers threads instead of running it on the
+		// thread calling update(). Messages from one client are still handled
+		// in order, messages from different clients run in parallel, so
+		// OnMessage has to be thread safe. Must be called before start()
+		void setWorkerThreads(size_t nWorkers) { m_nWorkerThreads = nWorkers; }
+
+		// Choose between the queued and the direct path, for every message
+		// type or for one. Messages of types on different paths are not
+		// ordered relative to each other. Direct messages run OnMessage on
+		// the asio thread, at the same time as queued ones run it on the
+		// thread calling update() or on the workers, so OnMessage has to be
+		// thread safe as soon as any type is direct. Must be called before
+		// start()
+		void setDispatchMode(dispatch_mode mode) { m_aDispatchModes.fill(mode); }
+		void setDispatchMode(uint8_t nType, dispatch_mode mode) { m_aDispatchModes[nType] = mode; }
+
+		// Conflate incoming messages of a type: OnMessageKey is asked for a
+		// key on the asio thread, and a message still queued with the same
+		// key from the same client is replaced by the newer one. Must be
+		// called before start()
+		void setConflation(uint8_t nType, bool bEnable) { m_aConflatedTypes[nType] = bEnable; }
+
+		// Incoming messages of a type older than ttl are dropped instead of
+		// being handled, 0 to keep them forever. Must be called before start()
+		void setMessageTtl(uint8_t nType, std::chrono::nanoseconds ttl) { m_aTypeTtls[nType] = coarse_clock::toNanos(ttl); }
+
+		// Watch the time messages spend in the incoming queue. Once it has
+		// stayed above target for a whole interval the server is overloaded:
+		// messages of sheddable types are dropped before OnMessage and new
+		// connections are refused, until a message gets through in under
+		// target again. Sojourn times come from coarse_clock, keep target
+		// well above its few milliseconds of resolution
+		void setLoadShedding(bool bEnable, std::chrono::nanoseconds target = std::chrono::milliseconds(10),
+			std::chrono::nanoseconds interval = std::chrono::milliseconds(100))
+		{
+			m_bLoadShedding = bEnable;
+			m_codelIn.configure(coarse_clock::toNanos(target), coarse_clock::toNanos(interval));
+		}
+
+		// Message types that may be dropped under overload, e.g. position
+		// pings that will be superseded shortly anyway
+		void setSheddable(uint8_t nType, bool bSheddable) { m_aSheddableTypes[nType] = bSheddable; }
+
+		// Spin on poll() in the asio thread instead of blocking in epoll,
+		// optionally pinned to nCpu. Burns that core for wake-ups in the
+		// microsecond range; backs off to yielding and then to short
+		// blocking waits when there is nothing to do. Also turns on low
+		// latency socket options. Must be called before start()
+		void setBusyPoll(bool bEnable, int nCpu = -1)
+		{
+			m_bBusyPoll = bEnable;
+			if (nCpu >= 0)
+				placement(thread_role::io).vecCpus = { nCpu };
+			if (bEnable)
+				m_bLowLatencySockets = true;
+		}
+
+		// Clients that have not answered the handshake after timeout are
+		// dropped
+		void setHandshakeTimeout(std::chrono::nanoseconds timeout) { m_handshakes.setTimeout(coarse_clock::toNanos(timeout)); }
+
+		// Handshakes answered wrongly or not in time
+		uint64_t failedHandshakes() { return m_handshakes.failed(); }
+
+		// TCP_NODELAY and TCP_QUICKACK on every accepted socket
+		void setLowLatencySockets(bool bEnable) { m_bLowLatencySockets = bEnable; }
+
+		// Most bytes a client may have waiting in one outgoing lane, 0 for
+		// no limit. Applies to connections accepted afterwards
+		void setLaneQuota(message_priority priority, size_t nBytes) { m_aLaneQuotas[size_t(priority)] = nBytes; }
+
+		// CPUs and NUMA node for the server's threads. The asio and worker
+		// threads apply it themselves in start(), workers are spread one per
+		// CPU of the list. Must be called before start()
+		void setThreadPlacement(thread_role role, cpu_placement place) { placement(role) = std::move(place); }
+
+		// For threads the server does not own: the one calling update() and
+		// background writers. Call from the thread itself
+		bool placeCurrentThread(thread_role role) { return CThreadAffinity::apply(placement(role)); }
+
+		// Steer the interrupts of a NIC's queues to the asio thread's CPUs,
+		// so packets are handled where they are read. Needs root, returns
+		// how many IRQs were moved
+		size_t alignIrqs(const std::string& strInterface);
+
+		// Messages with the same non-zero key conflate while waiting in the
+		// client's outgoing lane, only the latest one is sent
+		void messageClient(connection_handle client, const std::string& msg, message_priority priority = message_priority::normal, uint64_t nKey = 0);
+
+		// Same with a message built by the caller, e.g. one given a deadline
+		// through owned_message::setTtl that is dropped if still unsent then
+		void messageClient(connection_handle client, owned_message&& msg);
+
+		// Publish/subscribe. Clients subscribe to topics (see topic_id()),
+		// usually from OnMessage when they say what they want to follow,
+		// and a published message goes to every current subscriber. Any
+		// thread. Subscriptions belong to the connection: they end when it
+		// closes, and a resumed client has to subscribe again. An adopted
+		// one keeps them, see handoff_record
+		bool subscribe(connection_handle client, uint64_t nTopic);
+		bool unsubscribe(connection_handle client, uint64_t nTopic);
+		size_t subscriberCount(uint64_t nTopic) { return m_topics.subscribers(nTopic); }
+
+		// Goes out through fanOut(), tagged with the topic. A non-zero key
+		// conflates in each subscriber's lane like with messageClient()
+		void publish(uint64_t nTopic, owned_message&& msg);
+		void publish(uint64_t nTopic, const std::string& msg, message_priority priority = message_priority::normal, uint64_t nKey = 0);
+
+		// Send one message to a list of clients. The list is split by the
+		// asio thread serving each client and every thread queues its part
+		// in parallel, in chunks of nFanoutChunk so its other clients are
+		// still served in between. Payloads too big to sit inline are
+		// shared by all copies. OnFanoutComplete reports when the last
+		// copy has been queued. Any thread
+		void fanOut(const std::vector<connection_handle>& vecRecipients, owned_message&& msg, uint64_t nTag = 0);
+
+		// Keyed state per topic, e.g. bus positions per route, kept by the
+		// server so a client can join late: joinState() subscribes it and
+		// queues the current snapshot, and every setState() or eraseState()
+		// from then on reaches it as a numbered delta (see state_frame),
+		// without a gap or a duplicate. Snapshots are serialised once per
+		// version and shared by everyone joining at that version. Only
+		// clients with binary framing can join. setState() refuses values
+		// over state_frame::nMaxValue, which would not fit a frame.
+		//
+		// State topics are a namespace of their own: joining is not
+		// subscribing, and a subscribe() to the same id gets none of the
+		// state frames. Joining again while joined starts over from a new
+		// snapshot, deltas still on their way from before may then arrive
+		// on either side of it, see state_frame. Any thread
+		bool setState(uint64_t nTopic, uint64_t nKey, const std::string& value);
+		void eraseState(uint64_t nTopic, uint64_t nKey);
+		bool joinState(connection_handle client, uint64_t nTopic);
+		uint64_t stateVersion(uint64_t nTopic);
+		uint64_t snapshotsBuilt();
+
+		// Copies queued by fanOut() and publish()
+		uint64_t publishedDeliveries() { return m_nPublished.load(std::memory_order_relaxed); }
+
+		size_t ioThreads() { return m_vecIoShards.size() + 1; }
+
+		// Message a session rather than a connection. While its client is
+		// away the message is kept and replayed when it resumes
+		void messageSession(uint64_t nToken, owned_message&& msg);
+
+		// Incoming messages dropped by update() because they had expired
+		uint64_t expiredIncoming() { return m_nExpiredIn.load(std::memory_order_relaxed); }
+
+		// Load shedding counters: messages shed, connections refused while
+		// overloaded and the number of overload episodes
+		uint64_t shedIncoming() { return m_nShedIn.load(std::memory_order_relaxed); }
+		uint64_t refusedOverloaded() { return m_nRefusedOverloaded.load(std::memory_order_relaxed); }
+		uint64_t overloadEpisodes() { return m_codelIn.episodes(); }
+		bool isOverloaded() { return m_bLoadShedding && m_codelIn.overloaded(); }
+
+		// Tell the server what kind of client this is once it has identified
+		// itself. Its messages are then drained with the weight of its class
+		void setClientClass(connection_handle client, client_class cls);
+
+		// Share of the incoming queue clients of a class get relative to the
+		// others, in units of CFairQueue::nBaseQuantum bytes per round
+		void setClassWeight(client_class cls, uint32_t nWeight) { m_aClassWeights[size_t(cls)] = nWeight; }
+
+		// Per connection read rate limit for a class, in messages per second
+		// with bursts of up to fBurst. 0 for no limit, which is the default.
+		// The burst is at least what arrives in one coarse_clock tick at
+		// fRate, see CTokenBucket
+		void setClassRateLimit(client_class cls, double fRate, double fBurst)
+		{
+			m_aClassRates[size_t(cls)] = { fRate, fBurst };
+		}
+
+		// Connection behind a handle, nullptr once the client is gone. Safe to
+		// use inside the callbacks below, other threads must hold an
+		// epoch_guard for as long as they use the pointer
+		CConnection* getConnection(connection_handle client);
 	protected:
-		virtual bool OnClientConnect(std::shared_ptr<CConnection> client)
+		virtual bool OnClientConnect(connection_handle client)
 		{
 			return false;
 		}
 
-		// Called when a client appears to have disconnected
-		virtual void OnClientDisconnect(std::shared_ptr<CConnection> client)
+		// Called when a client appears to have disconnected, the handle
+		// still resolves for the duration of the call. Runs on the asio
+		// thread serving the client, so at the same time as OnMessage on
+		// update() or the workers, and with several asio threads at the
+		// same time as other disconnects: whatever it shares with them
+		// needs its own locking
+		virtual void OnClientDisconnect(connection_handle client)
+		{
+		}
+
+		// Called on the asio thread for a client taken over from the previous
+		// process, in place of the connect and validation calls. Its
+		// subscriptions and state joins are restored right after
+		virtual void OnClientAdopted(connection_handle client)
+		{
+		}
+
+		// Called on the asio thread when a client resumed its session on a new
+		// connection. It has taken over the client id of the session, and
+		// missed messages are being replayed to it
+		virtual void OnClientResumed(connection_handle client, uint64_t nToken)
+		{
+		}
+
+		// Called on an asio thread once every copy of a fan-out has been
+		// queued, or on the caller's thread if there was nobody to send to
+		virtual void OnFanoutComplete(const fanout_report& report)
 		{
 		}
 
 		// Called when a message arrives
-		virtual void OnMessage(std::shared_ptr<CConnection> client, std::string& msg)
+		virtual void OnMessage(connection_handle client, owned_message& msg)
+		{
+		}
+
+		// Called on the asio thread for messages of conflated types, returns
+		// the key (e.g. vehicle id) or 0 to queue the message normally
+		virtual uint64_t OnMessageKey(connection_handle client, const owned_message& msg)
 		{
+			return 0;
 		}
 	public:
-		virtual void OnClientValidated(std::shared_ptr<CConnection> client)
+		virtual void OnClientValidated(connection_handle client)
 		{
 		}
+
+		// Called on the asio thread once a connection has closed its socket
+		void releaseConnection(connection_handle client);
+
+		// Called on the asio thread when a connection is ready to move to
+		// the successor: reading has stopped, nothing it read is still
+		// waiting for OnMessage and everything queued for it is written
+		void transferConnection(connection_handle client);
+
+		// Called on the asio thread for every session frame a client sends
+		void handleSessionFrame(connection_handle client, const session_frame& frame);
+
+		// Called on the asio thread for every message written to a client
+		// on a session
+		void recordSent(uint64_t nToken, const owned_message& msg);
+
+		// Called on the asio thread for every message read. Runs OnMessage
+		// straight away and returns true if the type is dispatched directly
+		bool dispatchDirect(owned_message& msg);
+
+		// Called on the asio thread when a message is read
+		void stampDeadline(owned_message& msg)
+		{
+			if (m_aTypeTtls[msg.type] != 0)
+				msg.nDeadline = msg.nTimestamp + m_aTypeTtls[msg.type];
+		}
+
+		// Called on the asio thread before a message is queued
+		void keyMessage(owned_message& msg)
+		{
+			if (m_aConflatedTypes[msg.type])
+				msg.key = OnMessageKey(msg.remote, msg);
+		}
 	private:
 		void listen_connections();
 		bool isConnected();
-		tsqueue<owned_message> m_qMessagesIn;
 
-		// Container of active validated connections
-		std::deque<std::shared_ptr<CConnection>> m_deqConnections;
+		void openAcceptor();
+
+		// A queued message of client has been handled or dropped
+		void inboundDone(connection_handle client);
+
+		// Called by m_handshakes once a client has answered correctly
+		void acceptValidated(asio::ip::tcp::socket socket, const hello_frame& hello);
+
+		// Class dependent settings of a freshly acquired connection
+		void setupConnection(CConnection* conn, client_class cls);
+
+		// Hot restart, successor side. takeOver() runs in start(), the rest
+		// on the asio thread
+		bool takeOver();
+		void receiveHandoff();
+		void adoptConnection(const handoff_record& rec, int nFd);
+		void adoptTopics(const handoff_record& rec);
+
+		// Hot restart, retiring side
+		void listenForSuccessor();
+		void acceptSuccessor();
+		void handOff(int nSuccessor);
+		void handOverTopics(handoff_record::kind nKind, uint32_t nId, const std::vector<uint64_t>& vecTopics);
+		void drainHandoff();
+		void retire();
+
+		// Contexts of the asio threads after the first one
+		static std::vector<std::unique_ptr<asio::io_context>> makeShards(size_t nIoThreads);
+		asio::io_context& shardContext(size_t nSlot)
+		{
+			size_t nShard = nSlot % ioThreads();
+			return nShard == 0 ? m_asioContext : *m_vecIoShards[nShard - 1];
+		}
+
+		// Body of an asio thread
+		void runShard(asio::io_context& context, size_t nShard);
+
+		// Same in busy poll mode
+		void pollContext(asio::io_context& context);
+
+		// A fan-out in flight, shared by the asio threads working on it
+		struct fanout_job
+		{
+			owned_message msg;
+			// Recipients by asio thread
+			std::vector<std::vector<connection_handle>> vecPartitions;
+			std::atomic<size_t> nPending{0};
+			std::atomic<size_t> nDelivered{0};
+			fanout_report report;
+		};
+
+		// Fan-outs waiting on one asio thread, only touched by that thread.
+		// They are worked through strictly in order, so a big one split
+		// into chunks is never overtaken by the next message of its topic
+		struct fanout_shard
+		{
+			ring_buffer<std::shared_ptr<fanout_job>> qJobs;
+			size_t nOffset = 0;
+			bool bScheduled = false;
+		};
+
+		// publish() to the subscribers of a topic in one of the indexes
+		void publishTo(const CTopicIndex& index, uint64_t nTopic, owned_message&& msg);
+
+		// Split by shard already, starts the asio threads on it
+		void startFanout(std::shared_ptr<fanout_job> job);
+
+		// Queue one chunk of the oldest fan-out of a shard
+		void runFanout(size_t nShard);
+		// One sub-queue per pool slot, drained fairly by update()
+		CFairQueue m_qMessagesIn;
+		std::array<uint32_t, size_t(client_class::count)> m_aClassWeights = { 1, 1, 1, 1 };
+
+		struct rate_limit
+		{
+			double fRate = 0.0;
+			double fBurst = 1.0;
+		};
+		std::array<rate_limit, size_t(client_class::count)> m_aClassRates = {};
 
 		// Order of declaration is important - it is also the order of initialisation
 		asio::io_context m_asioContext;
 		std::thread m_threadContext;
 
+		// One context and thread per further asio thread
+		std::vector<std::unique_ptr<asio::io_context>> m_vecIoShards;
+		std::vector<std::thread> m_vecShardThreads;
+		std::vector<fanout_shard> m_vecFanoutShards;
+
+		// Preallocated connections, needs the context and the incoming queue
+		CConnectionPool m_poolConnections;
+
+		// Asio threads that have created their share of the pool
+		std::mutex m_mxShardsReady;
+		std::condition_variable m_cvShardsReady;
+		size_t m_nShardsReady = 0;
+
+		// Accepted clients waiting to answer the handshake, up to one per
+		// pooled connection
+		CHandshakeStage m_handshakes;
+
+		// Subscribers of every topic, indexed by pool slot
+		CTopicIndex m_topics;
+
+		// Clients that joined state, kept apart from m_topics so publish()
+		// subscribers never get state frames and the other way round
+		CTopicIndex m_stateTopics;
+		std::atomic<uint64_t> m_nPublished{0};
+
+		// Held across a change and its publish, and across a join, so a
+		// joining client gets each change either in its snapshot or as a
+		// delta queued after it
+		std::mutex m_mxState;
+		CStateStore m_state;
+
+		// Only created by start() when worker threads were requested
+		size_t m_nWorkerThreads = 0;
+		std::unique_ptr<CWorkerPool> m_poolWorkers;
+
+		// Indexed by owned_message::type
+		std::array<dispatch_mode, 256> m_aDispatchModes = {};
+		std::array<bool, 256> m_aConflatedTypes = {};
+
+		// Nanoseconds, 0 for no expiry
+		std::array<uint64_t, 256> m_aTypeTtls = {};
+		std::atomic<uint64_t> m_nExpiredIn{0};
+
+		bool m_bLoadShedding = false;
+		CCoDel m_codelIn{ 10000000, 100000000 };
+		std::array<bool, 256> m_aSheddableTypes = {};
+		std::atomic<uint64_t> m_nShedIn{0};
+		std::atomic<uint64_t> m_nRefusedOverloaded{0};
+
+		// Compression has no codec, it is never granted
+		uint32_t m_nOfferedCapabilities = capabilities::nBinaryFraming | capabilities::nBatching
+			| capabilities::nConflation | capabilities::nResumption | capabilities::nDeltaEncoding;
+
+		// Resumable sessions, only touched on the asio thread
+		bool m_bSessions = false;
+		CSessionStore m_sessions;
+
+		// Bind the session to the connection and tell the client
+		void resumeSession(CConnection* conn, session& s, uint64_t nSeq);
+
+		bool m_bBusyPoll = false;
+		bool m_bLowLatencySockets = false;
+
+		std::array<size_t, COutboundQueue::nLanes> m_aLaneQuotas = {};
+
+		cpu_placement& placement(thread_role role) { return m_aPlacements[size_t(role)]; }
+		std::array<cpu_placement, 4> m_aPlacements;
+
 		// These things need an asio context
 		asio::ip::tcp::acceptor m_asioAcceptor;
 
+		// Unix socket a successor connects to, and the one we take our
+		// predecessor's clients from
+		asio::posix::stream_descriptor m_descSuccessors;
+		asio::posix::stream_descriptor m_descPredecessor;
+		asio::steady_timer m_timerDrain;
+
+		uint32_t m_nPort;
 		uint32_t nClientID = 100;
+
+		std::string m_strHotRestartPath;
+		bool m_bHandOffConnections = true;
+		uint64_t m_nDrainTimeout = 0;
+		uint64_t m_nDrainDeadline = 0;
+		int m_nSuccessor = -1;
+		// Adopted last, the topics that follow are its
+		connection_handle m_lastAdopted;
+		uint32_t m_nLastAdoptedId = 0;
+		std::atomic<bool> m_bRetired{false};
 };
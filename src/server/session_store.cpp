@@ -0,0 +1,166 @@
+#include "session_store.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+namespace
+{
+	// Fills the buffer from getrandom(), or /dev/urandom on kernels that
+	// lack it. Both are the kernel's CSPRNG, no userspace generator that
+	// could be predicted from the tokens it has handed out
+	bool secureRandom(void* pData, size_t nSize)
+	{
+		char* p = static_cast<char*>(pData);
+		size_t nDone = 0;
+		while (nDone < nSize)
+		{
+			ssize_t n = getrandom(p + nDone, nSize - nDone, 0);
+			if (n > 0)
+				nDone += size_t(n);
+			else if (n < 0 && errno == ENOSYS)
+				break;
+			else if (n < 0 && errno != EINTR)
+				return false;
+		}
+		if (nDone == nSize)
+			return true;
+
+		int nFd = ::open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+		if (nFd < 0)
+			return false;
+
+		while (nDone < nSize)
+		{
+			ssize_t n = ::read(nFd, p + nDone, nSize - nDone);
+			if (n > 0)
+				nDone += size_t(n);
+			else if (n == 0 || errno != EINTR)
+				break;
+		}
+		::close(nFd);
+		return nDone == nSize;
+	}
+
+	void putU64(char* p, uint64_t nValue)
+	{
+		for (size_t i = 0; i < 8; i++)
+			p[i] = char(nValue >> (8 * i));
+	}
+
+	uint64_t getU64(const char* p)
+	{
+		uint64_t nValue = 0;
+		for (size_t i = 0; i < 8; i++)
+			nValue |= uint64_t(uint8_t(p[i])) << (8 * i);
+		return nValue;
+	}
+}
+
+owned_message session_frame::encode() const
+{
+	char aData[nSize];
+	aData[0] = char(nMarker);
+	aData[1] = char(nOp);
+	putU64(aData + 2, nToken);
+	putU64(aData + 10, nSeq);
+
+	owned_message msg(connection_handle(), aData, nSize);
+	msg.type = nMarker;
+	msg.priority = message_priority::urgent;
+	return msg;
+}
+
+session_frame session_frame::decode(const char* pData)
+{
+	session_frame frame;
+	frame.nOp = uint8_t(pData[1]);
+	frame.nToken = getU64(pData + 2);
+	frame.nSeq = getU64(pData + 10);
+	return frame;
+}
+
+void CSessionStore::configure(size_t nMaxUnacked, uint64_t nTtl)
+{
+	m_nMaxUnacked = nMaxUnacked;
+	m_nTtl = nTtl;
+}
+
+session* CSessionStore::open(uint32_t nClientId, connection_handle conn)
+{
+	// 0 means "no session" everywhere
+	uint64_t nToken;
+	do
+	{
+		if (!secureRandom(&nToken, sizeof(nToken)))
+			return nullptr;
+	} while (nToken == 0 || m_mapSessions.count(nToken));
+
+	session& s = m_mapSessions[nToken];
+	s.nToken = nToken;
+	s.nClientId = nClientId;
+	s.bound = conn;
+	return &s;
+}
+
+session* CSessionStore::find(uint64_t nToken)
+{
+	auto it = m_mapSessions.find(nToken);
+	return it != m_mapSessions.end() ? &it->second : nullptr;
+}
+
+void CSessionStore::erase(uint64_t nToken)
+{
+	m_mapSessions.erase(nToken);
+}
+
+void CSessionStore::record(session& s, const owned_message& msg)
+{
+	// Full, the oldest unacknowledged message can no longer be replayed
+	if (s.qUnacked.size() >= m_nMaxUnacked)
+	{
+		if (s.qUnacked.empty())
+		{
+			s.nFirstSeq = ++s.nNextSeq;
+			return;
+		}
+		s.qUnacked.pop_front();
+		s.nFirstSeq++;
+	}
+
+	s.qUnacked.push_back(owned_message(msg));
+	s.nNextSeq++;
+}
+
+void CSessionStore::ack(session& s, uint64_t nSeq)
+{
+	if (nSeq > s.nNextSeq)
+		nSeq = s.nNextSeq;
+
+	while (s.nFirstSeq < nSeq && !s.qUnacked.empty())
+	{
+		s.qUnacked.pop_front();
+		s.nFirstSeq++;
+	}
+	if (s.nFirstSeq < nSeq)
+		s.nFirstSeq = nSeq;
+}
+
+void CSessionStore::detach(session& s, uint64_t nNow)
+{
+	s.bound = connection_handle();
+	s.nDetachedAt = nNow;
+}
+
+void CSessionStore::expire(uint64_t nNow)
+{
+	for (auto it = m_mapSessions.begin(); it != m_mapSessions.end();)
+	{
+		const session& s = it->second;
+		if (!s.bound.valid() && nNow - s.nDetachedAt > m_nTtl)
+			it = m_mapSessions.erase(it);
+		else
+			++it;
+	}
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+
+#include "connection_handle.h"
+#include "message.h"
+#include "ring_buffer.h"
+
+// Session control frames, both directions. Fixed size and binary so they
+// bypass the newline framing: the marker byte, an op, then the token and a
+// sequence number, little endian. Plain text clients never send the marker
+// and never get a frame, sessions are strictly opt-in.
+//
+//  client -> server  'N' open a session
+//                    'A' nSeq messages of the session have been received
+//                    'R' resume nToken, nSeq messages had been received
+//  server -> client  'S' session nToken opened
+//                    'R' resumed, replay follows starting at message nSeq
+//                    'X' cannot replay, start over with session nToken whose
+//                        next message is nSeq
+//
+// Messages of a session are numbered in the order they are written to the
+// socket, control frames are not counted.
+struct session_frame
+{
+	static constexpr uint8_t nMarker = 0x01;
+	static constexpr size_t nSize = 18;
+
+	uint8_t nOp = 0;
+	uint64_t nToken = 0;
+	uint64_t nSeq = 0;
+
+	owned_message encode() const;
+	static session_frame decode(const char* pData);
+};
+
+// A client that may come back on another connection. Holds copies of the
+// messages written to it that it has not acknowledged yet, so a reconnect
+// only costs the replay of what it missed.
+struct session
+{
+	uint64_t nToken = 0;
+	uint32_t nClientId = 0;
+
+	// Connection currently serving it, invalid while the client is away
+	connection_handle bound;
+	uint64_t nDetachedAt = 0;
+
+	// Number of the next message, and of the oldest one still kept
+	uint64_t nNextSeq = 0;
+	uint64_t nFirstSeq = 0;
+	ring_buffer<owned_message> qUnacked;
+};
+
+// Every session of the server. Only used from the asio thread, there is no
+// locking.
+class CSessionStore
+{
+	public:
+		// nMaxUnacked messages are kept per session, older ones are given up
+		// and the client then has to start over. Detached sessions are
+		// forgotten after nTtl nanoseconds
+		void configure(size_t nMaxUnacked, uint64_t nTtl);
+
+		// The token is all a client needs to take the session over, so it
+		// is 64 bits straight from the kernel's CSPRNG, never derived from
+		// earlier ones. nullptr if the kernel has none to give
+		session* open(uint32_t nClientId, connection_handle conn);
+		session* find(uint64_t nToken);
+		void erase(uint64_t nToken);
+
+		// Keep a copy of a message written to the session's client
+		void record(session& s, const owned_message& msg);
+
+		// The client has seen everything before nSeq
+		void ack(session& s, uint64_t nSeq);
+
+		// Every message from nSeq on is still kept
+		bool canReplay(const session& s, uint64_t nSeq) const
+		{
+			return nSeq >= s.nFirstSeq && nSeq <= s.nNextSeq;
+		}
+
+		void detach(session& s, uint64_t nNow);
+
+		// Drop sessions detached for longer than the ttl
+		void expire(uint64_t nNow);
+
+		size_t size() const { return m_mapSessions.size(); }
+
+	private:
+		// Node based, sessions do not move when the table grows
+		std::unordered_map<uint64_t, session> m_mapSessions;
+
+		size_t m_nMaxUnacked = 256;
+		uint64_t m_nTtl = 60000000000ull;
+};
@@ -0,0 +1,345 @@
+#include "slab_allocator.h"
+
+#include <atomic>
+#include <mutex>
+#include <new>
+
+#include <sys/mman.h>
+
+namespace
+{
+	struct free_block
+	{
+		free_block* pNext;
+	};
+
+	struct slab_cache;
+
+	// Lives in the first block of every slab, so a pointer can find its
+	// owner by rounding down to the slab boundary
+	struct slab_header
+	{
+		slab_cache* pOwner;
+		uint32_t nClass;
+	};
+
+	// Frees of another thread's blocks waiting to be sent home
+	struct remote_batch
+	{
+		slab_cache* pOwner = nullptr;
+		uint32_t nClass = 0;
+		uint32_t nCount = 0;
+		free_block* pHead = nullptr;
+		free_block* pTail = nullptr;
+	};
+
+	constexpr size_t nBatchSize = 32;
+	constexpr size_t nPendingBatches = 4;
+
+	struct slab_cache
+	{
+		free_block* aFree[CSlabAllocator::nClasses] = {};
+		char* aBump[CSlabAllocator::nClasses] = {};
+		char* aBumpEnd[CSlabAllocator::nClasses] = {};
+
+		// Blocks given back by other threads, drained when the local list
+		// runs dry
+		std::atomic<free_block*> aInbox[CSlabAllocator::nClasses] = {};
+
+		remote_batch aPending[nPendingBatches];
+
+		// Written only by the thread owning the cache, summed by stats()
+		std::atomic<uint64_t> aAllocated[CSlabAllocator::nClasses] = {};
+		std::atomic<uint64_t> aFreed[CSlabAllocator::nClasses] = {};
+		std::atomic<uint64_t> aSlabs[CSlabAllocator::nClasses] = {};
+	};
+
+	std::mutex g_mxRegistry;
+	std::vector<slab_cache*> g_vecCaches;
+	std::vector<slab_cache*> g_vecOrphans;
+
+	std::atomic<bool> g_bHugePages{false};
+	std::atomic<uint64_t> g_nLargeBlocks{0};
+	std::atomic<uint64_t> g_nLargeBytes{0};
+
+	void bump(std::atomic<uint64_t>& counter, uint64_t n = 1)
+	{
+		// Single writer, no need for a locked add
+		counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	size_t classIndex(size_t nSize)
+	{
+		size_t nClass = 0;
+		while ((size_t(1) << (CSlabAllocator::nMinBlockShift + nClass)) < nSize)
+			nClass++;
+		return nClass;
+	}
+
+	size_t classSize(size_t nClass)
+	{
+		return size_t(1) << (CSlabAllocator::nMinBlockShift + nClass);
+	}
+
+	slab_header* headerOf(void* p)
+	{
+		return reinterpret_cast<slab_header*>(reinterpret_cast<uintptr_t>(p) & ~(uintptr_t(CSlabAllocator::nSlabSize) - 1));
+	}
+
+	// Map one slab aligned to its own size
+	char* mapSlab()
+	{
+		const size_t nSize = CSlabAllocator::nSlabSize;
+
+		if (g_bHugePages.load(std::memory_order_relaxed))
+		{
+#ifdef MAP_HUGETLB
+			void* p = mmap(nullptr, nSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (p != MAP_FAILED)
+				return static_cast<char*>(p);
+#endif
+		}
+
+		// Over-map and trim so the slab starts on a slab boundary
+		void* p = mmap(nullptr, nSize * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			throw std::bad_alloc();
+
+		uintptr_t nStart = reinterpret_cast<uintptr_t>(p);
+		uintptr_t nAligned = (nStart + nSize - 1) & ~(uintptr_t(nSize) - 1);
+		if (nAligned > nStart)
+			munmap(p, nAligned - nStart);
+		uintptr_t nTail = nStart + nSize * 2 - (nAligned + nSize);
+		if (nTail > 0)
+			munmap(reinterpret_cast<void*>(nAligned + nSize), nTail);
+
+#ifdef MADV_HUGEPAGE
+		if (g_bHugePages.load(std::memory_order_relaxed))
+			madvise(reinterpret_cast<void*>(nAligned), nSize, MADV_HUGEPAGE);
+#endif
+		return reinterpret_cast<char*>(nAligned);
+	}
+
+	void pushRemote(remote_batch& batch)
+	{
+		if (batch.nCount == 0)
+			return;
+
+		std::atomic<free_block*>& inbox = batch.pOwner->aInbox[batch.nClass];
+		free_block* pOld = inbox.load(std::memory_order_relaxed);
+		do
+		{
+			batch.pTail->pNext = pOld;
+		} while (!inbox.compare_exchange_weak(pOld, batch.pHead, std::memory_order_release, std::memory_order_relaxed));
+
+		batch = remote_batch();
+	}
+
+	void flushCache(slab_cache* cache)
+	{
+		for (auto& batch : cache->aPending)
+			pushRemote(batch);
+	}
+
+	// Ties a cache to the lifetime of the thread using it. On thread exit
+	// the cache is parked for the next thread, its slabs are never unmapped
+	struct cache_holder
+	{
+		slab_cache* pCache = nullptr;
+
+		slab_cache* get()
+		{
+			if (!pCache)
+			{
+				std::lock_guard<std::mutex> lock(g_mxRegistry);
+				if (!g_vecOrphans.empty())
+				{
+					pCache = g_vecOrphans.back();
+					g_vecOrphans.pop_back();
+				}
+				else
+				{
+					pCache = new slab_cache();
+					g_vecCaches.push_back(pCache);
+				}
+			}
+			return pCache;
+		}
+
+		~cache_holder()
+		{
+			if (pCache)
+			{
+				flushCache(pCache);
+
+				std::lock_guard<std::mutex> lock(g_mxRegistry);
+				g_vecOrphans.push_back(pCache);
+				pCache = nullptr;
+			}
+		}
+	};
+
+	thread_local cache_holder t_cache;
+}
+
+void* CSlabAllocator::allocate(size_t nSize)
+{
+	if (nSize > nMaxBlockSize)
+	{
+		g_nLargeBlocks.fetch_add(1, std::memory_order_relaxed);
+		g_nLargeBytes.fetch_add(nSize, std::memory_order_relaxed);
+		return ::operator new(nSize);
+	}
+
+	slab_cache* cache = t_cache.get();
+	size_t nClass = classIndex(nSize);
+	size_t nBlock = classSize(nClass);
+
+	free_block* p = cache->aFree[nClass];
+	if (!p)
+	{
+		// Take back everything other threads have returned so far
+		p = cache->aInbox[nClass].exchange(nullptr, std::memory_order_acquire);
+	}
+
+	if (p)
+	{
+		cache->aFree[nClass] = p->pNext;
+	}
+	else
+	{
+		if (cache->aBump[nClass] == cache->aBumpEnd[nClass])
+		{
+			char* pSlab = mapSlab();
+			auto* header = reinterpret_cast<slab_header*>(pSlab);
+			header->pOwner = cache;
+			header->nClass = uint32_t(nClass);
+
+			// The first block is given up to the header, which also keeps
+			// every block aligned to its own size
+			cache->aBump[nClass] = pSlab + nBlock;
+			cache->aBumpEnd[nClass] = pSlab + nSlabSize;
+			bump(cache->aSlabs[nClass]);
+		}
+
+		p = reinterpret_cast<free_block*>(cache->aBump[nClass]);
+		cache->aBump[nClass] += nBlock;
+	}
+
+	bump(cache->aAllocated[nClass]);
+	return p;
+}
+
+void CSlabAllocator::deallocate(void* p, size_t nSize)
+{
+	if (!p)
+		return;
+
+	if (nSize > nMaxBlockSize)
+	{
+		g_nLargeBlocks.fetch_sub(1, std::memory_order_relaxed);
+		g_nLargeBytes.fetch_sub(nSize, std::memory_order_relaxed);
+		::operator delete(p);
+		return;
+	}
+
+	slab_cache* cache = t_cache.get();
+	slab_header* header = headerOf(p);
+	uint32_t nClass = header->nClass;
+	auto* block = static_cast<free_block*>(p);
+
+	bump(cache->aFreed[nClass]);
+
+	if (header->pOwner == cache)
+	{
+		block->pNext = cache->aFree[nClass];
+		cache->aFree[nClass] = block;
+		return;
+	}
+
+	// Someone else's block, add it to the batch going back to its owner
+	remote_batch* target = nullptr;
+	for (auto& batch : cache->aPending)
+	{
+		if (batch.nCount > 0 && batch.pOwner == header->pOwner && batch.nClass == nClass)
+		{
+			target = &batch;
+			break;
+		}
+		if (!target && batch.nCount == 0)
+			target = &batch;
+	}
+
+	if (!target)
+	{
+		// All batch slots are taken by other owners, make room
+		target = &cache->aPending[0];
+		pushRemote(*target);
+	}
+
+	if (target->nCount == 0)
+	{
+		target->pOwner = header->pOwner;
+		target->nClass = nClass;
+		target->pTail = block;
+		block->pNext = nullptr;
+	}
+	else
+	{
+		block->pNext = target->pHead;
+	}
+	target->pHead = block;
+
+	if (++target->nCount >= nBatchSize)
+		pushRemote(*target);
+}
+
+size_t CSlabAllocator::blockSize(size_t nSize)
+{
+	if (nSize > nMaxBlockSize)
+		return nSize;
+	return classSize(classIndex(nSize));
+}
+
+void CSlabAllocator::flush()
+{
+	flushCache(t_cache.get());
+}
+
+void CSlabAllocator::setHugePages(bool bEnable)
+{
+	g_bHugePages.store(bEnable, std::memory_order_relaxed);
+}
+
+std::vector<CSlabAllocator::size_class_stats> CSlabAllocator::stats()
+{
+	std::vector<size_class_stats> vecStats(nClasses + 1);
+
+	{
+		std::lock_guard<std::mutex> lock(g_mxRegistry);
+		for (size_t c = 0; c < nClasses; c++)
+		{
+			uint64_t nAllocated = 0, nFreed = 0, nSlabs = 0;
+			for (slab_cache* cache : g_vecCaches)
+			{
+				nAllocated += cache->aAllocated[c].load(std::memory_order_relaxed);
+				nFreed += cache->aFreed[c].load(std::memory_order_relaxed);
+				nSlabs += cache->aSlabs[c].load(std::memory_order_relaxed);
+			}
+
+			auto& entry = vecStats[c];
+			entry.nBlockSize = classSize(c);
+			// Counters are read one after the other, never report a
+			// transient negative
+			entry.nBlocksInFlight = nAllocated > nFreed ? nAllocated - nFreed : 0;
+			entry.nBytesInFlight = entry.nBlocksInFlight * entry.nBlockSize;
+			entry.nSlabs = nSlabs;
+		}
+	}
+
+	auto& large = vecStats[nClasses];
+	large.nBlocksInFlight = g_nLargeBlocks.load(std::memory_order_relaxed);
+	large.nBytesInFlight = g_nLargeBytes.load(std::memory_order_relaxed);
+
+	return vecStats;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Size-class allocator for message payloads.
+//
+// Memory is carved out of 2 MiB slabs, each slab belongs to one thread and
+// one size class (128 bytes up to 64 KiB, powers of two). Every thread has
+// its own cache, so allocation and freeing on the owning thread take no
+// locks. A block freed by another thread (payload read on the asio thread,
+// released on the CServer::update thread) is collected in a small batch and
+// returned to its owner with a single atomic push once the batch is full or
+// flush() is called. Requests above the largest class go to operator new.
+class CSlabAllocator
+{
+	public:
+		static constexpr size_t nSlabSize = size_t(2) << 20;
+		static constexpr size_t nMinBlockShift = 7;
+		static constexpr size_t nClasses = 10;
+		static constexpr size_t nMaxBlockSize = size_t(1) << (nMinBlockShift + nClasses - 1);
+
+		struct size_class_stats
+		{
+			// 0 for the bucket of requests too big for any class
+			size_t nBlockSize = 0;
+			uint64_t nBlocksInFlight = 0;
+			uint64_t nBytesInFlight = 0;
+			uint64_t nSlabs = 0;
+		};
+
+		static void* allocate(size_t nSize);
+		static void deallocate(void* p, size_t nSize);
+
+		// Real capacity of the block handed out for a request of nSize bytes
+		static size_t blockSize(size_t nSize);
+
+		// Send frees of blocks owned by other threads home now, instead of
+		// waiting for the batch to fill up
+		static void flush();
+
+		// Back new slabs with huge pages (MAP_HUGETLB if the system has them
+		// reserved, transparent huge pages otherwise). Affects slabs mapped
+		// after the call
+		static void setHugePages(bool bEnable);
+
+		// One entry per size class plus a final one for oversized requests
+		static std::vector<size_class_stats> stats();
+};
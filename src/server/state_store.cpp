@@ -0,0 +1,139 @@
+#include "state_store.h"
+
+namespace
+{
+	// Where a snapshot part keeps its part and entry counts
+	constexpr size_t nPartCountOffset = state_frame::nHeaderSize + 2;
+	constexpr size_t nEntryCountOffset = state_frame::nHeaderSize + 4;
+
+	void putU16(std::string& str, uint16_t nValue)
+	{
+		str.push_back(char(nValue));
+		str.push_back(char(nValue >> 8));
+	}
+
+	void putU64(std::string& str, uint64_t nValue)
+	{
+		for (size_t i = 0; i < 8; i++)
+			str.push_back(char(nValue >> (8 * i)));
+	}
+
+	void putHeader(std::string& str, uint8_t nOp, uint64_t nTopic, uint64_t nSeq)
+	{
+		str.push_back(char(state_frame::nMarker));
+		str.push_back(char(nOp));
+		putU64(str, nTopic);
+		putU64(str, nSeq);
+	}
+
+	owned_message toMessage(const std::string& str)
+	{
+		owned_message msg(connection_handle(), str.data(), str.size());
+		msg.type = state_frame::nMarker;
+		return msg;
+	}
+}
+
+bool CStateStore::set(uint64_t nTopic, uint64_t nKey, const char* pData, size_t nSize, owned_message& delta)
+{
+	// Cutting it short would hand every client a value nobody set
+	if (nSize > state_frame::nMaxValue)
+		return false;
+
+	topic_state& state = m_mapTopics[nTopic];
+	state.mapValues[nKey].assign(pData, nSize);
+	state.nSeq++;
+	state.bSnapshot = false;
+	state.vecSnapshot.clear();
+
+	std::string str;
+	str.reserve(state_frame::nHeaderSize + 10 + nSize);
+	putHeader(str, 'D', nTopic, state.nSeq);
+	putU64(str, nKey);
+	putU16(str, uint16_t(nSize));
+	str.append(pData, nSize);
+	delta = toMessage(str);
+	return true;
+}
+
+bool CStateStore::erase(uint64_t nTopic, uint64_t nKey, owned_message& delta)
+{
+	auto it = m_mapTopics.find(nTopic);
+	if (it == m_mapTopics.end() || it->second.mapValues.erase(nKey) == 0)
+		return false;
+
+	topic_state& state = it->second;
+	state.nSeq++;
+	state.bSnapshot = false;
+	state.vecSnapshot.clear();
+
+	std::string str;
+	putHeader(str, 'E', nTopic, state.nSeq);
+	putU64(str, nKey);
+	delta = toMessage(str);
+	return true;
+}
+
+const std::vector<owned_message>& CStateStore::snapshot(uint64_t nTopic)
+{
+	topic_state& state = m_mapTopics[nTopic];
+	if (!state.bSnapshot)
+		buildSnapshot(nTopic, state);
+	return state.vecSnapshot;
+}
+
+uint64_t CStateStore::version(uint64_t nTopic) const
+{
+	auto it = m_mapTopics.find(nTopic);
+	return it == m_mapTopics.end() ? 0 : it->second.nSeq;
+}
+
+void CStateStore::buildSnapshot(uint64_t nTopic, topic_state& state)
+{
+	// Entries are packed into parts first, the part count is only known
+	// at the end and patched into every header afterwards
+	std::vector<std::string> vecParts;
+	std::vector<uint16_t> vecEntries;
+
+	auto startPart = [&]()
+	{
+		vecParts.emplace_back();
+		vecParts.back().reserve(state_frame::nMaxPart);
+		putHeader(vecParts.back(), 'S', nTopic, state.nSeq);
+		putU16(vecParts.back(), uint16_t(vecParts.size() - 1));
+		putU16(vecParts.back(), 0);
+		putU16(vecParts.back(), 0);
+		vecEntries.push_back(0);
+	};
+
+	startPart();
+	for (const auto& entry : state.mapValues)
+	{
+		size_t nEntry = 10 + entry.second.size();
+		if ((vecParts.back().size() + nEntry > state_frame::nMaxPart && vecEntries.back() > 0) || vecEntries.back() == UINT16_MAX)
+			startPart();
+
+		putU64(vecParts.back(), entry.first);
+		putU16(vecParts.back(), uint16_t(entry.second.size()));
+		vecParts.back().append(entry.second);
+		vecEntries.back()++;
+	}
+
+	state.vecSnapshot.clear();
+	state.vecSnapshot.reserve(vecParts.size());
+	for (size_t i = 0; i < vecParts.size(); i++)
+	{
+		std::string& str = vecParts[i];
+		str[nPartCountOffset] = char(vecParts.size());
+		str[nPartCountOffset + 1] = char(vecParts.size() >> 8);
+		str[nEntryCountOffset] = char(vecEntries[i]);
+		str[nEntryCountOffset + 1] = char(vecEntries[i] >> 8);
+
+		// Shared, every client joining at this version gets a reference
+		state.vecSnapshot.push_back(toMessage(str));
+		state.vecSnapshot.back().share();
+	}
+
+	state.bSnapshot = true;
+	m_nSnapshotsBuilt++;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "message.h"
+
+// State frames, server -> client, only for clients with binary framing.
+// The marker byte, an op, the topic and a sequence number, little endian,
+// then the body:
+//
+//  'S' snapshot of the topic as of nSeq, possibly in several parts:
+//      part index and part count (2 bytes each), entry count (2 bytes),
+//      then per entry the key (8 bytes), value length (2 bytes), value
+//  'D' the value of a key changed: key, value length, value
+//  'E' a key went away: key
+//
+// Deltas of a topic are numbered one after the other. A client applies a
+// snapshot once it has every part and then the deltas numbered after it;
+// it never misses one. Deltas numbered at or below the snapshot's nSeq
+// have to be dropped: a client that joins again while still joined can
+// get deltas sent before its new snapshot, before or after that snapshot
+// arrives. If it does see a gap, e.g. because its outgoing lane hit its
+// quota, it joins again.
+struct state_frame
+{
+	static constexpr uint8_t nMarker = 0x03;
+	static constexpr size_t nHeaderSize = 18;
+
+	// Every frame has to fit the 64 KiB a binary framed message can carry.
+	// The largest one holding a single value is a snapshot part with just
+	// that entry: header, the part's three counts, key and length. Larger
+	// values are refused
+	static constexpr size_t nMaxValue = UINT16_MAX - nHeaderSize - 6 - 10;
+
+	// Parts are filled up to this, a part may only go beyond it with a
+	// single entry, which nMaxValue keeps within the frame limit
+	static constexpr size_t nMaxPart = 16384;
+};
+
+// Keyed state of every topic, e.g. the latest position of each bus on a
+// route, with a sequence number per topic that every change moves on.
+//
+// The snapshot of a topic is serialised once per version and kept until
+// the topic changes again, so any number of clients joining in between
+// share the same buffers. Not thread safe, CServer locks around it.
+class CStateStore
+{
+	public:
+		// Store a value and make the delta frame announcing it. Returns
+		// false, and changes nothing, if it is over nMaxValue
+		bool set(uint64_t nTopic, uint64_t nKey, const char* pData, size_t nSize, owned_message& delta);
+
+		// Remove a value. Returns false, and no delta, if it was not there
+		bool erase(uint64_t nTopic, uint64_t nKey, owned_message& delta);
+
+		// Frames of the current snapshot of a topic, payloads shared
+		const std::vector<owned_message>& snapshot(uint64_t nTopic);
+
+		// Sequence number of the latest change, 0 for a topic never set
+		uint64_t version(uint64_t nTopic) const;
+
+		// Snapshots serialised so far, for checking they are reused
+		uint64_t snapshotsBuilt() const { return m_nSnapshotsBuilt; }
+
+	private:
+		struct topic_state
+		{
+			uint64_t nSeq = 0;
+			std::unordered_map<uint64_t, std::string> mapValues;
+
+			// Valid while bSnapshot is set, dropped on the next change
+			std::vector<owned_message> vecSnapshot;
+			bool bSnapshot = false;
+		};
+
+		void buildSnapshot(uint64_t nTopic, topic_state& state);
+
+		std::unordered_map<uint64_t, topic_state> m_mapTopics;
+		uint64_t m_nSnapshotsBuilt = 0;
+};
@@ -0,0 +1,174 @@
+#include "thread_affinity.h"
+
+#include <fstream>
+#include <sstream>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+	// From <numaif.h>, spelled out so we do not depend on libnuma
+	constexpr int nMpolPreferred = 1;
+
+	std::string readFile(const std::string& strPath)
+	{
+		std::ifstream file(strPath);
+		std::stringstream ss;
+		ss << file.rdbuf();
+		return ss.str();
+	}
+
+	bool makeSet(const std::vector<int>& vecCpus, cpu_set_t& set)
+	{
+		CPU_ZERO(&set);
+		for (int nCpu : vecCpus)
+		{
+			if (nCpu < 0 || nCpu >= CPU_SETSIZE)
+				return false;
+			CPU_SET(nCpu, &set);
+		}
+		return !vecCpus.empty();
+	}
+}
+
+cpu_placement cpu_placement::cpus(std::vector<int> vecCpus)
+{
+	cpu_placement placement;
+	placement.vecCpus = std::move(vecCpus);
+	return placement;
+}
+
+cpu_placement cpu_placement::node(int nNode)
+{
+	cpu_placement placement;
+	placement.vecCpus = CThreadAffinity::cpusOfNode(nNode);
+	placement.nNumaNode = nNode;
+	return placement;
+}
+
+std::vector<int> CThreadAffinity::parseCpuList(const std::string& strList)
+{
+	std::vector<int> vecCpus;
+	std::stringstream ss(strList);
+	std::string strRange;
+
+	while (std::getline(ss, strRange, ','))
+	{
+		if (strRange.empty() || strRange == "\n")
+			continue;
+
+		try
+		{
+			size_t nDash = strRange.find('-');
+			int nFirst = std::stoi(strRange.substr(0, nDash));
+			int nLast = nDash == std::string::npos ? nFirst : std::stoi(strRange.substr(nDash + 1));
+			for (int nCpu = nFirst; nCpu <= nLast; nCpu++)
+				vecCpus.push_back(nCpu);
+		}
+		catch (std::exception&)
+		{
+			return {};
+		}
+	}
+
+	return vecCpus;
+}
+
+std::vector<int> CThreadAffinity::cpusOfNode(int nNode)
+{
+	return parseCpuList(readFile("/sys/devices/system/node/node" + std::to_string(nNode) + "/cpulist"));
+}
+
+int CThreadAffinity::nodeOfCpu(int nCpu)
+{
+	for (int nNode = 0; nNode < 64; nNode++)
+	{
+		std::vector<int> vecCpus = cpusOfNode(nNode);
+		for (int n : vecCpus)
+		{
+			if (n == nCpu)
+				return nNode;
+		}
+	}
+	return -1;
+}
+
+bool CThreadAffinity::pin(std::thread& thread, const std::vector<int>& vecCpus)
+{
+	cpu_set_t set;
+	if (!makeSet(vecCpus, set))
+		return false;
+	return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+}
+
+bool CThreadAffinity::pinCurrent(const std::vector<int>& vecCpus)
+{
+	cpu_set_t set;
+	if (!makeSet(vecCpus, set))
+		return false;
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+bool CThreadAffinity::setMemoryNode(int nNode)
+{
+	if (nNode < 0 || nNode >= 64)
+		return false;
+
+	unsigned long nMask = 1UL << nNode;
+	return syscall(SYS_set_mempolicy, nMpolPreferred, &nMask, sizeof(nMask) * 8) == 0;
+}
+
+bool CThreadAffinity::apply(const cpu_placement& placement)
+{
+	bool bOk = true;
+	if (!placement.vecCpus.empty())
+		bOk = pinCurrent(placement.vecCpus) && bOk;
+	if (placement.nNumaNode >= 0)
+		bOk = setMemoryNode(placement.nNumaNode) && bOk;
+	return bOk;
+}
+
+std::vector<int> CThreadAffinity::irqsOfInterface(const std::string& strInterface)
+{
+	std::vector<int> vecIrqs;
+	std::ifstream file("/proc/interrupts");
+	std::string strLine;
+
+	while (std::getline(file, strLine))
+	{
+		// "  45:  0  1234  IR-PCI-MSI 524289-edge  eth0-TxRx-0"
+		size_t nColon = strLine.find(':');
+		if (nColon == std::string::npos || strLine.find(strInterface, nColon) == std::string::npos)
+			continue;
+
+		try
+		{
+			vecIrqs.push_back(std::stoi(strLine.substr(0, nColon)));
+		}
+		catch (std::exception&)
+		{
+			// Named rows like NMI or LOC, not a real IRQ
+		}
+	}
+
+	return vecIrqs;
+}
+
+bool CThreadAffinity::setIrqAffinity(int nIrq, const std::vector<int>& vecCpus)
+{
+	if (vecCpus.empty())
+		return false;
+
+	std::ofstream file("/proc/irq/" + std::to_string(nIrq) + "/smp_affinity_list");
+	if (!file.is_open())
+		return false;
+
+	for (size_t i = 0; i < vecCpus.size(); i++)
+		file << (i ? "," : "") << vecCpus[i];
+	file.flush();
+
+	return bool(file);
+}
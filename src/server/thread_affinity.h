@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+#include <thread>
+#include <vector>
+
+// Which of the server's threads a placement applies to
+enum class thread_role
+{
+	// The asio thread reading and writing sockets
+	io,
+	// Whoever calls CServer::update()
+	consumer,
+	// CWorkerPool threads running OnMessage
+	worker,
+	// Application threads doing slow background work, e.g. journaling
+	writer
+};
+
+// Where a thread runs and where its memory comes from
+struct cpu_placement
+{
+	// CPUs the thread may run on, empty leaves scheduling to the kernel
+	std::vector<int> vecCpus;
+
+	// NUMA node new pages of the thread are taken from, -1 for the default
+	int nNumaNode = -1;
+
+	static cpu_placement cpus(std::vector<int> vecCpus);
+
+	// Every CPU of the node, memory from the node
+	static cpu_placement node(int nNode);
+
+	bool empty() const { return vecCpus.empty() && nNumaNode < 0; }
+};
+
+// Thin wrappers over the Linux affinity, memory policy and IRQ interfaces.
+// They report failure instead of throwing, placement is a tuning aid and
+// the server keeps running without it.
+class CThreadAffinity
+{
+	public:
+		// Parsed from /sys/devices/system/node/node<N>/cpulist
+		static std::vector<int> cpusOfNode(int nNode);
+		static int nodeOfCpu(int nCpu);
+
+		static bool pin(std::thread& thread, const std::vector<int>& vecCpus);
+		static bool pinCurrent(const std::vector<int>& vecCpus);
+
+		// Prefer nNode for every page the calling thread faults in from now
+		// on. Buffers a thread creates and touches first end up on its node
+		static bool setMemoryNode(int nNode);
+
+		// Pin and set the memory node of the calling thread
+		static bool apply(const cpu_placement& placement);
+
+		// IRQ numbers whose /proc/interrupts entry names the interface,
+		// one per RX/TX queue on multiqueue NICs
+		static std::vector<int> irqsOfInterface(const std::string& strInterface);
+
+		// Write /proc/irq/<N>/smp_affinity_list, needs root
+		static bool setIrqAffinity(int nIrq, const std::vector<int>& vecCpus);
+
+		// "0-3,8" -> {0, 1, 2, 3, 8}
+		static std::vector<int> parseCpuList(const std::string& strList);
+};
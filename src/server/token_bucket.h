@@ -0,0 +1,68 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+#include "clock.h"
+
+// Classic token bucket: fills at fRate tokens per second up to fBurst, and
+// every message takes one token. Times are coarse_clock nanoseconds. A rate
+// of 0 means unlimited.
+//
+// The clock only moves in ticks of a few milliseconds, so tokens arrive a
+// tick's worth at a time. A bucket smaller than that would throw most of
+// them away and cap the rate at fBurst per tick, so the burst is raised to
+// at least one tick's worth of tokens.
+class CTokenBucket
+{
+	public:
+		void configure(double fRate, double fBurst)
+		{
+			m_fRate = fRate;
+			m_fBurst = std::max({ fBurst, 1.0, fRate * double(coarse_clock::resolution()) / 1e9 });
+			m_fTokens = m_fBurst;
+			m_nLast = 0;
+		}
+
+		bool limited() const { return m_fRate > 0.0; }
+
+		// Takes a token if there is one
+		bool take(uint64_t nNow)
+		{
+			if (!limited())
+				return true;
+
+			refill(nNow);
+			if (m_fTokens < 1.0)
+				return false;
+
+			m_fTokens -= 1.0;
+			return true;
+		}
+
+		// Nanoseconds until the next token is available. The clock may not
+		// show it before its next tick
+		uint64_t wait(uint64_t nNow)
+		{
+			if (!limited())
+				return 0;
+
+			refill(nNow);
+			if (m_fTokens >= 1.0)
+				return 0;
+			return uint64_t((1.0 - m_fTokens) / m_fRate * 1e9) + 1;
+		}
+
+	private:
+		void refill(uint64_t nNow)
+		{
+			if (m_nLast != 0 && nNow > m_nLast)
+				m_fTokens = std::min(m_fBurst, m_fTokens + double(nNow - m_nLast) * m_fRate / 1e9);
+			m_nLast = nNow;
+		}
+
+		double m_fRate = 0.0;
+		double m_fBurst = 1.0;
+		double m_fTokens = 1.0;
+		uint64_t m_nLast = 0;
+};
@@ -0,0 +1,283 @@
+#include <algorithm>
+
+#include "topic_index.h"
+#include "server.h"
+
+namespace
+{
+	bool bySlot(const connection_handle& a, const connection_handle& b)
+	{
+		return a.nSlot < b.nSlot;
+	}
+
+	// Generations only move forward, compare them wrapping around
+	bool olderThan(uint32_t a, uint32_t b)
+	{
+		return int32_t(a - b) < 0;
+	}
+}
+
+CTopicIndex::CTopicIndex(size_t nMaxClients): m_pTable(new topic_table(16)), m_vecClients(nMaxClients)
+{
+}
+
+CTopicIndex::~CTopicIndex()
+{
+	topic_table* pTable = m_pTable.load(std::memory_order_relaxed);
+	for (topic_entry& e : pTable->vecEntries)
+		delete e.pList.load(std::memory_order_relaxed);
+	delete pTable;
+
+	for (retired& r : m_vecRetired)
+	{
+		delete r.pList;
+		delete r.pTable;
+	}
+}
+
+const CTopicIndex::subscriber_list* CTopicIndex::find(uint64_t nTopic) const
+{
+	const topic_table* pTable = m_pTable.load(std::memory_order_acquire);
+	size_t nMask = pTable->vecEntries.size() - 1;
+
+	for (size_t i = slot(nTopic, nMask); ; i = (i + 1) & nMask)
+	{
+		const topic_entry& e = pTable->vecEntries[i];
+		uint64_t nFound = e.nTopic.load(std::memory_order_acquire);
+		if (nFound == nTopic)
+			return e.pList.load(std::memory_order_acquire);
+		if (nFound == 0)
+			return nullptr;
+	}
+}
+
+size_t CTopicIndex::subscribers(uint64_t nTopic) const
+{
+	epoch_guard guard;
+
+	const subscriber_list* pList = find(nTopic);
+	return pList ? pList->size() : 0;
+}
+
+bool CTopicIndex::subscribe(uint64_t nTopic, connection_handle client)
+{
+	if (nTopic == 0 || client.nSlot >= m_vecClients.size())
+		return false;
+
+	scoped_lock lock(m_mxWriters);
+
+	client_topics& ct = m_vecClients[client.nSlot];
+	if (ct.nGeneration != client.nGeneration)
+	{
+		// A subscribe that lost a race against the connection closing
+		if (olderThan(client.nGeneration, ct.nGeneration))
+			return false;
+
+		// Whatever the slot's previous connection left behind
+		for (uint64_t nOld : ct.vecTopics)
+			remove(nOld, client.nSlot);
+		ct.vecTopics.clear();
+		ct.nGeneration = client.nGeneration;
+	}
+
+	topic_entry& e = entry(nTopic);
+	const subscriber_list* pOld = e.pList.load(std::memory_order_relaxed);
+
+	auto* pList = new subscriber_list();
+	pList->reserve((pOld ? pOld->size() : 0) + 1);
+	if (pOld)
+	{
+		auto it = std::lower_bound(pOld->begin(), pOld->end(), client, bySlot);
+		if (it != pOld->end() && *it == client)
+		{
+			delete pList;
+			return false;
+		}
+
+		// At most one handle per slot, a stale one is replaced
+		auto itNext = (it != pOld->end() && it->nSlot == client.nSlot) ? it + 1 : it;
+		pList->insert(pList->end(), pOld->begin(), it);
+		pList->push_back(client);
+		pList->insert(pList->end(), itNext, pOld->end());
+	}
+	else
+	{
+		pList->push_back(client);
+	}
+
+	replace(e, pList);
+	ct.vecTopics.push_back(nTopic);
+	return true;
+}
+
+bool CTopicIndex::unsubscribe(uint64_t nTopic, connection_handle client)
+{
+	if (nTopic == 0 || client.nSlot >= m_vecClients.size())
+		return false;
+
+	scoped_lock lock(m_mxWriters);
+
+	client_topics& ct = m_vecClients[client.nSlot];
+	if (ct.nGeneration != client.nGeneration)
+		return false;
+
+	auto it = std::find(ct.vecTopics.begin(), ct.vecTopics.end(), nTopic);
+	if (it == ct.vecTopics.end())
+		return false;
+
+	*it = ct.vecTopics.back();
+	ct.vecTopics.pop_back();
+	return remove(nTopic, client.nSlot);
+}
+
+void CTopicIndex::unsubscribeAll(connection_handle client)
+{
+	if (client.nSlot >= m_vecClients.size())
+		return;
+
+	scoped_lock lock(m_mxWriters);
+
+	client_topics& ct = m_vecClients[client.nSlot];
+	for (uint64_t nTopic : ct.vecTopics)
+		remove(nTopic, client.nSlot);
+	ct.vecTopics.clear();
+}
+
+std::vector<uint64_t> CTopicIndex::topicsOf(connection_handle client)
+{
+	if (client.nSlot >= m_vecClients.size())
+		return {};
+
+	scoped_lock lock(m_mxWriters);
+
+	const client_topics& ct = m_vecClients[client.nSlot];
+	if (ct.nGeneration != client.nGeneration)
+		return {};
+	return ct.vecTopics;
+}
+
+CTopicIndex::topic_entry& CTopicIndex::entry(uint64_t nTopic)
+{
+	topic_table* pTable = m_pTable.load(std::memory_order_relaxed);
+
+	// Keep the load under one half, probes stay short
+	if ((m_nUsed + 1) * 2 > pTable->vecEntries.size())
+	{
+		grow();
+		pTable = m_pTable.load(std::memory_order_relaxed);
+	}
+
+	size_t nMask = pTable->vecEntries.size() - 1;
+	size_t i = slot(nTopic, nMask);
+	while (true)
+	{
+		topic_entry& e = pTable->vecEntries[i];
+		uint64_t nFound = e.nTopic.load(std::memory_order_relaxed);
+		if (nFound == nTopic)
+			return e;
+
+		if (nFound == 0)
+		{
+			// Readers find the topic only once it is in place, and then
+			// see no list until the caller stores one
+			e.nTopic.store(nTopic, std::memory_order_release);
+			m_nUsed++;
+			return e;
+		}
+		i = (i + 1) & nMask;
+	}
+}
+
+void CTopicIndex::replace(topic_entry& e, subscriber_list* pList)
+{
+	if (pList && pList->empty())
+	{
+		delete pList;
+		pList = nullptr;
+	}
+
+	const subscriber_list* pOld = e.pList.exchange(pList, std::memory_order_acq_rel);
+	if (!pOld && pList)
+		m_nTopics.fetch_add(1, std::memory_order_relaxed);
+	else if (pOld && !pList)
+		m_nTopics.fetch_sub(1, std::memory_order_relaxed);
+
+	if (pOld)
+		m_vecRetired.push_back({ pOld, nullptr, CEpochManager::current() });
+	reclaim();
+}
+
+bool CTopicIndex::remove(uint64_t nTopic, uint32_t nSlot)
+{
+	const subscriber_list* pOld = find(nTopic);
+	if (!pOld)
+		return false;
+
+	connection_handle key;
+	key.nSlot = nSlot;
+	auto it = std::lower_bound(pOld->begin(), pOld->end(), key, bySlot);
+	if (it == pOld->end() || it->nSlot != nSlot)
+		return false;
+
+	auto* pList = new subscriber_list();
+	pList->reserve(pOld->size() - 1);
+	pList->insert(pList->end(), pOld->begin(), it);
+	pList->insert(pList->end(), it + 1, pOld->end());
+
+	replace(entry(nTopic), pList);
+	return true;
+}
+
+void CTopicIndex::grow()
+{
+	topic_table* pOld = m_pTable.load(std::memory_order_relaxed);
+
+	// Topics nobody listens to anymore are not carried over
+	size_t nLive = m_nTopics.load(std::memory_order_relaxed);
+	size_t nSize = 16;
+	while (nSize < (nLive + 1) * 4)
+		nSize *= 2;
+
+	auto* pTable = new topic_table(nSize);
+	size_t nMask = nSize - 1;
+	m_nUsed = 0;
+
+	for (topic_entry& e : pOld->vecEntries)
+	{
+		const subscriber_list* pList = e.pList.load(std::memory_order_relaxed);
+		if (!pList)
+			continue;
+
+		uint64_t nTopic = e.nTopic.load(std::memory_order_relaxed);
+		size_t i = slot(nTopic, nMask);
+		while (pTable->vecEntries[i].nTopic.load(std::memory_order_relaxed) != 0)
+			i = (i + 1) & nMask;
+
+		pTable->vecEntries[i].nTopic.store(nTopic, std::memory_order_relaxed);
+		pTable->vecEntries[i].pList.store(pList, std::memory_order_relaxed);
+		m_nUsed++;
+	}
+
+	// The lists now belong to the new table, only the old table retires
+	m_pTable.store(pTable, std::memory_order_release);
+	m_vecRetired.push_back({ nullptr, pOld, CEpochManager::current() });
+}
+
+void CTopicIndex::reclaim()
+{
+	if (m_vecRetired.empty())
+		return;
+
+	CEpochManager::tryAdvance();
+
+	// Retired in epoch order, so stop at the first one still in use
+	size_t nReclaimed = 0;
+	while (nReclaimed < m_vecRetired.size() && CEpochManager::isSafe(m_vecRetired[nReclaimed].nEpoch))
+	{
+		delete m_vecRetired[nReclaimed].pList;
+		delete m_vecRetired[nReclaimed].pTable;
+		nReclaimed++;
+	}
+
+	m_vecRetired.erase(m_vecRetired.begin(), m_vecRetired.begin() + nReclaimed);
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "connection_handle.h"
+#include "epoch.h"
+
+// What a topic is about. Ids of different kinds live in separate ranges of
+// the topic space, route 12 and stop 12 are different topics
+enum class topic_kind : uint8_t
+{
+	route = 1,
+	stop,
+	vehicle
+};
+
+inline uint64_t topic_id(topic_kind kind, uint64_t nId)
+{
+	return (uint64_t(kind) << 56) | (nId & 0x00FFFFFFFFFFFFFFull);
+}
+
+// Inverted index from a topic to the connections subscribed to it.
+//
+// Every topic has an immutable array of subscribers sorted by pool slot, at
+// most one handle per slot. Subscribing or unsubscribing builds a new array
+// and swaps it in, the old one is retired through CEpochManager. Readers
+// never lock: they find the topic in an open addressing table with atomic
+// entries and walk whatever array is current. Writers are serialised by a
+// mutex, which is fine since subscriptions change at human speed while
+// updates are published many times a second.
+//
+// Topic 0 is not a valid topic, it marks empty table entries.
+class CTopicIndex
+{
+	public:
+		using subscriber_list = std::vector<connection_handle>;
+
+		// nMaxClients is the size of the connection pool, slots index into it
+		explicit CTopicIndex(size_t nMaxClients);
+		CTopicIndex(const CTopicIndex&) = delete;
+		~CTopicIndex();
+
+		// Returns false if the client was subscribed already, or if the
+		// handle is older than one the slot has subscribed with since
+		bool subscribe(uint64_t nTopic, connection_handle client);
+		bool unsubscribe(uint64_t nTopic, connection_handle client);
+
+		// Drop every subscription held through the client's slot, whatever
+		// the generation. Called when the connection goes back to the pool
+		void unsubscribeAll(connection_handle client);
+
+		// Topics the client is subscribed to, none for a stale handle
+		std::vector<uint64_t> topicsOf(connection_handle client);
+
+		// Calls fn for every subscriber of the topic. Lock free, the handles
+		// may be stale and have to be resolved by the caller
+		template<typename F>
+		void forEach(uint64_t nTopic, F&& fn) const
+		{
+			epoch_guard guard;
+
+			const subscriber_list* pList = find(nTopic);
+			if (!pList)
+				return;
+
+			for (const connection_handle& client : *pList)
+				fn(client);
+		}
+
+		size_t subscribers(uint64_t nTopic) const;
+
+		// Topics with at least one subscriber
+		size_t topics() const { return m_nTopics.load(std::memory_order_relaxed); }
+
+	private:
+		struct topic_entry
+		{
+			std::atomic<uint64_t> nTopic{0};
+			std::atomic<const subscriber_list*> pList{nullptr};
+		};
+
+		struct topic_table
+		{
+			explicit topic_table(size_t nSize): vecEntries(nSize) {}
+			std::vector<topic_entry> vecEntries;
+		};
+
+		struct retired
+		{
+			const subscriber_list* pList;
+			topic_table* pTable;
+			uint64_t nEpoch;
+		};
+
+		// Subscriptions of one pool slot, so a closing connection can leave
+		// its topics without scanning all of them
+		struct client_topics
+		{
+			uint32_t nGeneration = 0;
+			std::vector<uint64_t> vecTopics;
+		};
+
+		const subscriber_list* find(uint64_t nTopic) const;
+
+		// Writer side, need m_mxWriters held
+		topic_entry& entry(uint64_t nTopic);
+		void replace(topic_entry& e, subscriber_list* pList);
+		bool remove(uint64_t nTopic, uint32_t nSlot);
+		void grow();
+		void reclaim();
+
+		static size_t slot(uint64_t nTopic, size_t nMask)
+		{
+			// Fibonacci hashing, like CKeyIndex
+			return size_t((nTopic * 0x9E3779B97F4A7C15ull) >> 32) & nMask;
+		}
+
+		std::atomic<topic_table*> m_pTable;
+
+		std::mutex m_mxWriters;
+		// Table entries in use, topics stay in the table after their last
+		// subscriber left until it grows
+		size_t m_nUsed = 0;
+		std::atomic<size_t> m_nTopics{0};
+		std::vector<client_topics> m_vecClients;
+		std::vector<retired> m_vecRetired;
+};
@@ -0,0 +1,206 @@
+#include "vehicle_codec.h"
+
+namespace
+{
+	// Raw layout: marker, 'V', then the fields in declaration order, little
+	// endian
+	constexpr size_t nRawSize = 2 + 4 + 4 + 4 + 4 + 2 + 2 + 1 + 8;
+
+	// Varint plus zigzag worst cases: 1 marker, 1 op, 1 mask, 7 fields
+	constexpr size_t nMaxEncoded = 3 + 5 + 5 + 5 + 5 + 3 + 3 + 1 + 10;
+
+	void putLE(char*& p, uint64_t nValue, size_t nBytes)
+	{
+		for (size_t i = 0; i < nBytes; i++)
+			*p++ = char(nValue >> (8 * i));
+	}
+
+	uint64_t getLE(const char*& p, size_t nBytes)
+	{
+		uint64_t nValue = 0;
+		for (size_t i = 0; i < nBytes; i++)
+			nValue |= uint64_t(uint8_t(*p++)) << (8 * i);
+		return nValue;
+	}
+
+	void putVarint(uint8_t*& p, uint64_t nValue)
+	{
+		while (nValue >= 0x80)
+		{
+			*p++ = uint8_t(nValue) | 0x80;
+			nValue >>= 7;
+		}
+		*p++ = uint8_t(nValue);
+	}
+
+	// Small differences either way become small unsigned numbers
+	uint64_t zigzag(int64_t nValue)
+	{
+		return (uint64_t(nValue) << 1) ^ uint64_t(nValue >> 63);
+	}
+
+	void putFull(uint8_t*& p, const vehicle_state& state)
+	{
+		*p++ = 'F';
+		putVarint(p, state.nVehicle);
+		putVarint(p, state.nRoute);
+		putVarint(p, zigzag(state.nLat));
+		putVarint(p, zigzag(state.nLon));
+		putVarint(p, state.nHeading);
+		putVarint(p, state.nSpeed);
+		*p++ = state.nOccupancy;
+		putVarint(p, state.nTime);
+	}
+}
+
+bool vehicle_frame::isRaw(const owned_message& msg)
+{
+	return msg.size() == nRawSize && msg.data()[1] == 'V';
+}
+
+owned_message vehicle_frame::encode(const vehicle_state& state)
+{
+	char aData[nRawSize];
+	char* p = aData;
+	*p++ = char(nMarker);
+	*p++ = 'V';
+	putLE(p, state.nVehicle, 4);
+	putLE(p, state.nRoute, 4);
+	putLE(p, uint32_t(state.nLat), 4);
+	putLE(p, uint32_t(state.nLon), 4);
+	putLE(p, state.nHeading, 2);
+	putLE(p, state.nSpeed, 2);
+	putLE(p, state.nOccupancy, 1);
+	putLE(p, state.nTime, 8);
+
+	owned_message msg(connection_handle(), aData, nRawSize);
+	msg.type = nMarker;
+	msg.key = state.nVehicle;
+	return msg;
+}
+
+vehicle_state vehicle_frame::decode(const owned_message& msg)
+{
+	vehicle_state state;
+	if (!isRaw(msg))
+		return state;
+
+	const char* p = msg.data() + 2;
+	state.nVehicle = uint32_t(getLE(p, 4));
+	state.nRoute = uint32_t(getLE(p, 4));
+	state.nLat = int32_t(uint32_t(getLE(p, 4)));
+	state.nLon = int32_t(uint32_t(getLE(p, 4)));
+	state.nHeading = uint16_t(getLE(p, 2));
+	state.nSpeed = uint16_t(getLE(p, 2));
+	state.nOccupancy = uint8_t(getLE(p, 1));
+	state.nTime = getLE(p, 8);
+	return state;
+}
+
+void vehicle_frame::toFull(owned_message& msg)
+{
+	if (msg.type != nMarker || !isRaw(msg))
+		return;
+
+	uint8_t aOut[nMaxEncoded];
+	uint8_t* p = aOut;
+	*p++ = nMarker;
+	putFull(p, decode(msg));
+	msg.assign(reinterpret_cast<const char*>(aOut), size_t(p - aOut));
+}
+
+void CVehicleEncoder::encode(owned_message& msg, uint64_t nNow, bool bDeltas)
+{
+	// Already encoded, or built by hand
+	if (!vehicle_frame::isRaw(msg))
+		return;
+
+	vehicle_state state = vehicle_frame::decode(msg);
+
+	last_sent* pLast = nullptr;
+	uint64_t nIndex;
+	if (m_index.find(uint64_t(state.nVehicle) + 1, nIndex))
+	{
+		pLast = &m_vecLast[nIndex];
+	}
+	else if (m_vecLast.size() < nMaxTracked)
+	{
+		m_index.insert(uint64_t(state.nVehicle) + 1, m_vecLast.size());
+		m_vecLast.emplace_back();
+		pLast = &m_vecLast.back();
+		pLast->nDeltas = nFullEvery;	// first one goes out in full
+	}
+
+	bool bFull = !bDeltas || !pLast || pLast->nDeltas >= nFullEvery || nNow - pLast->nSentAt > nFullAfter;
+
+	uint8_t aOut[nMaxEncoded];
+	uint8_t* p = aOut;
+	*p++ = vehicle_frame::nMarker;
+
+	if (bFull)
+	{
+		putFull(p, state);
+	}
+	else
+	{
+		const vehicle_state& last = pLast->state;
+		*p++ = 'D';
+		putVarint(p, state.nVehicle);
+
+		// Filled in once we know what changed
+		uint8_t* pMask = p++;
+		uint8_t nMask = 0;
+
+		if (state.nRoute != last.nRoute)
+		{
+			nMask |= vehicle_frame::nRouteChanged;
+			putVarint(p, state.nRoute);
+		}
+		if (state.nLat != last.nLat)
+		{
+			nMask |= vehicle_frame::nLatChanged;
+			putVarint(p, zigzag(int64_t(state.nLat) - last.nLat));
+		}
+		if (state.nLon != last.nLon)
+		{
+			nMask |= vehicle_frame::nLonChanged;
+			putVarint(p, zigzag(int64_t(state.nLon) - last.nLon));
+		}
+		if (state.nHeading != last.nHeading)
+		{
+			nMask |= vehicle_frame::nHeadingChanged;
+			putVarint(p, state.nHeading);
+		}
+		if (state.nSpeed != last.nSpeed)
+		{
+			nMask |= vehicle_frame::nSpeedChanged;
+			putVarint(p, state.nSpeed);
+		}
+		if (state.nOccupancy != last.nOccupancy)
+		{
+			nMask |= vehicle_frame::nOccupancyChanged;
+			*p++ = state.nOccupancy;
+		}
+		if (state.nTime != last.nTime)
+		{
+			nMask |= vehicle_frame::nTimeChanged;
+			putVarint(p, zigzag(int64_t(state.nTime - last.nTime)));
+		}
+		*pMask = nMask;
+	}
+
+	if (pLast)
+	{
+		pLast->state = state;
+		pLast->nSentAt = nNow;
+		pLast->nDeltas = bFull ? 0 : pLast->nDeltas + 1;
+	}
+
+	msg.assign(reinterpret_cast<const char*>(aOut), size_t(p - aOut));
+}
+
+void CVehicleEncoder::clear()
+{
+	m_index.clear();
+	m_vecLast.clear();
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "conflating_queue.h"
+#include "message.h"
+
+// Position report of one vehicle. Coordinates are fixed point in units of
+// 1e-7 degrees, which is about a centimetre
+struct vehicle_state
+{
+	uint32_t nVehicle = 0;
+	uint32_t nRoute = 0;
+	int32_t nLat = 0;
+	int32_t nLon = 0;
+	// Degrees, 0-359
+	uint16_t nHeading = 0;
+	// Centimetres per second
+	uint16_t nSpeed = 0;
+	uint8_t nOccupancy = 0;
+	// Milliseconds, any epoch as long as it is the same for every report
+	uint64_t nTime = 0;
+};
+
+// Vehicle states are queued as raw messages of this type, keyed by vehicle
+// so they conflate, and only encoded for the client when they are about to
+// be written: the encoding depends on what that client last got.
+//
+// On the wire, after the marker byte (the raw form has 'V' there):
+//
+//  'F' full record: vehicle, route, lat, lon, heading, speed as varints
+//      (lat and lon zigzag), occupancy as one byte, time as a varint
+//  'D' delta against the last record of the vehicle: vehicle as a varint,
+//      a byte saying which fields follow (see the n*Changed bits), then
+//      only those, coordinates and time as zigzag varint differences
+//
+// A client without capabilities::nDeltaEncoding only ever gets 'F'.
+//
+// Vehicles report in the raw form, which is binary, so only over
+// capabilities::nBinaryFraming: newline framing would split a report at any
+// 0x0A byte in its fields. Reports from other clients are ignored.
+struct vehicle_frame
+{
+	static constexpr uint8_t nMarker = 0x04;
+
+	static constexpr uint8_t nRouteChanged = 1u << 0;
+	static constexpr uint8_t nLatChanged = 1u << 1;
+	static constexpr uint8_t nLonChanged = 1u << 2;
+	static constexpr uint8_t nHeadingChanged = 1u << 3;
+	static constexpr uint8_t nSpeedChanged = 1u << 4;
+	static constexpr uint8_t nOccupancyChanged = 1u << 5;
+	static constexpr uint8_t nTimeChanged = 1u << 6;
+
+	// The raw message to hand to messageClient(), publish() and the like
+	static owned_message encode(const vehicle_state& state);
+	static vehicle_state decode(const owned_message& msg);
+
+	// Whether msg is in the raw form encode() makes, decode() takes only that
+	static bool isRaw(const owned_message& msg);
+
+	// Raw vehicle messages become an 'F' record, anything else is left as
+	// it is. For raw messages that leave the write path without going
+	// through a CVehicleEncoder, e.g. unsent ones kept for a session
+	static void toFull(owned_message& msg);
+};
+
+// Per connection memory of the last record written for each vehicle.
+// Asio thread only, like the rest of the connection's write side.
+class CVehicleEncoder
+{
+	public:
+		// A vehicle gets a full record again after this many deltas, or when
+		// nothing was sent for it for nFullAfter nanoseconds
+		static constexpr uint32_t nFullEvery = 32;
+		static constexpr uint64_t nFullAfter = 30000000000ull;
+
+		// Past this many vehicles new ones always go out in full
+		static constexpr size_t nMaxTracked = 4096;
+
+		// Replace the raw payload of msg by what goes on the wire
+		void encode(owned_message& msg, uint64_t nNow, bool bDeltas);
+
+		void clear();
+
+	private:
+		struct last_sent
+		{
+			vehicle_state state;
+			uint64_t nSentAt = 0;
+			uint32_t nDeltas = 0;
+		};
+
+		// Vehicle id + 1 to index into m_vecLast, 0 is no key
+		CKeyIndex m_index;
+		std::vector<last_sent> m_vecLast;
+};
@@ -0,0 +1,156 @@
+#include "worker_pool.h"
+#include "epoch.h"
+#include "server.h"
+#include "slab_allocator.h"
+
+CWorkerPool::CWorkerPool(size_t nWorkers, size_t nMailboxes, handler_t fnHandler, thread_init_t fnThreadInit):
+	m_fnHandler(std::move(fnHandler)), m_fnThreadInit(std::move(fnThreadInit)), m_vecMailboxes(nMailboxes)
+{
+	if (nWorkers == 0)
+		nWorkers = 1;
+
+	for (size_t i = 0; i < nWorkers; i++)
+		m_vecWorkers.push_back(std::make_unique<worker>());
+
+	// Only start once every deque exists, workers steal from each other
+	for (size_t i = 0; i < nWorkers; i++)
+		m_vecWorkers[i]->thread = std::thread([this, i]() { run(i); });
+}
+
+CWorkerPool::~CWorkerPool()
+{
+	{
+		std::unique_lock<std::mutex> ul(m_mxIdle);
+		m_bRunning = false;
+	}
+	m_cvIdle.notify_all();
+
+	for (auto& w : m_vecWorkers)
+	{
+		if (w->thread.joinable())
+			w->thread.join();
+	}
+}
+
+void CWorkerPool::post(size_t nMailbox, owned_message&& msg)
+{
+	if (nMailbox >= m_vecMailboxes.size())
+		nMailbox = 0;
+
+	mailbox* box = &m_vecMailboxes[nMailbox];
+	{
+		scoped_lock lock(box->mxQueue);
+		box->qMessages.push_back(std::move(msg));
+		if (box->bScheduled)
+			return;
+		box->bScheduled = true;
+	}
+
+	// Same client lands on the same worker unless someone steals it, which
+	// keeps its state warm in one cache
+	schedule(box, nMailbox % m_vecWorkers.size(), false);
+}
+
+void CWorkerPool::schedule(mailbox* box, size_t nWorker, bool bFront)
+{
+	worker& w = *m_vecWorkers[nWorker];
+	{
+		scoped_lock lock(w.mxDeque);
+		if (bFront)
+			w.deqReady.push_front(std::move(box));
+		else
+			w.deqReady.push_back(std::move(box));
+	}
+
+	{
+		std::unique_lock<std::mutex> ul(m_mxIdle);
+		m_nReady++;
+	}
+	m_cvIdle.notify_one();
+}
+
+CWorkerPool::mailbox* CWorkerPool::take(size_t nWorker)
+{
+	mailbox* box = nullptr;
+	{
+		worker& own = *m_vecWorkers[nWorker];
+		scoped_lock lock(own.mxDeque);
+		if (!own.deqReady.empty())
+		{
+			box = own.deqReady.back();
+			own.deqReady.pop_back();
+		}
+	}
+
+	for (size_t i = 1; !box && i < m_vecWorkers.size(); i++)
+	{
+		worker& victim = *m_vecWorkers[(nWorker + i) % m_vecWorkers.size()];
+		scoped_lock lock(victim.mxDeque);
+		if (!victim.deqReady.empty())
+		{
+			box = victim.deqReady.front();
+			victim.deqReady.pop_front();
+		}
+	}
+
+	if (box)
+		m_nReady--;
+	return box;
+}
+
+void CWorkerPool::drain(mailbox* box, size_t nWorker)
+{
+	// Handlers resolve connection handles, keep them valid for the batch
+	epoch_guard guard;
+
+	for (size_t n = 0; n < nBatchSize; n++)
+	{
+		owned_message msg;
+		{
+			scoped_lock lock(box->mxQueue);
+			if (box->qMessages.empty())
+			{
+				box->bScheduled = false;
+				return;
+			}
+			msg = std::move(box->qMessages.front());
+			box->qMessages.pop_front();
+		}
+
+		m_fnHandler(msg);
+	}
+
+	// Batch used up - if there is more, go to the back of the line so other
+	// clients on this worker get their turn
+	{
+		scoped_lock lock(box->mxQueue);
+		if (box->qMessages.empty())
+		{
+			box->bScheduled = false;
+			return;
+		}
+	}
+	schedule(box, nWorker, true);
+}
+
+void CWorkerPool::run(size_t nWorker)
+{
+	if (m_fnThreadInit)
+		m_fnThreadInit(nWorker);
+
+	while (m_bRunning)
+	{
+		mailbox* box = take(nWorker);
+		if (!box)
+		{
+			// Payload blocks freed here belong to the asio thread
+			CSlabAllocator::flush();
+
+			std::unique_lock<std::mutex> ul(m_mxIdle);
+			m_cvIdle.wait(ul, [this]() { return !m_bRunning || m_nReady > 0; });
+			continue;
+		}
+
+		drain(box, nWorker);
+	}
+}
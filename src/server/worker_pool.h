@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "message.h"
+#include "ring_buffer.h"
+
+// Runs message handlers on a set of worker threads while keeping the order
+// of messages from any one client.
+//
+// Every client gets a mailbox. A mailbox with messages in it is scheduled on
+// exactly one worker's deque at a time, so its messages are handled one
+// after the other. Workers take mailboxes from the back of their own deque
+// and, when that is empty, steal from the front of the others', which lets a
+// few busy clients spread over all cores.
+class CWorkerPool
+{
+	public:
+		using handler_t = std::function<void(owned_message&)>;
+
+		// Run first thing on every worker thread, e.g. to pin it
+		using thread_init_t = std::function<void(size_t nWorker)>;
+
+		// Messages handled per mailbox before it yields to the next one
+		static constexpr size_t nBatchSize = 32;
+
+		CWorkerPool(size_t nWorkers, size_t nMailboxes, handler_t fnHandler, thread_init_t fnThreadInit = nullptr);
+		CWorkerPool(const CWorkerPool&) = delete;
+		~CWorkerPool();
+
+		// Queue a message behind everything else in the mailbox
+		void post(size_t nMailbox, owned_message&& msg);
+
+		size_t workers() const { return m_vecWorkers.size(); }
+
+	private:
+		struct mailbox
+		{
+			std::mutex mxQueue;
+			ring_buffer<owned_message> qMessages;
+
+			// True while the mailbox sits in a deque or is being run
+			bool bScheduled = false;
+		};
+
+		struct worker
+		{
+			std::mutex mxDeque;
+			ring_buffer<mailbox*> deqReady;
+			std::thread thread;
+		};
+
+		void run(size_t nWorker);
+		void drain(mailbox* box, size_t nWorker);
+
+		// Own deque first, then steal round the others
+		mailbox* take(size_t nWorker);
+
+		// bFront puts the mailbox at the steal end of the deque
+		void schedule(mailbox* box, size_t nWorker, bool bFront);
+
+		handler_t m_fnHandler;
+		thread_init_t m_fnThreadInit;
+		std::vector<mailbox> m_vecMailboxes;
+		std::vector<std::unique_ptr<worker>> m_vecWorkers;
+
+		// Number of mailboxes sitting in deques, workers sleep when it is 0.
+		// Signed, a thief may take a mailbox before its push was counted
+		std::atomic<int64_t> m_nReady{0};
+		std::atomic<bool> m_bRunning{true};
+		std::mutex m_mxIdle;
+		std::condition_variable m_cvIdle;
+};